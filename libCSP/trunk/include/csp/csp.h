@@ -215,7 +215,7 @@ typedef union {
 #define CSP_FRES1			0x80 				// Reserved for future use
 #define CSP_FRES2			0x40 				// Reserved for future use
 #define CSP_FRES3			0x20 				// Reserved for future use
-#define CSP_FRES4			0x10 				// Reserved for future use
+#define CSP_FFRAG			0x10 				// Packet is a fragment, see CSP_USE_FRAG
 #define CSP_FHMAC 			0x08 				// Use HMAC verification
 #define CSP_FXTEA 			0x04 				// Use XTEA encryption
 #define CSP_FRDP			0x02 				// Use RDP protocol
@@ -232,6 +232,8 @@ typedef union {
 #define CSP_SO_CRC32REQ		0x0040				// Require CRC32
 #define CSP_SO_CRC32PROHIB	0x0080				// Prohibit CRC32
 #define CSP_SO_CONN_LESS	0x0100				// Enable Connection Less mode
+#define CSP_SO_REUSEPORT	0x0200				// Allow several sockets to bind the same port
+#define CSP_SO_RDPFASTOPEN	0x0400				// Accept RDP data sent before the handshake completes
 
 /** CSP Connect options */
 #define CSP_O_NONE  		CSP_SO_NONE			// No connection options
@@ -243,6 +245,7 @@ typedef union {
 #define CSP_O_NOXTEA		CSP_SO_XTEAPROHIB	// Disable XTEA
 #define CSP_O_CRC32			CSP_SO_CRC32REQ		// Enable CRC32
 #define CSP_O_NOCRC32		CSP_SO_CRC32PROHIB	// Disable CRC32
+#define CSP_O_RDPFASTOPEN	CSP_SO_RDPFASTOPEN	// Send RDP data behind the SYN to ports that accepted it before
 
 /* Default padding size is 8 bytes */
 #ifndef CSP_PADDING_BYTES
@@ -269,6 +272,9 @@ typedef struct __attribute__((__packed__)) {
 /** Next hop function prototype */
 typedef int (*nexthop_t)(csp_packet_t * packet, unsigned int timeout);
 
+/** Batch next hop function prototype, returns number of packets accepted */
+typedef int (*nexthop_many_t)(csp_packet_t ** packets, unsigned int count, unsigned int timeout);
+
 /** Interface struct */
 typedef struct csp_iface_s {
     const char * name;			/**< Interface name */
@@ -285,9 +291,54 @@ typedef struct csp_iface_s {
     uint32_t frame;				/**< Frame format errors */
     uint32_t txbytes;			/**< Transmitted bytes */
     uint32_t rxbytes;			/**< Received bytes */
+    nexthop_many_t nexthop_many;	/**< Optional batch next hop function */
     struct csp_iface_s * next;	/**< Next interface */
 } csp_iface_t;
 
+/**
+ * Connection statistics. Transmit counters are added atomically, as several
+ * tasks may send on a connection. Receive and RDP event counters are only
+ * incremented by the router task. The RDP round trip, timeout and congestion
+ * values are stored as whole words by the router task and by csp_connect.
+ * Each field can therefore be read at any time, but a copy is not an atomic
+ * snapshot of all fields.
+ */
+typedef struct {
+    uint32_t tx;				/**< Packets sent by user */
+    uint32_t txbytes;			/**< Bytes sent by user */
+    uint32_t rx;				/**< Packets delivered to user */
+    uint32_t rxbytes;			/**< Bytes delivered to user */
+    uint32_t drop;				/**< Packets dropped due to full RX queue */
+    uint32_t rxq_max;			/**< Highest number of packets waiting in RX queue */
+    uint32_t retransmits;		/**< RDP segments retransmitted on timeout */
+    uint32_t fast_retransmits;	/**< RDP segments retransmitted early, as reported missing by EACK */
+    uint32_t eack_tx;			/**< RDP EACKs sent */
+    uint32_t eack_rx;			/**< RDP EACKs received */
+    uint32_t acks_piggybacked;	/**< RDP ACKs not sent, because a data segment carried them */
+    uint32_t rtt;				/**< RDP smoothed round trip time in ms, 0 if not measured */
+    uint32_t rttvar;			/**< RDP round trip time variation in ms */
+    uint32_t rto;				/**< RDP current retransmission timeout in ms, including backoff */
+    uint32_t cwnd;				/**< RDP congestion window in segments, 0 without CSP_RDP_CC */
+    uint32_t ssthresh;			/**< RDP slow start threshold in segments, 0 without CSP_RDP_CC */
+} csp_conn_stats_t;
+
+/** Connection statistics entry, as returned by csp_conn_stats_next */
+typedef struct {
+    csp_id_t idin;				/**< Identifier received */
+    csp_id_t idout;				/**< Identifier transmitted */
+    uint32_t age;				/**< Time since connection was opened in ms */
+    csp_conn_stats_t stats;		/**< Connection counters */
+} csp_conn_info_t;
+
+/** Fragmentation counters, as returned by csp_frag_get_stats */
+typedef struct {
+    uint32_t tx;				/**< Fragments sent */
+    uint32_t rx;				/**< Fragments received */
+    uint32_t reassembled;		/**< Packets reassembled */
+    uint32_t timeout;			/**< Packets dropped because fragments were missing */
+    uint32_t drop;				/**< Fragments or packets dropped, invalid or table full */
+} csp_frag_stats_t;
+
 /**
  * This define must be equal to the size of the packet overhead in csp_packet_t.
  * It is used in csp_buffer_get() to check the allocated buffer size against
@@ -300,6 +351,16 @@ typedef struct csp_socket_s csp_socket_t;
 typedef struct csp_conn_s csp_conn_t;
 typedef struct csp_l4data_s csp_l4data_t;
 
+/** csp_conn_set_max
+ * Set the number of connections in the connection pool. Must be called before
+ * csp_init, otherwise CSP_CONN_MAX connections are available. The pool itself
+ * is allocated by csp_init, and the queues of each connection are created the
+ * first time it is used.
+ * @param count Maximum number of simultaneous connections
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if already initialised
+ */
+int csp_conn_set_max(unsigned int count);
+
 /** csp_init
  * Start up the can-space protocol
  * @param my_node_address The CSP node address
@@ -333,6 +394,118 @@ csp_conn_t * csp_accept(csp_socket_t * socket, unsigned int timeout);
  */
 csp_packet_t * csp_read(csp_conn_t * conn, unsigned int timeout);
 
+/**
+ * Read several packets from a connection
+ * Blocks until at least one packet is available, then returns as many
+ * queued packets as fit in the array without blocking again.
+ * Packets are returned in the same order as repeated calls to csp_read would.
+ * Where csp_read would return NULL because the connection was closed by the
+ * transport layer, the batch ends, and the next call returns 0.
+ * @param conn pointer to connection
+ * @param packets array to store packet pointers in
+ * @param max size of packets array
+ * @param timeout timeout in ms to wait for the first packet
+ * @return number of packets read, which you MUST free yourself, or 0 on timeout or close
+ */
+int csp_read_many(csp_conn_t * conn, csp_packet_t ** packets, int max, unsigned int timeout);
+
+/** csp_poll events */
+#define CSP_POLLIN			0x01				// Packet can be read, or connection accepted
+#define CSP_POLLHUP			0x02				// Connection was closed by remote end
+
+/** Connection or socket to wait for with csp_poll */
+typedef struct {
+	csp_conn_t * conn;			/**< Connection to poll, or NULL */
+	csp_socket_t * socket;		/**< Socket to poll, or NULL */
+	uint8_t events;				/**< Requested events */
+	uint8_t revents;			/**< Returned events, CSP_POLLHUP is always reported */
+} csp_pollfd_t;
+
+/**
+ * Wait until any of a set of connections and sockets is ready
+ * A connection is readable when csp_read will return a packet. A socket is
+ * readable when csp_accept or csp_recvfrom will return. All objects share
+ * one wait object, so a single task can serve many connections. Only one
+ * task can poll an object at a time, CSP_ERR_BUSY is returned if another
+ * task is waiting on one of the objects.
+ * @param fds array of connections and sockets to poll
+ * @param nfds number of entries in fds
+ * @param timeout timeout in ms, use CSP_MAX_DELAY for infinite blocking time
+ * @return number of entries with events, 0 on timeout, or an error code
+ */
+int csp_poll(csp_pollfd_t * fds, unsigned int nfds, unsigned int timeout);
+
+/**
+ * Receive callback
+ * The callback owns the packet, and must free it or reuse it. For a
+ * connection, the callback also owns the connection and must close it with
+ * csp_close when done, also when called with a NULL packet, which means the
+ * remote end closed the connection. For connection-less sockets conn is NULL.
+ * @param conn connection the packet was received on, NULL if connection-less
+ * @param packet received packet, NULL if the connection was closed
+ * @param arg argument given when the callback was set
+ */
+typedef void (*csp_callback_t)(csp_conn_t * conn, csp_packet_t * packet, void * arg);
+
+/**
+ * Set receive callback of a socket
+ * Connection-less packets are passed to the callback instead of being
+ * queued for csp_recvfrom. New connections get the socket callback and are
+ * not queued for csp_accept. Callbacks run in the router task, unless
+ * executor tasks have been started with csp_callback_start_tasks.
+ * @param socket Socket to set callback on
+ * @param callback Function to call, NULL to go back to csp_accept/csp_recvfrom
+ * @param arg Argument passed to callback
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_socket_set_callback(csp_socket_t * socket, csp_callback_t callback, void * arg);
+
+/**
+ * Set receive callback of a connection
+ * Packets are passed to the callback instead of being read with csp_read,
+ * starting with any packets already queued.
+ * @param conn Connection to set callback on
+ * @param callback Function to call, NULL to go back to csp_read
+ * @param arg Argument passed to callback
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_conn_set_callback(csp_conn_t * conn, csp_callback_t callback, void * arg);
+
+/**
+ * Start CSP_CALLBACK_THREADS executor tasks to run receive callbacks.
+ * Without executors, callbacks run in the router task. Callbacks of one
+ * connection or socket always run in the same task, in packet order.
+ * Start executors before any callbacks are set.
+ * @param task_stack_size The number of portStackType to allocate. This only affects FreeRTOS systems.
+ * @param priority The OS task priority of the executors
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_callback_start_tasks(unsigned int task_stack_size, unsigned int priority);
+
+#if CSP_USE_EVENTFD
+/**
+ * Get eventfd signalling that a connection is readable
+ * The fd becomes readable when a packet is queued on an empty connection,
+ * and can be added to epoll, select or io_uring. When it fires, call
+ * csp_read with zero timeout until it returns NULL, this also clears the
+ * fd. A closed connection makes the fd readable too, use csp_poll with
+ * zero timeout to tell it apart. Remove the fd from epoll before calling
+ * csp_close, the fd is owned by CSP and reused with the connection.
+ * @param conn pointer to connection
+ * @return file descriptor, or an error code
+ */
+int csp_conn_fd(csp_conn_t * conn);
+
+/**
+ * Get eventfd signalling that a socket has a connection to accept, or
+ * a packet to receive if connection-less
+ * Call csp_accept or csp_recvfrom with zero timeout until it returns NULL.
+ * @param socket pointer to socket
+ * @return file descriptor, or an error code
+ */
+int csp_socket_fd(csp_socket_t * socket);
+#endif
+
 /**
  * Send a packet on an already established connection
  * @param conn pointer to connection
@@ -342,10 +515,51 @@ csp_packet_t * csp_read(csp_conn_t * conn, unsigned int timeout);
  */
 int csp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout);
 
+/**
+ * Send several packets on an already established connection
+ * The route is looked up once for the whole batch, and interfaces with a
+ * nexthop_many function receive the packets in one call. On RDP connections
+ * as many packets as the send window allows are queued before transmission.
+ * @param conn pointer to connection
+ * @param packets array of packets to send, in order
+ * @param count number of packets in array
+ * @param timeout a timeout to wait for TX to complete
+ * @return number of packets sent. On RDP connections this includes packets
+ * that reached the send window but not the interface, as RDP retransmits
+ * them. Packets from this index onward were not sent, and you MUST free them yourself.
+ */
+int csp_send_many(csp_conn_t * conn, csp_packet_t ** packets, unsigned int count, unsigned int timeout);
+
+/**
+ * Write a byte stream to a connection
+ * The data is split into the largest segments that fit in a buffer and the
+ * MTU of the outgoing interface, after RDP header and HMAC, CRC32 and XTEA
+ * trailers. On RDP connections the call blocks while the send window is full.
+ * Segment boundaries are not preserved, use csp_stream_read on the other end.
+ * @param conn pointer to connection
+ * @param buf data to write
+ * @param len number of bytes to write
+ * @param timeout timeout in ms to wait for each segment to be sent
+ * @return number of bytes written, which is less than len if a segment could not be sent or the buffer pool ran out, or an error code if nothing was written
+ */
+int csp_stream_write(csp_conn_t * conn, const void * buf, size_t len, unsigned int timeout);
+
+/**
+ * Read a byte stream from a connection
+ * Packet data is copied directly into buf. A packet that does not fit is
+ * kept by the connection and returned by the next call.
+ * @param conn pointer to connection
+ * @param buf buffer to read into
+ * @param len number of bytes to read
+ * @param timeout timeout in ms for the whole call
+ * @return number of bytes read, which is less than len if the timeout passed or the connection was closed
+ */
+int csp_stream_read(csp_conn_t * conn, void * buf, size_t len, unsigned int timeout);
+
 /**
  * Perform an entire request/reply transaction
  * Copies both input buffer and reply to output buffeer.
- * Also makes the connection and closes it again
+ * Same as calling csp_transaction2 with no connection options.
  * @param prio CSP Prio
  * @param dest CSP Dest
  * @param port CSP Port
@@ -358,6 +572,36 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout);
  */
 int csp_transaction(uint8_t prio, uint8_t dest, uint8_t port, unsigned int timeout, void * outbuf, int outlen, void * inbuf, int inlen);
 
+/**
+ * Perform an entire request/reply transaction with connection options
+ * If CSP_CONN_CACHE_SIZE is nonzero, connections are cached by
+ * (prio, dest, port, opts) for reuse by later transactions. This requires
+ * servers that keep the connection open for further requests, instead of
+ * closing it after each reply. A cached connection is closed after
+ * CSP_CONN_CACHE_TIMEOUT ms idle, when the cache is full and a newer
+ * connection is cached, or when the connection pool runs out. A connection
+ * is only cached if the transaction succeeded, so a late reply can never be
+ * read by the next one. If a transaction on a cached connection fails, it
+ * is tried once more on a new connection.
+ * @param prio CSP Prio
+ * @param dest CSP Dest
+ * @param port CSP Port
+ * @param timeout timeout in ms
+ * @param outbuf pointer to outgoing data buffer
+ * @param outlen length of request to send
+ * @param inbuf pointer to incoming data buffer
+ * @param inlen length of expected reply, -1 for unknown size (note inbuf MUST be large enough)
+ * @param opts Connection options, see csp_connect
+ * @return Return 1 or reply size if successful, 0 if error or incoming length does not match or -1 if timeout was reached
+ */
+int csp_transaction2(uint8_t prio, uint8_t dest, uint8_t port, unsigned int timeout, void * outbuf, int outlen, void * inbuf, int inlen, uint32_t opts);
+
+/**
+ * Close all idle connections kept by the connection cache
+ * @return Number of connections closed
+ */
+int csp_conn_cache_flush(void);
+
 /**
  * Use an existing connection to perform a transaction,
  * This is only possible if the next packet is on the same port and destination!
@@ -444,6 +688,32 @@ int csp_conn_src(csp_conn_t * conn);
  */
 int csp_conn_flags(csp_conn_t * conn);
 
+/**
+ * Copy statistics of a connection
+ * @param conn pointer to connection structure
+ * @param stats pointer to statistics to fill
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_conn_stats(csp_conn_t * conn, csp_conn_stats_t * stats);
+
+/**
+ * Iterate statistics of all open connections. Set index to 0 before the
+ * first call, and call again until 0 is returned. Nothing is printed and
+ * no locks are taken, so this can be used in release builds.
+ * @param index iterator position, updated on each call
+ * @param info pointer to entry to fill
+ * @return 1 if info was filled, 0 when there are no more open connections
+ */
+int csp_conn_stats_next(int * index, csp_conn_info_t * info);
+
+#if CSP_USE_FRAG
+/**
+ * Get fragmentation and reassembly counters
+ * @param stats pointer to struct to fill
+ */
+void csp_frag_get_stats(csp_frag_stats_t * stats);
+#endif
+
 /**
  * Set socket to listen for incoming connections
  * @param socket Socket to enable listening on
@@ -454,6 +724,11 @@ int csp_listen(csp_socket_t * socket, size_t conn_queue_length);
 
 /**
  * Bind port to socket
+ * Several sockets can bind the same port if they are all created with
+ * CSP_SO_REUSEPORT and the same options. New connections and connection-less
+ * packets are then spread across the sockets by a hash of the source address
+ * and port, so each socket can be served by its own task. All packets from
+ * one source port go to the same socket.
  * @param socket Socket to bind port to
  * @param port Port number to bind
  * @return 0 on success, -1 on error.
@@ -481,6 +756,8 @@ int csp_route_start_task(unsigned int task_stack_size, unsigned int priority);
  * If enabled, a copy of all incoming packets are placed in a queue
  * that can be read with csp_promisc_get(). Not all interface drivers
  * support promiscuous mode.
+ * The queue is a promiscuous mode tap without filter, so when the reader
+ * falls behind, the oldest packets are overwritten.
  *
  * @param buf_size Size of buffer for incoming packets
  */
@@ -503,6 +780,73 @@ void csp_promisc_disable(void);
  */
 csp_packet_t * csp_promisc_read(unsigned int timeout);
 
+/** Promiscuous mode capture directions */
+#define CSP_PROMISC_IN		0			// Packet entered the router
+#define CSP_PROMISC_OUT		1			// Packet was sent on an interface
+
+/** Promiscuous mode capture record */
+typedef struct {
+	uint32_t tv_sec;			/**< Capture time, seconds */
+	uint32_t tv_usec;			/**< Capture time, microseconds */
+	csp_iface_t * interface;	/**< Interface the packet was seen on */
+	uint8_t direction;			/**< CSP_PROMISC_IN or CSP_PROMISC_OUT */
+	uint16_t length;			/**< Length of packet data */
+	uint16_t caplen;			/**< Number of data bytes captured */
+	csp_id_t id;				/**< CSP identifier */
+	uint8_t data[0];			/**< Captured data, caplen bytes */
+} csp_promisc_record_t;
+
+/** Forward declaration of promiscuous mode tap */
+typedef struct csp_promisc_tap_s csp_promisc_tap_t;
+
+/**
+ * Open a promiscuous mode tap
+ * A tap is a ring of capture records, which is written by the router
+ * without locking. When the ring is full, the oldest record is overwritten.
+ * Only packets where (packet->id.ext & mask) == (id & mask) are captured,
+ * so pass a mask of 0 to capture everything. Up to CSP_PROMISC_TAPS
+ * taps can be open at the same time.
+ *
+ * @param slots Number of records in the ring
+ * @param snaplen Maximum number of data bytes captured per packet
+ * @param id Identifier to match
+ * @param mask Identifier bits to compare, e.g. CSP_ID_DST_MASK | CSP_ID_DPORT_MASK
+ * @return Pointer to tap on success, NULL on failure
+ */
+csp_promisc_tap_t * csp_promisc_tap_open(unsigned int slots, unsigned int snaplen, uint32_t id, uint32_t mask);
+
+/**
+ * Close a promiscuous mode tap and free its memory
+ * @param tap Tap to close
+ */
+void csp_promisc_tap_close(csp_promisc_tap_t * tap);
+
+/**
+ * Pause or resume capturing on a tap
+ * @param tap Tap to enable or disable
+ * @param enable 1 to capture, 0 to pause
+ */
+void csp_promisc_tap_enable(csp_promisc_tap_t * tap, int enable);
+
+/**
+ * Read the oldest record from a tap
+ * Only one task may read from a tap at a time.
+ *
+ * @param tap Tap to read from
+ * @param record Pointer to record storage, including room for data
+ * @param size Size of record storage in bytes
+ * @param timeout Timeout in ms to wait for a new record
+ * @return Number of data bytes copied, or CSP_ERR_TIMEDOUT if no record was available
+ */
+int csp_promisc_tap_read(csp_promisc_tap_t * tap, csp_promisc_record_t * record, unsigned int size, unsigned int timeout);
+
+/**
+ * Get number of records that were overwritten before they could be read
+ * @param tap Tap to query
+ * @return Number of lost records
+ */
+uint32_t csp_promisc_tap_lost(csp_promisc_tap_t * tap);
+
 /**
  * If the given packet is a service-request (that is uses one of the csp service ports)
  * it will be handled according to the CSP service handler.
@@ -593,6 +937,22 @@ void csp_rdp_get_opt(unsigned int * window_size, unsigned int * conn_timeout_ms,
 		unsigned int * packet_timeout_ms, unsigned int * delayed_acks,
 		unsigned int * ack_timeout, unsigned int * ack_delay_count);
 
+/**
+ * Set the largest RDP window accepted for new connections, in both
+ * directions. A larger window offered by the other end is reduced to this
+ * value in the SYN/ACK. The retransmit and receive rings and the RX queues
+ * of a connection are allocated to match the negotiated window.
+ * @param max_window Maximum window size in segments, 1 to 4096
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if out of range
+ */
+int csp_rdp_set_max_window(unsigned int max_window);
+
+/**
+ * Get the largest RDP window accepted for new connections
+ * @return Maximum window size in segments
+ */
+unsigned int csp_rdp_get_max_window(void);
+
 /**
  * Set XTEA key
  * @param key Pointer to key array
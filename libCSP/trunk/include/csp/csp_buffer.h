@@ -73,6 +73,12 @@ void * csp_buffer_clone(void * buffer);
  */
 int csp_buffer_remaining(void);
 
+/**
+ * Return the number of data bytes that fit in one buffer element.
+ * @return maximum packet data size
+ */
+int csp_buffer_data_size(void);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
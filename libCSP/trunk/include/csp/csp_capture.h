@@ -0,0 +1,66 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_CAPTURE_H_
+#define _CSP_CAPTURE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+#if CSP_USE_PROMISC
+/**
+ * Start capturing packets to a pcapng file
+ * Received, routed and sent packets matching the filter are written by a
+ * background task, using link type CSP_CAPTURE_LINKTYPE. Each record holds
+ * the CSP identifier in network byte order, followed by the packet data.
+ * Only one capture can be active at a time.
+ *
+ * @param filename Path of capture file, overwritten if it exists
+ * @param snaplen Maximum number of data bytes to capture per packet
+ * @param id Identifier to match
+ * @param mask Identifier mask, use 0 to capture all packets
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if snaplen exceeds UINT16_MAX, otherwise an error code
+ */
+int csp_capture_start(const char * filename, unsigned int snaplen, uint32_t id, uint32_t mask);
+
+/**
+ * Stop capture, write out remaining records and close the capture file
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if no capture is active
+ */
+int csp_capture_stop(void);
+
+/**
+ * Number of packets dropped because the capture task fell behind, or
+ * because they passed more than CSP_CAPTURE_IFACES different interfaces
+ * @return Number of lost packets in the active capture
+ */
+uint32_t csp_capture_lost(void);
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_CAPTURE_H_
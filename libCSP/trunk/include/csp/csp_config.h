@@ -47,8 +47,16 @@ extern "C" {
 #ifdef CSP_DFL_CONFIG
 /* General config */
 #define CSP_DEBUG			   	0	   	// Enable/disable debugging output
-#define CSP_CONN_MAX			10  	// Number of statically allocated connection structs
+#define CSP_CONN_MAX			10  	// Default number of connection structs, see csp_conn_set_max
 #define CSP_CONN_QUEUE_LENGTH	100		// Number of packets potentially in queue for a connection
+#define CSP_POLL_WAITERS		4		// Maximum number of tasks in csp_poll at the same time
+#define CSP_USE_EVENTFD			0		// Expose connections and sockets as eventfds (Linux only)
+#define CSP_CALLBACK_THREADS	2		// Number of receive callback executor tasks, see csp_callback_start_tasks
+#define CSP_CALLBACK_QUEUE_LENGTH 32	// Connections and sockets with callbacks pending per executor
+#define CSP_TIMER_RESOLUTION	10		// Resolution of connection timers in ms
+#define CSP_CONN_CACHE_SIZE		0		// Idle connections kept by csp_transaction for reuse, servers must keep them open (0 to disable)
+#define CSP_CONN_CACHE_TIMEOUT	5000	// Close cached connections after this many ms idle
+#define CSP_MUX_INFLIGHT		8		// Maximum outstanding requests per multiplexed connection, see csp_mux.h
 #define CSP_FIFO_INPUT			100		// Number of packets to be queued at the input of the router
 #define CSP_MAX_BIND_PORT		15		// Highest incoming port number to bind to (must be below (2^CSP_ID_PORT_SIZE)-1)
 #define CSP_RANDOMIZE_EPHEM		1		// Randomize initial ephemeral port
@@ -57,10 +65,17 @@ extern "C" {
 /* Transport layer config */
 #define CSP_USE_RDP				1		// Enable RDP transport protocol
 #define CSP_DELAY_ACKS			1		// Use delayed acknowledgements
-#define CSP_RDP_MAX_WINDOW		20		// Maximum RDP window size
+#define CSP_RDP_MAX_WINDOW		20		// Default maximum RDP window size, see csp_rdp_set_max_window
+#define CSP_RDP_CC				1		// Limit RDP send window by an AIMD congestion window
 
 /* Router config */
 #define CSP_USE_PROMISC			1		// Enable promiscuous mode functions
+#define CSP_PROMISC_TAPS		4		// Maximum number of open promiscuous mode taps
+#define CSP_CAPTURE_SLOTS		256		// Number of records buffered by the pcapng capture task
+#define CSP_CAPTURE_LINKTYPE	147		// pcapng link type for CSP captures (LINKTYPE_USER0)
+#define CSP_USE_FRAG			1		// Fragment packets larger than the interface MTU
+#define CSP_FRAG_SLOTS			4		// Packets reassembled at the same time
+#define CSP_FRAG_TIMEOUT		2000	// Drop incomplete packets after this many ms
 
 /* Buffer config */
 #define CSP_BUFFER_CALLOC		0		// Set to 1 to clear buffer at allocation
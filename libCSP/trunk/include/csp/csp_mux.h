@@ -0,0 +1,128 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_MUX_H_
+#define _CSP_MUX_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+/**
+ * Multiplexed transactions
+ * Many requests can be outstanding on one connection at the same time.
+ * Every request and reply starts with a 16 bit request id in network byte
+ * order, which is used to match replies to requests, so the server may
+ * answer requests in any order. Replies are received through the connection
+ * callback, see csp_conn_set_callback, so either executor tasks must be
+ * started or the router task must be running.
+ */
+
+/** Size of request id header */
+#define CSP_MUX_HEADER_SIZE		2
+
+/** Multiplexed connection handle */
+typedef struct csp_mux_s csp_mux_t;
+
+/** Outstanding request handle */
+typedef struct csp_mux_req_s csp_mux_req_t;
+
+/**
+ * Request completion callback
+ * Called from a callback executor or the router task, and must not block.
+ * @param status CSP_ERR_NONE if a reply was received, CSP_ERR_TIMEDOUT if the request timed out, CSP_ERR_RESET if the connection was closed
+ * @param reply Reply without request id header, which you MUST free, or NULL if status is not CSP_ERR_NONE
+ * @param arg Argument given to csp_mux_request
+ */
+typedef void (*csp_mux_callback_t)(int status, csp_packet_t * reply, void * arg);
+
+/**
+ * Open a multiplexed connection
+ * @param prio Connection priority
+ * @param dest Destination address
+ * @param port Destination port
+ * @param timeout Timeout in ms for connection setup
+ * @param opts Connection options, see csp_connect. CSP_O_RDP is recommended.
+ * @return Multiplexed connection, or NULL on failure
+ */
+csp_mux_t * csp_mux_open(uint8_t prio, uint8_t dest, uint8_t port, unsigned int timeout, uint32_t opts);
+
+/**
+ * Close multiplexed connection
+ * Outstanding requests complete with CSP_ERR_RESET. Requests without a
+ * callback must still be collected with csp_mux_wait before this is called.
+ * Waits for request callbacks that are running, so it must not be called
+ * from a request callback.
+ * @param mux Multiplexed connection
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_mux_close(csp_mux_t * mux);
+
+/**
+ * Send request
+ * Blocks while CSP_MUX_INFLIGHT requests are outstanding. The request id
+ * header is added in front of the packet data, so the packet must have room
+ * for CSP_MUX_HEADER_SIZE more bytes.
+ * @param mux Multiplexed connection
+ * @param packet Request packet, owned by CSP if the call succeeds
+ * @param timeout Timeout in ms for both sending and the reply
+ * @param callback Function to call when the request completes, or NULL to collect the result with csp_mux_wait
+ * @param arg Argument passed to callback
+ * @return Request handle, or NULL on failure, in which case you MUST free the packet yourself
+ */
+csp_mux_req_t * csp_mux_request(csp_mux_t * mux, csp_packet_t * packet, unsigned int timeout, csp_mux_callback_t callback, void * arg);
+
+/**
+ * Wait for a request sent without callback to complete
+ * Blocks until the reply arrives or the request timeout passes. The request
+ * handle is released and must not be used again.
+ * @param req Request handle returned by csp_mux_request
+ * @param reply Set to the reply without request id header, which you MUST free, or NULL on error
+ * @return CSP_ERR_NONE if a reply was received, otherwise an error code
+ */
+int csp_mux_wait(csp_mux_req_t * req, csp_packet_t ** reply);
+
+/**
+ * Remove request id header from a received request, for use by servers
+ * @param packet Received request
+ * @param id Set to the request id, to be passed to csp_mux_reply
+ * @return CSP_ERR_NONE on success, CSP_ERR_INVAL if the packet is too short
+ */
+int csp_mux_get_id(csp_packet_t * packet, uint16_t * id);
+
+/**
+ * Send reply to a multiplexed request, for use by servers
+ * @param conn Connection the request was received on
+ * @param packet Reply packet, may be the request packet. Owned by CSP if the call succeeds.
+ * @param id Request id returned by csp_mux_get_id
+ * @param timeout Timeout in ms to wait for TX to complete
+ * @return 1 if successful and 0 otherwise, in which case you MUST free the packet yourself
+ */
+int csp_mux_reply(csp_conn_t * conn, csp_packet_t * packet, uint16_t id, unsigned int timeout);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_MUX_H_
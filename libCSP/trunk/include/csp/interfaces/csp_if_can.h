@@ -63,6 +63,18 @@ struct can_at91sam7a3_conf {
  */
 int csp_can_tx(csp_packet_t * packet, unsigned int timeout);
 
+/**
+ * CAN interface batch transmit function
+ * The first frames of several packets are queued before waiting for any
+ * packet to complete. A packet that was accepted belongs to the driver,
+ * also if waiting for it timed out.
+ * @param packets Packets to transmit, in order
+ * @param count Number of packets
+ * @param timeout Timeout in ms for the whole batch
+ * @return Number of packets accepted
+ */
+int csp_can_tx_many(csp_packet_t ** packets, unsigned int count, unsigned int timeout);
+
 /**
  * Init CAN interface
  * @param mode Must be either CSP_CAN_MASKED or CSP_CAN_PROMISC
@@ -28,5 +28,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 csp_iface_t csp_if_lo;
 
 int csp_lo_tx(csp_packet_t * packet, unsigned int timeout);
+int csp_lo_tx_many(csp_packet_t ** packets, unsigned int count, unsigned int timeout);
 
 #endif // _CSP_IF_LO_H_
@@ -38,6 +38,9 @@ void csp_queue_remove(csp_queue_handle_t queue);
 int csp_queue_enqueue(csp_queue_handle_t handle, void *value, int timeout);
 int csp_queue_enqueue_isr(csp_queue_handle_t handle, void * value, CSP_BASE_TYPE * task_woken);
 int csp_queue_dequeue(csp_queue_handle_t handle, void *buf, int timeout);
+/* Dequeue up to max items, waiting only for the first. Returns number of items.
+ * item_size must match the queue, FreeRTOS does not expose it. */
+int csp_queue_dequeue_many(csp_queue_handle_t handle, void * buf, size_t item_size, int max, int timeout);
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken);
 int csp_queue_size(csp_queue_handle_t handle);
 int csp_queue_size_isr(csp_queue_handle_t handle);
@@ -32,8 +32,10 @@ extern "C" {
 #if defined(_CSP_POSIX_)
 
 #include <pthread.h>
+#include <unistd.h>
 
 #define csp_thread_exit() pthread_exit(NULL)
+#define csp_sleep_ms(time_ms) usleep((time_ms) * 1000)
 
 typedef pthread_t csp_thread_handle_t;
 typedef void* csp_thread_return_t;
@@ -47,6 +49,7 @@ typedef void* csp_thread_return_t;
 #include <freertos/task.h>
 
 #define csp_thread_exit() vTaskDelete(NULL)
+#define csp_sleep_ms(time_ms) vTaskDelay((time_ms) / portTICK_RATE_MS)
 
 typedef xTaskHandle csp_thread_handle_t;
 typedef void csp_thread_return_t;
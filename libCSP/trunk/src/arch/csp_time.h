@@ -49,6 +49,7 @@ uint32_t csp_get_ms(void);
 uint32_t csp_get_ms_isr(void);
 uint32_t csp_get_s(void);
 uint32_t csp_get_s_isr(void);
+void csp_get_timestamp(uint32_t * sec, uint32_t * usec);
 
 #ifdef __cplusplus
 } /* extern "C" */
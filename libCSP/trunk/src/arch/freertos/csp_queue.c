@@ -49,6 +49,15 @@ int csp_queue_dequeue(csp_queue_handle_t handle, void * buf, int timeout) {
     return xQueueReceive(handle, buf, timeout / portTICK_RATE_MS);
 }
 
+int csp_queue_dequeue_many(csp_queue_handle_t handle, void * buf, size_t item_size, int max, int timeout) {
+    int count = 0;
+    if (max > 0 && xQueueReceive(handle, buf, timeout / portTICK_RATE_MS) == pdTRUE)
+        for (count = 1; count < max; count++)
+            if (xQueueReceive(handle, (uint8_t *) buf + count * item_size, 0) != pdTRUE)
+                break;
+    return count;
+}
+
 int csp_queue_dequeue_isr(csp_queue_handle_t handle, void * buf, CSP_BASE_TYPE * task_woken) {
     return xQueueReceiveFromISR(handle, buf, (signed CSP_BASE_TYPE *)task_woken);
 }
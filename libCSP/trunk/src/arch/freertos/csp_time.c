@@ -44,3 +44,9 @@ uint32_t csp_get_s(void) {
 uint32_t csp_get_s_isr(void) {
 	return (uint32_t)(xTaskGetTickCountFromISR()/configTICK_RATE_HZ);
 }
+
+void csp_get_timestamp(uint32_t * sec, uint32_t * usec) {
+	portTickType ticks = xTaskGetTickCount();
+	*sec = (uint32_t)(ticks / configTICK_RATE_HZ);
+	*usec = (uint32_t)((ticks % configTICK_RATE_HZ) * (1000000/configTICK_RATE_HZ));
+}
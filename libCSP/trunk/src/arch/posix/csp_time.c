@@ -52,3 +52,15 @@ uint32_t csp_get_s(void) {
 uint32_t csp_get_s_isr(void) {
 	return csp_get_s();
 }
+
+void csp_get_timestamp(uint32_t * sec, uint32_t * usec) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+		*sec = (uint32_t)ts.tv_sec;
+		*usec = (uint32_t)(ts.tv_nsec / 1000);
+	} else {
+		*sec = 0;
+		*usec = 0;
+	}
+}
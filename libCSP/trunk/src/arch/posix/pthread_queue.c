@@ -73,35 +73,59 @@ void pthread_queue_delete(pthread_queue_t * q) {
 }
     
 
-int pthread_queue_enqueue(pthread_queue_t * queue, void * value, int timeout) {
-    
-    int ret;
+/* Absolute deadline for pthread_cond_timedwait, only computed when a call has to wait */
+static int pthread_queue_deadline(struct timespec * ts, int timeout) {
 
-    /* Calculate timeout */
-    struct timespec ts;
-    if (clock_gettime(CLOCK_REALTIME, &ts))
+    if (clock_gettime(CLOCK_REALTIME, ts))
         return PTHREAD_QUEUE_ERROR;
-    
+
     uint32_t sec = timeout / 1000;
     uint32_t nsec = (timeout - 1000 * sec) * 1000000;
 
-    ts.tv_sec += sec;
+    ts->tv_sec += sec;
 
-    if (ts.tv_nsec + nsec > 1000000000)
-        ts.tv_sec++;
+    if (ts->tv_nsec + nsec > 1000000000)
+        ts->tv_sec++;
 
-    ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
+    ts->tv_nsec = (ts->tv_nsec + nsec) % 1000000000;
 
-    /* Get queue lock */
-    pthread_mutex_lock(&(queue->mutex));
-    while (queue->items == queue->size) {
-        ret = pthread_cond_timedwait(&(queue->cond_full), &(queue->mutex), &ts);
-        if (ret != 0) {
-            pthread_mutex_unlock(&(queue->mutex));
-            return PTHREAD_QUEUE_FULL;
+    return PTHREAD_QUEUE_OK;
+
+}
+
+/* Wait until predicate is false, with queue locked. Returns with queue unlocked on failure. */
+static int pthread_queue_wait(pthread_queue_t * queue, pthread_cond_t * cond, int * items, int limit, int timeout) {
+
+    struct timespec ts;
+    int deadline = 0;
+
+    while (*items == limit) {
+        if (timeout == 0)
+            goto fail;
+        if (!deadline) {
+            if (pthread_queue_deadline(&ts, timeout) != PTHREAD_QUEUE_OK)
+                goto fail;
+            deadline = 1;
         }
+        if (pthread_cond_timedwait(cond, &(queue->mutex), &ts) != 0)
+            goto fail;
     }
 
+    return PTHREAD_QUEUE_OK;
+
+fail:
+    pthread_mutex_unlock(&(queue->mutex));
+    return PTHREAD_QUEUE_ERROR;
+
+}
+
+int pthread_queue_enqueue(pthread_queue_t * queue, void * value, int timeout) {
+
+    /* Get queue lock */
+    pthread_mutex_lock(&(queue->mutex));
+    if (pthread_queue_wait(queue, &(queue->cond_full), &(queue->items), queue->size, timeout) != PTHREAD_QUEUE_OK)
+        return PTHREAD_QUEUE_FULL;
+
     /* Coby object from input buffer */
     memcpy(queue->buffer+(queue->in * queue->item_size), value, queue->item_size);
     queue->items++;
@@ -117,32 +141,10 @@ int pthread_queue_enqueue(pthread_queue_t * queue, void * value, int timeout) {
 
 int pthread_queue_dequeue(pthread_queue_t * queue, void * buf, int timeout) {
 
-    int ret;
-    
-    /* Calculate timeout */
-    struct timespec ts;
-    if (clock_gettime(CLOCK_REALTIME, &ts))
-        return PTHREAD_QUEUE_ERROR;
-    
-    uint32_t sec = timeout / 1000;
-    uint32_t nsec = (timeout - 1000 * sec) * 1000000;
-
-    ts.tv_sec += sec;
-    
-    if (ts.tv_nsec + nsec > 1000000000)
-        ts.tv_sec++;
-
-    ts.tv_nsec = (ts.tv_nsec + nsec) % 1000000000;
-    
     /* Get queue lock */
     pthread_mutex_lock(&(queue->mutex));
-    while (queue->items == 0) {
-        ret = pthread_cond_timedwait(&(queue->cond_empty), &(queue->mutex), &ts);
-        if (ret != 0) {
-            pthread_mutex_unlock(&(queue->mutex));
-            return PTHREAD_QUEUE_EMPTY;
-        }
-    }
+    if (pthread_queue_wait(queue, &(queue->cond_empty), &(queue->items), 0, timeout) != PTHREAD_QUEUE_OK)
+        return PTHREAD_QUEUE_EMPTY;
 
     /* Coby object to output buffer */
     memcpy(buf, queue->buffer+(queue->out * queue->item_size), queue->item_size);
@@ -157,6 +159,34 @@ int pthread_queue_dequeue(pthread_queue_t * queue, void * buf, int timeout) {
     
 }
 
+int pthread_queue_dequeue_many(pthread_queue_t * queue, void * buf, int max, int timeout) {
+
+    int count = 0;
+
+    if (max <= 0)
+        return 0;
+
+    /* Wait for the first item only */
+    pthread_mutex_lock(&(queue->mutex));
+    if (pthread_queue_wait(queue, &(queue->cond_empty), &(queue->items), 0, timeout) != PTHREAD_QUEUE_OK)
+        return 0;
+
+    /* Copy all available objects under one lock */
+    while (count < max && queue->items > 0) {
+        memcpy(buf + (count * queue->item_size), queue->buffer+(queue->out * queue->item_size), queue->item_size);
+        queue->items--;
+        queue->out = (queue->out + 1) % queue->size;
+        count++;
+    }
+    pthread_mutex_unlock(&(queue->mutex));
+
+    /* Nofify blocked threads */
+    pthread_cond_broadcast(&(queue->cond_full));
+
+    return count;
+
+}
+
 int pthread_queue_items(pthread_queue_t * queue) {
 
     pthread_mutex_lock(&(queue->mutex));
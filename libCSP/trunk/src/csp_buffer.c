@@ -179,6 +179,10 @@ int csp_buffer_remaining(void) {
 	return buf_count;
 }
 
+int csp_buffer_data_size(void) {
+	return size - CSP_BUFFER_PACKET_OVERHEAD;
+}
+
 #if CSP_DEBUG
 void csp_buffer_print_table(void) {
 	int i;
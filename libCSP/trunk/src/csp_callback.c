@@ -0,0 +1,286 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Callback driven receive.
+ * Packets for a connection or socket with a callback are queued as usual,
+ * and the object is put on a job queue once until its queue is drained.
+ * Jobs are run by the router task between packets, or by executor tasks if
+ * they have been started. Jobs of one object always go to the same task,
+ * so callbacks of one connection are never called concurrently and see
+ * packets in order. An object whose job queue is full waits on a list of
+ * the queue, and is queued by the executor when the queue has drained.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+
+#include "arch/csp_thread.h"
+#include "arch/csp_queue.h"
+#include "arch/csp_semaphore.h"
+
+#include "csp_conn.h"
+#include "csp_callback.h"
+
+/** Callback job, either a connection or a connection-less socket */
+typedef struct {
+	csp_conn_t * conn;
+	csp_socket_t * socket;
+} csp_callback_job_t;
+
+#define CSP_CALLBACK_QUEUES		(CSP_CALLBACK_THREADS > 0 ? CSP_CALLBACK_THREADS : 1)
+
+static csp_queue_handle_t callback_queue[CSP_CALLBACK_QUEUES];
+static csp_thread_handle_t callback_handle[CSP_CALLBACK_QUEUES];
+static volatile int callback_threads = 0;
+
+/* Objects that found their job queue full, protected by callback_lock */
+static csp_conn_t * callback_waiting_conn[CSP_CALLBACK_QUEUES];
+static csp_socket_t * callback_waiting_socket[CSP_CALLBACK_QUEUES];
+static csp_bin_sem_handle_t callback_lock;
+
+int csp_callback_init(void) {
+
+	int i;
+
+	if (csp_bin_sem_create(&callback_lock) != CSP_SEMAPHORE_OK) {
+		csp_debug(CSP_ERROR, "No more memory for callback semaphore\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	for (i = 0; i < CSP_CALLBACK_QUEUES; i++) {
+		callback_queue[i] = csp_queue_create(CSP_CALLBACK_QUEUE_LENGTH, sizeof(csp_callback_job_t));
+		if (callback_queue[i] == NULL) {
+			csp_debug(CSP_ERROR, "No more memory for callback queue\r\n");
+			return CSP_ERR_NOMEM;
+		}
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+static void csp_callback_deliver(csp_callback_job_t * job) {
+
+	csp_packet_t * packet;
+
+	if (job->socket != NULL) {
+		csp_socket_t * socket = job->socket;
+		__sync_lock_release(&socket->callback_pending);
+		while (socket->callback != NULL && (packet = csp_recvfrom(socket, 0)) != NULL)
+			socket->callback(NULL, packet, socket->callback_arg);
+		return;
+	}
+
+	/* Clear pending before draining, so packets queued meanwhile schedule a new job */
+	csp_conn_t * conn = job->conn;
+	conn->callback_running = 1;
+	__sync_lock_release(&conn->callback_pending);
+
+	/* The callback may close the connection */
+	while (conn->callback != NULL && (packet = csp_read(conn, 0)) != NULL)
+		conn->callback(conn, packet, conn->callback_arg);
+
+	/* Tell callback once that the remote end has closed the connection */
+#if CSP_USE_RDP
+	if (conn->callback != NULL && conn->state == CONN_OPEN && !conn->callback_hup
+			&& (conn->idin.flags & CSP_FRDP) && conn->rdp.state == RDP_CLOSE_WAIT) {
+		conn->callback_hup = 1;
+		conn->callback(conn, NULL, conn->callback_arg);
+	}
+#endif
+
+	__sync_synchronize();
+	conn->callback_running = 0;
+
+}
+
+static void csp_callback_schedule(csp_callback_job_t * job, volatile uint8_t * pending, uintptr_t key) {
+
+	int q = 0;
+
+	if (__sync_lock_test_and_set(pending, 1))
+		return;
+
+	/* Connections lie in one array, so their addresses differ by multiples of
+	 * sizeof(csp_conn_t). Hash the address, so they spread over all executors */
+	if (callback_threads > 0)
+		q = (((uint32_t) key * 2654435761u) >> 16) % callback_threads;
+
+	/* A full queue has jobs left, so its executor will look at the waiting
+	 * list again. Pending stays set, so the object is only listed once. */
+	csp_bin_sem_wait(&callback_lock, CSP_MAX_DELAY);
+	if (csp_queue_enqueue(callback_queue[q], job, 0) != CSP_QUEUE_OK) {
+		csp_debug(CSP_WARN, "Callback queue full, job waits\r\n");
+		if (job->conn != NULL) {
+			job->conn->callback_next = callback_waiting_conn[q];
+			callback_waiting_conn[q] = job->conn;
+		} else {
+			job->socket->callback_next = callback_waiting_socket[q];
+			callback_waiting_socket[q] = job->socket;
+		}
+	}
+	csp_bin_sem_post(&callback_lock);
+
+}
+
+/**
+ * Move waiting objects to the job queue, as long as it has room.
+ * Called by the task running the queue before it blocks on it.
+ * @return Number of jobs queued
+ */
+static int csp_callback_requeue(int q) {
+
+	int count = 0;
+
+	csp_bin_sem_wait(&callback_lock, CSP_MAX_DELAY);
+	while (callback_waiting_conn[q] != NULL) {
+		csp_callback_job_t job = {callback_waiting_conn[q], NULL};
+		if (csp_queue_enqueue(callback_queue[q], &job, 0) != CSP_QUEUE_OK)
+			break;
+		callback_waiting_conn[q] = job.conn->callback_next;
+		count++;
+	}
+	while (callback_waiting_socket[q] != NULL) {
+		csp_callback_job_t job = {NULL, callback_waiting_socket[q]};
+		if (csp_queue_enqueue(callback_queue[q], &job, 0) != CSP_QUEUE_OK)
+			break;
+		callback_waiting_socket[q] = job.socket->callback_next;
+		count++;
+	}
+	csp_bin_sem_post(&callback_lock);
+
+	return count;
+
+}
+
+void csp_callback_schedule_conn(csp_conn_t * conn) {
+
+	if (conn->callback == NULL)
+		return;
+
+	csp_callback_job_t job = {conn, NULL};
+	csp_callback_schedule(&job, &conn->callback_pending, (uintptr_t) conn);
+
+}
+
+void csp_callback_schedule_socket(csp_socket_t * socket) {
+
+	if (socket->callback == NULL)
+		return;
+
+	csp_callback_job_t job = {NULL, socket};
+	csp_callback_schedule(&job, &socket->callback_pending, (uintptr_t) socket);
+
+}
+
+void csp_callback_flush_conn(csp_conn_t * conn) {
+
+	while (conn->callback_pending || conn->callback_running)
+		csp_sleep_ms(1);
+
+}
+
+void csp_callback_run(void) {
+
+	csp_callback_job_t job;
+
+	if (callback_threads > 0)
+		return;
+
+	do {
+		while (csp_queue_dequeue(callback_queue[0], &job, 0) == CSP_QUEUE_OK)
+			csp_callback_deliver(&job);
+	} while (csp_callback_requeue(0) > 0);
+
+}
+
+csp_thread_return_t vTaskCSPCallback(void * pvParameters) {
+
+	int q = (intptr_t) pvParameters;
+	csp_callback_job_t job;
+
+	while (1) {
+		if (csp_queue_dequeue(callback_queue[q], &job, 0) != CSP_QUEUE_OK) {
+			/* Queue has drained, take in waiting jobs before blocking */
+			if (csp_callback_requeue(q) > 0)
+				continue;
+			if (csp_queue_dequeue(callback_queue[q], &job, CSP_MAX_DELAY) != CSP_QUEUE_OK)
+				continue;
+		}
+		csp_callback_deliver(&job);
+	}
+
+}
+
+int csp_callback_start_tasks(unsigned int task_stack_size, unsigned int priority) {
+
+	int i;
+
+	if (CSP_CALLBACK_THREADS == 0 || callback_threads > 0)
+		return CSP_ERR_INVAL;
+
+	for (i = 0; i < CSP_CALLBACK_THREADS; i++) {
+		if (csp_thread_create(vTaskCSPCallback, (signed char *) "CB", task_stack_size, (void *) (intptr_t) i, priority, &callback_handle[i]) != 0) {
+			csp_debug(CSP_ERROR, "Failed to start callback task\r\n");
+			return CSP_ERR_NOMEM;
+		}
+	}
+
+	callback_threads = CSP_CALLBACK_THREADS;
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_socket_set_callback(csp_socket_t * socket, csp_callback_t callback, void * arg) {
+
+	if (socket == NULL)
+		return CSP_ERR_INVAL;
+
+	socket->callback_arg = arg;
+	socket->callback = callback;
+
+	/* Deliver anything received before the callback was set */
+	if (callback != NULL && (socket->opts & CSP_SO_CONN_LESS))
+		csp_callback_schedule_socket(socket);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_conn_set_callback(csp_conn_t * conn, csp_callback_t callback, void * arg) {
+
+	if (conn == NULL || conn->state != CONN_OPEN)
+		return CSP_ERR_INVAL;
+
+	conn->callback_arg = arg;
+	conn->callback = callback;
+
+	if (callback != NULL)
+		csp_callback_schedule_conn(conn);
+
+	return CSP_ERR_NONE;
+
+}
@@ -0,0 +1,72 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_CALLBACK_H_
+#define _CSP_CALLBACK_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+/**
+ * Create callback job queues
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_callback_init(void);
+
+/**
+ * Schedule delivery of queued packets to the callback of a connection.
+ * Does nothing if the connection has no callback.
+ * @param conn Connection that has packets queued or was closed
+ */
+void csp_callback_schedule_conn(csp_conn_t * conn);
+
+/**
+ * Schedule delivery of queued packets to the callback of a connection-less
+ * socket. Does nothing if the socket has no callback.
+ * @param socket Socket that has packets queued
+ */
+void csp_callback_schedule_socket(csp_socket_t * socket);
+
+/**
+ * Wait until no callback job of a connection is queued or running. Clear
+ * the callback first, so no new job is scheduled. Must not be called from
+ * a callback, or from a task that callbacks wait for.
+ * @param conn Connection to wait for
+ */
+void csp_callback_flush_conn(csp_conn_t * conn);
+
+/**
+ * Run scheduled callbacks, if no executor tasks have been started.
+ * Called by the router task between packets, and not where packets are
+ * queued, so callbacks never run inside the transport layer and may send
+ * on or close their connection.
+ */
+void csp_callback_run(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_CALLBACK_H_
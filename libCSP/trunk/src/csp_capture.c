@@ -0,0 +1,288 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Packet capture to pcapng files.
+ * Packets are collected by a promiscuous mode tap, so the router only pays for
+ * a copy into the tap ring. A capture task drains the tap and writes Enhanced
+ * Packet Blocks through a buffered stream. Each CSP interface gets its own
+ * Interface Description Block, written the first time the interface is seen.
+ * The packet data is the 32 bit CSP identifier in network byte order followed
+ * by the packet data as seen on the wire, including RDP, HMAC, CRC32 and XTEA
+ * trailers. utils/csp_dissector.lua decodes this format in Wireshark.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_capture.h>
+
+#include "arch/csp_thread.h"
+#include "arch/csp_semaphore.h"
+#include "arch/csp_malloc.h"
+
+#if CSP_USE_PROMISC
+
+/** pcapng block types */
+#define PCAPNG_SHB				0x0A0D0D0A
+#define PCAPNG_IDB				0x00000001
+#define PCAPNG_EPB				0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1A2B3C4D
+
+/** pcapng option codes */
+#define PCAPNG_OPT_ENDOFOPT		0
+#define PCAPNG_OPT_IF_NAME		2
+#define PCAPNG_OPT_EPB_FLAGS	2
+
+/** epb_flags direction values */
+#define PCAPNG_FLAG_INBOUND		0x00000001
+#define PCAPNG_FLAG_OUTBOUND	0x00000002
+
+/** Maximum number of interface description blocks per capture */
+#define CSP_CAPTURE_IFACES		16
+
+/** Size of stdio buffer in front of the capture file */
+#define CSP_CAPTURE_IOBUF		65536
+
+static FILE * csp_capture_file = NULL;
+static csp_promisc_tap_t * csp_capture_tap = NULL;
+static unsigned int csp_capture_snaplen;
+static volatile int csp_capture_running = 0;
+static csp_bin_sem_handle_t csp_capture_done;
+static csp_thread_handle_t handle_capture;
+
+/* Interfaces with a written IDB, index is the pcapng interface id */
+static csp_iface_t * csp_capture_ifaces[CSP_CAPTURE_IFACES];
+static int csp_capture_iface_count;
+
+/* Records dropped because their interface has no IDB, written by the capture task */
+static volatile uint32_t csp_capture_iface_lost;
+
+static void csp_capture_write32(uint32_t value) {
+	fwrite(&value, sizeof(value), 1, csp_capture_file);
+}
+
+static void csp_capture_write16(uint16_t value) {
+	fwrite(&value, sizeof(value), 1, csp_capture_file);
+}
+
+static void csp_capture_pad(unsigned int length) {
+	static const uint8_t zero[4] = {0, 0, 0, 0};
+	if (length % 4)
+		fwrite(zero, 1, 4 - (length % 4), csp_capture_file);
+}
+
+static void csp_capture_write_shb(void) {
+
+	uint32_t length = 28;
+
+	csp_capture_write32(PCAPNG_SHB);
+	csp_capture_write32(length);
+	csp_capture_write32(PCAPNG_BYTE_ORDER_MAGIC);
+	csp_capture_write16(1);
+	csp_capture_write16(0);
+	/* Section length not specified */
+	csp_capture_write32(0xFFFFFFFF);
+	csp_capture_write32(0xFFFFFFFF);
+	csp_capture_write32(length);
+
+}
+
+static int csp_capture_iface_id(csp_iface_t * interface) {
+
+	int i;
+
+	for (i = 0; i < csp_capture_iface_count; i++)
+		if (csp_capture_ifaces[i] == interface)
+			return i;
+
+	if (csp_capture_iface_count == CSP_CAPTURE_IFACES)
+		return -1;
+
+	/* Write interface description block, with name option.
+	 * Timestamp resolution is the default microseconds. */
+	const char * name = (interface && interface->name) ? interface->name : "unknown";
+	uint16_t namelen = strlen(name);
+	uint32_t optlen = 4 + ((namelen + 3) & ~3) + 4;
+	uint32_t length = 20 + optlen;
+
+	csp_capture_write32(PCAPNG_IDB);
+	csp_capture_write32(length);
+	csp_capture_write16(CSP_CAPTURE_LINKTYPE);
+	csp_capture_write16(0);
+	csp_capture_write32(sizeof(uint32_t) + csp_capture_snaplen);
+	csp_capture_write16(PCAPNG_OPT_IF_NAME);
+	csp_capture_write16(namelen);
+	fwrite(name, 1, namelen, csp_capture_file);
+	csp_capture_pad(namelen);
+	csp_capture_write16(PCAPNG_OPT_ENDOFOPT);
+	csp_capture_write16(0);
+	csp_capture_write32(length);
+
+	csp_capture_ifaces[csp_capture_iface_count] = interface;
+	return csp_capture_iface_count++;
+
+}
+
+static void csp_capture_write_epb(csp_promisc_record_t * record) {
+
+	int ifid = csp_capture_iface_id(record->interface);
+	if (ifid < 0) {
+		if (csp_capture_iface_lost++ == 0)
+			csp_debug(CSP_WARN, "Capture has more than %d interfaces, dropping packets\r\n", CSP_CAPTURE_IFACES);
+		return;
+	}
+
+	uint64_t ts = (uint64_t) record->tv_sec * 1000000 + record->tv_usec;
+	uint32_t caplen = sizeof(uint32_t) + record->caplen;
+	uint32_t length = 32 + ((caplen + 3) & ~3) + 12;
+	uint32_t id_be = csp_hton32(record->id.ext);
+
+	csp_capture_write32(PCAPNG_EPB);
+	csp_capture_write32(length);
+	csp_capture_write32(ifid);
+	csp_capture_write32((uint32_t) (ts >> 32));
+	csp_capture_write32((uint32_t) ts);
+	csp_capture_write32(caplen);
+	csp_capture_write32(sizeof(uint32_t) + record->length);
+	fwrite(&id_be, sizeof(id_be), 1, csp_capture_file);
+	fwrite(record->data, 1, record->caplen, csp_capture_file);
+	csp_capture_pad(caplen);
+	csp_capture_write16(PCAPNG_OPT_EPB_FLAGS);
+	csp_capture_write16(sizeof(uint32_t));
+	csp_capture_write32(record->direction == CSP_PROMISC_IN ? PCAPNG_FLAG_INBOUND : PCAPNG_FLAG_OUTBOUND);
+	csp_capture_write16(PCAPNG_OPT_ENDOFOPT);
+	csp_capture_write16(0);
+	csp_capture_write32(length);
+
+}
+
+csp_thread_return_t vTaskCSPCapture(__attribute__ ((unused)) void * pvParameters) {
+
+	unsigned int size = sizeof(csp_promisc_record_t) + csp_capture_snaplen;
+	csp_promisc_record_t * record = csp_malloc(size);
+
+	while (record != NULL && csp_capture_running) {
+		/* Write out buffered blocks whenever the tap runs dry */
+		if (csp_promisc_tap_read(csp_capture_tap, record, size, 100) < 0) {
+			fflush(csp_capture_file);
+			continue;
+		}
+		csp_capture_write_epb(record);
+	}
+
+	/* Drain records captured before stop */
+	while (record != NULL && csp_promisc_tap_read(csp_capture_tap, record, size, 0) >= 0)
+		csp_capture_write_epb(record);
+
+	csp_free(record);
+	csp_bin_sem_post(&csp_capture_done);
+	csp_thread_exit();
+
+}
+
+int csp_capture_start(const char * filename, unsigned int snaplen, uint32_t id, uint32_t mask) {
+
+	if (csp_capture_file != NULL)
+		return CSP_ERR_ALREADY;
+
+	/* Records store the captured length in 16 bits */
+	if (snaplen > UINT16_MAX)
+		return CSP_ERR_INVAL;
+
+	csp_capture_file = fopen(filename, "wb");
+	if (csp_capture_file == NULL) {
+		csp_debug(CSP_ERROR, "Failed to open capture file %s\r\n", filename);
+		return CSP_ERR_INVAL;
+	}
+	setvbuf(csp_capture_file, NULL, _IOFBF, CSP_CAPTURE_IOBUF);
+
+	csp_capture_snaplen = snaplen;
+	csp_capture_iface_count = 0;
+	csp_capture_iface_lost = 0;
+	csp_capture_write_shb();
+
+	if (csp_bin_sem_create(&csp_capture_done) != CSP_SEMAPHORE_OK)
+		goto err_file;
+
+	/* Ensure semaphore is busy, so capture task can release it */
+	csp_bin_sem_wait(&csp_capture_done, 0);
+
+	csp_capture_tap = csp_promisc_tap_open(CSP_CAPTURE_SLOTS, snaplen, id, mask);
+	if (csp_capture_tap == NULL)
+		goto err_sem;
+
+	csp_capture_running = 1;
+	if (csp_thread_create(vTaskCSPCapture, (signed char *) "CAP", 1000, NULL, 0, &handle_capture) != 0) {
+		csp_capture_running = 0;
+		goto err_tap;
+	}
+
+	return CSP_ERR_NONE;
+
+err_tap:
+	csp_promisc_tap_close(csp_capture_tap);
+	csp_capture_tap = NULL;
+err_sem:
+	csp_bin_sem_remove(&csp_capture_done);
+err_file:
+	fclose(csp_capture_file);
+	csp_capture_file = NULL;
+	return CSP_ERR_NOMEM;
+
+}
+
+int csp_capture_stop(void) {
+
+	if (csp_capture_file == NULL)
+		return CSP_ERR_INVAL;
+
+	/* Stop capturing new packets and wait for the task to finish writing */
+	csp_promisc_tap_enable(csp_capture_tap, 0);
+	csp_capture_running = 0;
+	csp_bin_sem_wait(&csp_capture_done, CSP_MAX_DELAY);
+
+	csp_promisc_tap_close(csp_capture_tap);
+	csp_capture_tap = NULL;
+	csp_bin_sem_remove(&csp_capture_done);
+
+	fclose(csp_capture_file);
+	csp_capture_file = NULL;
+
+	return CSP_ERR_NONE;
+
+}
+
+uint32_t csp_capture_lost(void) {
+
+	if (csp_capture_tap == NULL)
+		return 0;
+
+	return csp_promisc_tap_lost(csp_capture_tap) + csp_capture_iface_lost;
+
+}
+
+#endif // CSP_USE_PROMISC
@@ -21,6 +21,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 
 /* CSP includes */
 #include <csp/csp.h>
@@ -35,26 +37,199 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "csp_conn.h"
 #include "transport/csp_transport.h"
 
-/* Static connection pool */
-static csp_conn_t arr_conn[CSP_CONN_MAX];
+/* Connection pool, allocated by csp_conn_init */
+static csp_conn_t * arr_conn = NULL;
+static int conn_max = CSP_CONN_MAX;
+
+/* Closed connections, in the order they were closed */
+static csp_conn_t * conn_free_head = NULL;
+static csp_conn_t * conn_free_tail = NULL;
 
 /* Connection pool lock */
 static csp_bin_sem_handle_t conn_lock;
 
-/* Source port */
+/* Next ephemeral port to try, when ports are not randomized */
 static uint8_t sport;
 
-/* Source port lock */
-static csp_bin_sem_handle_t sport_lock;
+/* Port usage bitmap, a set bit means the incoming destination port is in use.
+ * Bound ports and bits above CSP_ID_PORT_MAX are always set. Bits are claimed
+ * and released with atomic operations, so no lock is needed. */
+#define CSP_CONN_PORT_WORDS		((CSP_ID_PORT_MAX + 32) / 32)
+static uint32_t conn_ports[CSP_CONN_PORT_WORDS];
+
+/* Incoming connections to CSP_ANY holding each ephemeral port. They share
+ * the port claim, the last one to close releases it. Protected by conn_lock. */
+static uint16_t conn_port_users[CSP_ID_PORT_MAX + 1];
+
+/* Connection hash index entry */
+typedef struct {
+	uint32_t key;					// Incoming identifier masked with CSP_ID_CONN_MASK
+	csp_conn_t * conn;				// Open connection, NULL if entry is empty
+} csp_conn_hash_t;
+
+/* Open addressed connection index, with linear probing. Entries are only
+ * modified while holding conn_lock. Lookups are lock free, and use the
+ * sequence counter to detect concurrent modifications. */
+static csp_conn_hash_t * conn_hash;
+static uint32_t conn_hash_mask;
+static uint32_t conn_hash_shift;
+static volatile uint32_t conn_hash_seq;
+
+#if CSP_CONN_CACHE_SIZE > 0
+/* Idle connections kept by csp_conn_cache_put. A connection is removed from
+ * the cache while it is in use, so it is never shared between tasks. */
+static struct {
+	csp_conn_t * conn;
+	uint32_t last_used;
+} conn_cache[CSP_CONN_CACHE_SIZE];
 
-void csp_conn_check_timeouts(void) {
-#if CSP_USE_RDP
-	int i;
-	for (i = 0; i < CSP_CONN_MAX; i++)
-		if (arr_conn[i].state == CONN_OPEN)
-			if (arr_conn[i].idin.flags & CSP_FRDP)
-				csp_rdp_check_timeouts(&arr_conn[i]);
+static csp_bin_sem_handle_t conn_cache_lock;
+static csp_timer_t conn_cache_timer;
+
+static void csp_conn_cache_expire(void * arg);
 #endif
+
+static inline uint32_t csp_conn_hash_slot(uint32_t key) {
+
+	/* Fibonacci hashing spreads the port and host bits over the table */
+	return (key * 2654435761u) >> conn_hash_shift;
+
+}
+
+static void csp_conn_hash_insert(csp_conn_t * conn) {
+
+	uint32_t key = conn->idin.ext & CSP_ID_CONN_MASK;
+	uint32_t i = csp_conn_hash_slot(key);
+
+	/* Table is at most half full, so a free entry always exists */
+	while (conn_hash[i].conn != NULL)
+		i = (i + 1) & conn_hash_mask;
+
+	conn_hash_seq++;
+	__sync_synchronize();
+	conn_hash[i].key = key;
+	conn_hash[i].conn = conn;
+	__sync_synchronize();
+	conn_hash_seq++;
+
+}
+
+static void csp_conn_hash_remove(csp_conn_t * conn) {
+
+	uint32_t i, j, k;
+
+	i = csp_conn_hash_slot(conn->idin.ext & CSP_ID_CONN_MASK);
+	while (conn_hash[i].conn != conn) {
+		if (conn_hash[i].conn == NULL)
+			return;
+		i = (i + 1) & conn_hash_mask;
+	}
+
+	conn_hash_seq++;
+	__sync_synchronize();
+
+	/* Shift following entries back, so no probe sequence is broken */
+	j = i;
+	while (1) {
+		j = (j + 1) & conn_hash_mask;
+		if (conn_hash[j].conn == NULL)
+			break;
+		k = csp_conn_hash_slot(conn_hash[j].key);
+		/* Leave entry if its home slot lies cyclically in (i, j] */
+		if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+			continue;
+		conn_hash[i] = conn_hash[j];
+		i = j;
+	}
+	conn_hash[i].conn = NULL;
+
+	__sync_synchronize();
+	conn_hash_seq++;
+
+}
+
+static int csp_conn_port_claim(unsigned int port) {
+
+	uint32_t bit = (uint32_t) 1 << (port % 32);
+	return !(__sync_fetch_and_or(&conn_ports[port / 32], bit) & bit);
+
+}
+
+static void csp_conn_port_release(unsigned int port) {
+
+	uint32_t bit = (uint32_t) 1 << (port % 32);
+	__sync_fetch_and_and(&conn_ports[port / 32], ~bit);
+
+}
+
+/**
+ * Allocate a free ephemeral port
+ * Searches the port bitmap for the first zero bit, starting at a random port
+ * or at the port after the last one allocated, and wrapping once.
+ * @return Port number, or -1 if all ephemeral ports are in use
+ */
+static int csp_conn_port_alloc(void) {
+
+	unsigned int port, word, words = 0;
+	uint32_t free;
+
+#if CSP_RANDOMIZE_EPHEM
+	port = (rand() % (CSP_ID_PORT_MAX - CSP_MAX_BIND_PORT)) + (CSP_MAX_BIND_PORT + 1);
+#else
+	port = sport;
+#endif
+
+	/* Visit the start word twice, to cover ports below the start port */
+	while (words <= CSP_CONN_PORT_WORDS) {
+		word = port / 32;
+		free = ~conn_ports[word] & ((uint32_t) 0xFFFFFFFF << (port % 32));
+		if (free == 0) {
+			port = ((word + 1) % CSP_CONN_PORT_WORDS) * 32;
+			words++;
+			continue;
+		}
+
+		port = word * 32 + __builtin_ctz(free);
+
+		/* Another task may have claimed the port, then search on */
+		if (csp_conn_port_claim(port)) {
+			sport = (port < CSP_ID_PORT_MAX) ? port + 1 : CSP_MAX_BIND_PORT + 1;
+			return port;
+		}
+	}
+
+	return -1;
+
+}
+
+static csp_conn_t * csp_conn_hash_find(uint32_t key, int * valid) {
+
+	uint32_t i, seq;
+	csp_conn_t * conn, * found = NULL;
+
+	seq = conn_hash_seq;
+	__sync_synchronize();
+
+	/* Writer active, let caller fall back to a table scan */
+	if (seq & 1) {
+		*valid = 0;
+		return NULL;
+	}
+
+	i = csp_conn_hash_slot(key);
+	while ((conn = conn_hash[i].conn) != NULL) {
+		if (conn_hash[i].key == key) {
+			found = conn;
+			break;
+		}
+		i = (i + 1) & conn_hash_mask;
+	}
+
+	__sync_synchronize();
+	*valid = (seq == conn_hash_seq);
+
+	return found;
+
 }
 
 int csp_conn_get_rxq(int prio) {
@@ -86,13 +261,28 @@ int csp_conn_unlock(csp_conn_t * conn) {
 
 int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
-	if (!conn || !packet)
+	if (!conn)
 		return CSP_ERR_INVAL;
 
-	int rxq = csp_conn_get_rxq(packet->id.pri);
+	/* A NULL packet tells user space that the transport layer has closed
+	 * the connection. It is queued behind data of all priorities. */
+	int rxq = (packet != NULL) ? csp_conn_get_rxq(packet->id.pri) : CSP_RX_QUEUES - 1;
 
-	if (csp_queue_enqueue(conn->rx_queue[rxq], &packet, 0) != CSP_QUEUE_OK)
+	if (csp_queue_enqueue(conn->rx_queue[rxq], &packet, 0) != CSP_QUEUE_OK) {
+		if (packet != NULL)
+			conn->stats.drop++;
 		return CSP_ERR_NOMEM;
+	}
+
+	/* Receive counters are only written by the router task. Transmit
+	 * counters are added atomically, as several tasks may send. */
+	if (packet != NULL) {
+		uint32_t depth = csp_queue_size(conn->rx_queue[rxq]);
+		if (depth > conn->stats.rxq_max)
+			conn->stats.rxq_max = depth;
+		conn->stats.rx++;
+		conn->stats.rxbytes += packet->length;
+	}
 
 #if CSP_USE_QOS
 	int event = 0;
@@ -100,45 +290,179 @@ int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		return CSP_ERR_NOMEM;
 #endif
 
+#if CSP_USE_QOS
+	csp_poll_signal(conn, conn->rx_event);
+#else
+	csp_poll_signal(conn, conn->rx_queue[rxq]);
+#endif
+	csp_callback_schedule_conn(conn);
+
+	return CSP_ERR_NONE;
+}
+
+int csp_conn_set_max(unsigned int count) {
+
+	/* Pool size cannot change once connections exist */
+	if (arr_conn != NULL || count == 0)
+		return CSP_ERR_INVAL;
+
+	conn_max = count;
+	return CSP_ERR_NONE;
+
+}
+
+/**
+ * Create queues and locks of a connection slot.
+ * This is done the first time the slot is handed out, and the resources
+ * are kept for reuse when the connection is closed.
+ */
+static int csp_conn_allocate(csp_conn_t * conn) {
+
+	int prio;
+
+	csp_debug(CSP_BUFFER, "Allocating queues for conn %p\r\n", conn);
+
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		conn->rx_queue[prio] = csp_queue_create(CSP_RX_QUEUE_LENGTH, sizeof(csp_packet_t *));
+		if (conn->rx_queue[prio] == NULL)
+			goto err_rxq;
+	}
+	conn->rx_queue_length = CSP_RX_QUEUE_LENGTH;
+
+#if CSP_USE_QOS
+	conn->rx_event = csp_queue_create(CSP_CONN_QUEUE_LENGTH, sizeof(int));
+	if (conn->rx_event == NULL)
+		goto err_rxq;
+#endif
+
+	if (csp_mutex_create(&conn->lock) != CSP_MUTEX_OK) {
+		csp_debug(CSP_ERROR, "Failed to create connection lock\r\n");
+		goto err_event;
+	}
+
+#if CSP_USE_RDP
+	if (csp_rdp_allocate(conn) != CSP_ERR_NONE) {
+		csp_debug(CSP_ERROR, "Failed to create queues for RDP in csp_conn_allocate\r\n");
+		goto err_lock;
+	}
+#endif
+
+	conn->allocated = 1;
 	return CSP_ERR_NONE;
+
+#if CSP_USE_RDP
+err_lock:
+	csp_mutex_remove(&conn->lock);
+#endif
+err_event:
+#if CSP_USE_QOS
+	csp_queue_remove(conn->rx_event);
+#endif
+err_rxq:
+	while (prio-- > 0)
+		csp_queue_remove(conn->rx_queue[prio]);
+	return CSP_ERR_NOMEM;
+
+}
+
+int csp_conn_rx_queue_resize(csp_conn_t * conn, unsigned int length) {
+
+	int prio;
+	csp_queue_handle_t rx_queue[CSP_RX_QUEUES];
+
+	if (length == conn->rx_queue_length)
+		return CSP_ERR_NONE;
+	if (length == 0 || length > UINT16_MAX)
+		return CSP_ERR_INVAL;
+
+	csp_debug(CSP_BUFFER, "Resizing RX queues of conn %p to %u\r\n", conn, length);
+
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		rx_queue[prio] = csp_queue_create(length, sizeof(csp_packet_t *));
+		if (rx_queue[prio] == NULL)
+			goto err_rxq;
+	}
+
+	/* The event queue holds one event per packet in all RX queues */
+#if CSP_USE_QOS
+	csp_queue_handle_t rx_event = csp_queue_create(length * CSP_RX_QUEUES, sizeof(int));
+	if (rx_event == NULL)
+		goto err_rxq;
+	csp_queue_remove(conn->rx_event);
+	conn->rx_event = rx_event;
+#endif
+
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+		csp_queue_remove(conn->rx_queue[prio]);
+		conn->rx_queue[prio] = rx_queue[prio];
+	}
+	conn->rx_queue_length = length;
+
+	return CSP_ERR_NONE;
+
+err_rxq:
+	while (prio-- > 0)
+		csp_queue_remove(rx_queue[prio]);
+	return CSP_ERR_NOMEM;
+
+}
+
+/* Free list is FIFO, so a closed slot is reused as late as possible */
+static void csp_conn_free_push(csp_conn_t * conn) {
+
+	conn->next_free = NULL;
+	if (conn_free_tail != NULL)
+		conn_free_tail->next_free = conn;
+	else
+		conn_free_head = conn;
+	conn_free_tail = conn;
+
+}
+
+static csp_conn_t * csp_conn_free_pop(void) {
+
+	csp_conn_t * conn = conn_free_head;
+	if (conn != NULL) {
+		conn_free_head = conn->next_free;
+		if (conn_free_head == NULL)
+			conn_free_tail = NULL;
+		conn->next_free = NULL;
+	}
+	return conn;
+
 }
 
 int csp_conn_init(void) {
 
+	int i;
+
 	/* Initialize source port */
 #if CSP_RANDOMIZE_EPHEM
 	srand(csp_get_ms());
-	sport = (rand() % (CSP_ID_PORT_MAX - CSP_MAX_BIND_PORT)) + (CSP_MAX_BIND_PORT + 1);
-#else
-	sport = CSP_MAX_BIND_PORT + 1;
 #endif
+	sport = CSP_MAX_BIND_PORT + 1;
 
-	if (csp_bin_sem_create(&sport_lock) != CSP_SEMAPHORE_OK) {
-		csp_debug(CSP_ERROR, "No more memory for sport semaphore\r\n");
+	/* Mark bound ports and ports outside the identifier as used */
+	memset(conn_ports, 0, sizeof(conn_ports));
+	memset(conn_port_users, 0, sizeof(conn_port_users));
+	for (i = 0; i < CSP_CONN_PORT_WORDS * 32; i++)
+		if (i <= CSP_MAX_BIND_PORT || i > CSP_ID_PORT_MAX)
+			csp_conn_port_claim(i);
+
+	/* Allocate connection pool. Queues are created on first use. */
+	arr_conn = csp_malloc(conn_max * sizeof(csp_conn_t));
+	if (arr_conn == NULL) {
+		csp_debug(CSP_ERROR, "No more memory for connection pool\r\n");
 		return CSP_ERR_NOMEM;
 	}
+	memset(arr_conn, 0, conn_max * sizeof(csp_conn_t));
 
-	int i, prio;
-	for (i = 0; i < CSP_CONN_MAX; i++) {
-		for (prio = 0; prio < CSP_RX_QUEUES; prio++)
-			arr_conn[i].rx_queue[prio] = csp_queue_create(CSP_RX_QUEUE_LENGTH, sizeof(csp_packet_t *));
-
-#if CSP_USE_QOS
-		arr_conn[i].rx_event = csp_queue_create(CSP_CONN_QUEUE_LENGTH, sizeof(int));
-#endif
+	for (i = 0; i < conn_max; i++) {
 		arr_conn[i].state = CONN_CLOSED;
-
-		if (csp_mutex_create(&arr_conn[i].lock) != CSP_MUTEX_OK) {
-			csp_debug(CSP_ERROR, "Failed to create connection lock\r\n");
-			return CSP_ERR_NOMEM;
-		}
-
-#if CSP_USE_RDP
-		if (csp_rdp_allocate(&arr_conn[i]) != CSP_ERR_NONE) {
-			csp_debug(CSP_ERROR, "Failed to create queues for RDP in csp_conn_init\r\n");
-			return CSP_ERR_NOMEM;
-		}
+#if CSP_USE_EVENTFD
+		arr_conn[i].efd = -1;
 #endif
+		csp_conn_free_push(&arr_conn[i]);
 	}
 
 	if (csp_bin_sem_create(&conn_lock) != CSP_SEMAPHORE_OK) {
@@ -146,17 +470,51 @@ int csp_conn_init(void) {
 		return CSP_ERR_NOMEM;
 	}
 
+#if CSP_CONN_CACHE_SIZE > 0
+	if (csp_bin_sem_create(&conn_cache_lock) != CSP_SEMAPHORE_OK) {
+		csp_debug(CSP_ERROR, "No more memory for conn cache semaphore\r\n");
+		return CSP_ERR_NOMEM;
+	}
+	csp_timer_create(&conn_cache_timer, csp_conn_cache_expire, NULL);
+#endif
+
+	/* Size hash index to a power of two, at least twice the pool size */
+	uint32_t size = 2;
+	conn_hash_shift = 31;
+	while (size < 2 * (uint32_t) conn_max) {
+		size <<= 1;
+		conn_hash_shift--;
+	}
+
+	conn_hash = csp_malloc(size * sizeof(csp_conn_hash_t));
+	if (conn_hash == NULL) {
+		csp_debug(CSP_ERROR, "No more memory for conn hash index\r\n");
+		return CSP_ERR_NOMEM;
+	}
+	memset(conn_hash, 0, size * sizeof(csp_conn_hash_t));
+	conn_hash_mask = size - 1;
+	conn_hash_seq = 0;
+
 	return CSP_ERR_NONE;
 
 }
 
 csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask) {
 
-	/* Search for matching connection */
-	int i;
+	int i, valid;
 	csp_conn_t * conn;
 
-    for (i = 0; i < CSP_CONN_MAX; i++) {
+	/* Use hash index for full connection lookups */
+	if (mask == CSP_ID_CONN_MASK) {
+		for (i = 0; i < 2; i++) {
+			conn = csp_conn_hash_find(id & mask, &valid);
+			if (valid)
+				return (conn != NULL && conn->state != CONN_CLOSED) ? conn : NULL;
+		}
+	}
+
+	/* Search for matching connection */
+    for (i = 0; i < conn_max; i++) {
 		conn = &arr_conn[i];
 		if ((conn->state != CONN_CLOSED) && (conn->idin.ext & mask) == (id & mask))
 			return conn;
@@ -185,14 +543,20 @@ int csp_conn_flush_rx_queue(csp_conn_t * conn) {
 	while (csp_queue_dequeue(conn->rx_event, &event, 0) == CSP_QUEUE_OK);
 #endif
 
+	conn->rx_hup = 0;
+
+	/* Drop partly read stream segment */
+	if (conn->stream_rx != NULL) {
+		csp_buffer_free(conn->stream_rx);
+		conn->stream_rx = NULL;
+	}
+
 	return CSP_ERR_NONE;
 
 }
 
 csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
 
-	static uint8_t csp_conn_last_given = 0;
-	int i;
 	csp_conn_t * conn;
 
 	if (csp_bin_sem_wait(&conn_lock, 100) != CSP_SEMAPHORE_OK) {
@@ -200,35 +564,57 @@ csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout) {
 		return NULL;
 	}
 
-	/* Search for free connection */
-	i = csp_conn_last_given;
-	i = (i + 1) % CSP_CONN_MAX;
-
-	do {
-		conn = &arr_conn[i];
-		if (conn->state == CONN_CLOSED) {
-			conn->state = CONN_OPEN;
-            break;
-        }
-		i = (i + 1) % CSP_CONN_MAX;
-	} while (i != csp_conn_last_given);
-
-	if (i == csp_conn_last_given) {
+	/* Take the connection that has been closed the longest */
+	conn = csp_conn_free_pop();
+	if (conn == NULL) {
 		csp_debug(CSP_ERROR, "No more free connections\r\n");
 		csp_bin_sem_post(&conn_lock);
 		return NULL;
 	}
 
-	csp_conn_last_given = i;
-	csp_bin_sem_post(&conn_lock);
+	/* Create queues the first time this connection is used */
+	if (!conn->allocated && csp_conn_allocate(conn) != CSP_ERR_NONE) {
+		csp_debug(CSP_ERROR, "No more memory for connection queues\r\n");
+		csp_conn_free_push(conn);
+		csp_bin_sem_post(&conn_lock);
+		return NULL;
+	}
+
+	/* Size RX queues for the RDP window before the router can find the connection */
+	unsigned int rxq_length = CSP_RX_QUEUE_LENGTH;
+#if CSP_USE_RDP
+	if (idout.flags & CSP_FRDP)
+		rxq_length = csp_rdp_rx_queue_length();
+#endif
+	if (csp_conn_rx_queue_resize(conn, rxq_length) != CSP_ERR_NONE) {
+		csp_debug(CSP_ERROR, "No more memory for connection queues\r\n");
+		csp_conn_free_push(conn);
+		csp_bin_sem_post(&conn_lock);
+		return NULL;
+	}
 
-	/* No lock is needed here, because nobody else
-	 * has a reference to this connection yet.
-	 */
+	/* Set identifiers before the connection can be found */
 	conn->idin = idin;
 	conn->idout = idout;
 	conn->rx_socket = NULL;
+	conn->poller = NULL;
+	conn->callback = NULL;
+	conn->callback_hup = 0;
 	conn->timestamp = csp_get_ms();
+	memset(&conn->stats, 0, sizeof(conn->stats));
+
+	/* Reserve ephemeral port of incoming connections to CSP_ANY */
+	conn->ephem_port = 0;
+	if (idin.dport > CSP_MAX_BIND_PORT &&
+			(conn_port_users[idin.dport] > 0 || csp_conn_port_claim(idin.dport))) {
+		conn_port_users[idin.dport]++;
+		conn->ephem_port = idin.dport;
+	}
+
+	conn->state = CONN_OPEN;
+	csp_conn_hash_insert(conn);
+
+	csp_bin_sem_post(&conn_lock);
 
 	/* Ensure connection queue is empty */
 	csp_conn_flush_rx_queue(conn);
@@ -262,11 +648,40 @@ int csp_close(csp_conn_t * conn) {
 		return CSP_ERR_TIMEDOUT;
 	}
 
+    /* Another task may have closed the connection while we waited */
+    if (conn->state == CONN_CLOSED) {
+    	csp_bin_sem_post(&conn_lock);
+    	return CSP_ERR_NONE;
+    }
+
     /* Set to closed */
 	conn->state = CONN_CLOSED;
+	csp_conn_hash_remove(conn);
+
+#if CSP_USE_RDP
+	/* Stop retransmission and ACK timers */
+	csp_timer_cancel(&conn->rdp.timer);
+#endif
+
+	/* Release ephemeral port, unless other incoming connections still hold it */
+	if (conn->ephem_port) {
+		if (conn_port_users[conn->ephem_port] == 0 || --conn_port_users[conn->ephem_port] == 0)
+			csp_conn_port_release(conn->ephem_port);
+		conn->ephem_port = 0;
+	}
+
+	/* Return connection to pool */
+	csp_conn_free_push(conn);
 
 	/* Ensure connection queue is empty */
 	csp_conn_flush_rx_queue(conn);
+#if CSP_USE_EVENTFD
+	csp_eventfd_rearm(conn->efd, NULL);
+#endif
+
+	/* Give back the memory of queues enlarged for an RDP window. If this
+	 * fails, the larger queues are kept, and csp_conn_new sizes them again. */
+	csp_conn_rx_queue_resize(conn, CSP_RX_QUEUE_LENGTH);
 
     /* Reset RDP state */
 #if CSP_USE_RDP
@@ -280,6 +695,142 @@ int csp_close(csp_conn_t * conn) {
     return CSP_ERR_NONE;
 }
 
+#if CSP_CONN_CACHE_SIZE > 0
+/* Close connections that have been idle longer than CSP_CONN_CACHE_TIMEOUT */
+static void csp_conn_cache_expire(__attribute__ ((unused)) void * arg) {
+
+	csp_conn_t * expired[CSP_CONN_CACHE_SIZE];
+	int i, count = 0, armed = 0;
+	uint32_t deadline = 0, time_now = csp_get_ms();
+
+	if (csp_bin_sem_wait(&conn_cache_lock, 100) != CSP_SEMAPHORE_OK) {
+		csp_timer_set(&conn_cache_timer, time_now + CSP_TIMER_RESOLUTION);
+		return;
+	}
+
+	for (i = 0; i < CSP_CONN_CACHE_SIZE; i++) {
+		if (conn_cache[i].conn == NULL)
+			continue;
+		if ((int32_t) (time_now - conn_cache[i].last_used) >= CSP_CONN_CACHE_TIMEOUT) {
+			expired[count++] = conn_cache[i].conn;
+			conn_cache[i].conn = NULL;
+		} else if (!armed || (int32_t) (conn_cache[i].last_used + CSP_CONN_CACHE_TIMEOUT - deadline) < 0) {
+			deadline = conn_cache[i].last_used + CSP_CONN_CACHE_TIMEOUT;
+			armed = 1;
+		}
+	}
+
+	csp_bin_sem_post(&conn_cache_lock);
+
+	if (armed)
+		csp_timer_set(&conn_cache_timer, deadline);
+
+	for (i = 0; i < count; i++)
+		csp_close(expired[i]);
+
+}
+
+static csp_conn_t * csp_conn_cache_get(uint8_t prio, uint8_t dest, uint8_t dport, uint32_t opts) {
+
+	int i;
+	csp_conn_t * conn = NULL;
+
+	if (csp_bin_sem_wait(&conn_cache_lock, 100) != CSP_SEMAPHORE_OK)
+		return NULL;
+
+	for (i = 0; i < CSP_CONN_CACHE_SIZE; i++) {
+		conn = conn_cache[i].conn;
+		if (conn != NULL && conn->idout.pri == prio && conn->idout.dst == dest
+				&& conn->idout.dport == dport && conn->conn_opts == opts) {
+			conn_cache[i].conn = NULL;
+			break;
+		}
+		conn = NULL;
+	}
+
+	csp_bin_sem_post(&conn_cache_lock);
+
+	if (conn == NULL)
+		return NULL;
+
+	/* Connection may have been reset by the remote end while idle */
+#if CSP_USE_RDP
+	if ((conn->idout.flags & CSP_FRDP) && conn->rdp.state != RDP_OPEN) {
+		csp_close(conn);
+		return NULL;
+	}
+#endif
+
+	/* Drop anything that arrived while the connection was idle */
+	csp_conn_flush_rx_queue(conn);
+
+	return conn;
+
+}
+
+static void csp_conn_cache_put(csp_conn_t * conn) {
+
+	int i, slot = -1;
+	csp_conn_t * victim = NULL;
+	uint32_t time_now = csp_get_ms();
+
+	if (csp_bin_sem_wait(&conn_cache_lock, 100) != CSP_SEMAPHORE_OK) {
+		csp_close(conn);
+		return;
+	}
+
+	/* Use a free entry, or evict the least recently used connection */
+	for (i = 0; i < CSP_CONN_CACHE_SIZE; i++) {
+		if (conn_cache[i].conn == NULL) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 || (int32_t) (conn_cache[i].last_used - conn_cache[slot].last_used) < 0)
+			slot = i;
+	}
+
+	victim = conn_cache[slot].conn;
+	conn_cache[slot].conn = conn;
+	conn_cache[slot].last_used = time_now;
+
+	csp_bin_sem_post(&conn_cache_lock);
+
+	csp_timer_set_earlier(&conn_cache_timer, time_now + CSP_CONN_CACHE_TIMEOUT);
+
+	if (victim != NULL)
+		csp_close(victim);
+
+}
+#endif
+
+int csp_conn_cache_flush(void) {
+
+	int count = 0;
+
+#if CSP_CONN_CACHE_SIZE > 0
+	int i;
+	csp_conn_t * flushed[CSP_CONN_CACHE_SIZE];
+
+	if (csp_bin_sem_wait(&conn_cache_lock, 100) != CSP_SEMAPHORE_OK)
+		return 0;
+
+	for (i = 0; i < CSP_CONN_CACHE_SIZE; i++) {
+		if (conn_cache[i].conn != NULL) {
+			flushed[count++] = conn_cache[i].conn;
+			conn_cache[i].conn = NULL;
+		}
+	}
+
+	csp_bin_sem_post(&conn_cache_lock);
+
+	for (i = 0; i < count; i++)
+		csp_close(flushed[i]);
+#endif
+
+	return count;
+
+}
+
 csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, unsigned int timeout, uint32_t opts) {
 
 	/* Generate identifier */
@@ -338,38 +889,26 @@ csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, unsigned int
     
     /* Find an unused ephemeral port */
     csp_conn_t * conn;
-
-    /* Wait for sport lock */
-    if (csp_bin_sem_wait(&sport_lock, 1000) != CSP_SEMAPHORE_OK)
+    int port = csp_conn_port_alloc();
+    if (port < 0) {
+    	csp_debug(CSP_ERROR, "No more free ephemeral ports\r\n");
     	return NULL;
-
-    uint8_t start = sport;
-    while (++sport != start) {
-        if (sport > CSP_ID_PORT_MAX)
-            sport = CSP_MAX_BIND_PORT + 1;
-
-        outgoing_id.sport = sport;
-        incoming_id.dport = sport;
-        
-        /* Match on destination port of _incoming_ identifier */
-        conn = csp_conn_find(incoming_id.ext, CSP_ID_DPORT_MASK);
-
-        /* Break if we found an unused ephemeral port */
-        if (conn == NULL)
-            break;
     }
 
-    /* Post sport lock */
-    csp_bin_sem_post(&sport_lock);
+    outgoing_id.sport = port;
+    incoming_id.dport = port;
 
-    /* If no available ephemeral port was found */
-    if (sport == start)
-        return NULL;
-
-    /* Get storage for new connection */
+    /* Get storage for new connection, closing idle cached connections if the pool is full */
     conn = csp_conn_new(incoming_id, outgoing_id);
-    if (conn == NULL)
+    if (conn == NULL && csp_conn_cache_flush() > 0)
+    	conn = csp_conn_new(incoming_id, outgoing_id);
+    if (conn == NULL) {
+    	csp_conn_port_release(port);
     	return NULL;
+    }
+
+    /* Port is released again when the connection is closed */
+    conn->ephem_port = port;
 
     /* Set connection options */
     conn->conn_opts = opts;
@@ -391,6 +930,81 @@ csp_conn_t * csp_connect(uint8_t prio, uint8_t dest, uint8_t dport, unsigned int
 
 }
 
+int csp_transaction2(uint8_t prio, uint8_t dest, uint8_t port, unsigned int timeout, void * outbuf, int outlen, void * inbuf, int inlen, uint32_t opts) {
+
+	csp_conn_t * conn = NULL;
+	int status;
+
+#if CSP_CONN_CACHE_SIZE > 0
+	conn = csp_conn_cache_get(prio, dest, port, opts);
+	if (conn != NULL) {
+		status = csp_transaction_persistent(conn, timeout, outbuf, outlen, inbuf, inlen);
+		if (status > 0) {
+			csp_conn_cache_put(conn);
+			return status;
+		}
+
+		/* The server may have closed the connection while it was idle, and
+		 * dropped the request with it. Try once more on a new connection. */
+		csp_debug(CSP_WARN, "Transaction on cached connection failed, reconnecting\r\n");
+		csp_close(conn);
+	}
+#endif
+
+	conn = csp_connect(prio, dest, port, timeout, opts);
+	if (conn == NULL)
+		return 0;
+
+	status = csp_transaction_persistent(conn, timeout, outbuf, outlen, inbuf, inlen);
+
+	/* Keep connection for the next transaction. A failed transaction may
+	 * leave a late reply behind, so that connection is closed instead. */
+#if CSP_CONN_CACHE_SIZE > 0
+	if (status > 0) {
+		csp_conn_cache_put(conn);
+		return status;
+	}
+#endif
+
+	csp_close(conn);
+
+	return status;
+
+}
+
+int csp_conn_stats(csp_conn_t * conn, csp_conn_stats_t * stats) {
+
+	if (conn == NULL || stats == NULL)
+		return CSP_ERR_INVAL;
+
+	memcpy(stats, &conn->stats, sizeof(*stats));
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_conn_stats_next(int * index, csp_conn_info_t * info) {
+
+	csp_conn_t * conn;
+
+	if (index == NULL || info == NULL || arr_conn == NULL)
+		return 0;
+
+	while (*index >= 0 && *index < conn_max) {
+		conn = &arr_conn[(*index)++];
+		if (conn->state != CONN_OPEN)
+			continue;
+		info->idin = conn->idin;
+		info->idout = conn->idout;
+		info->age = csp_get_ms() - conn->timestamp;
+		memcpy(&info->stats, &conn->stats, sizeof(info->stats));
+		return 1;
+	}
+
+	return 0;
+
+}
+
 inline int csp_conn_dport(csp_conn_t * conn) {
 
     return conn->idin.dport;
@@ -427,11 +1041,19 @@ void csp_conn_print_table(void) {
 	int i;
 	csp_conn_t * conn;
 
-    for (i = 0; i < CSP_CONN_MAX; i++) {
+    for (i = 0; i < conn_max; i++) {
 		conn = &arr_conn[i];
 		printf("[%02u %p] S:%u, %u -> %u, %u -> %u, sock: %p\r\n",
 				i, conn, conn->state, conn->idin.src, conn->idin.dst,
 				conn->idin.dport, conn->idin.sport, conn->rx_socket);
+		if (conn->state == CONN_OPEN)
+			printf("\ttx %"PRIu32"/%"PRIu32"B, rx %"PRIu32"/%"PRIu32"B, drop %"PRIu32", rxq %"PRIu32", "
+					"retx %"PRIu32"/%"PRIu32", eack %"PRIu32"/%"PRIu32", acks carried %"PRIu32", rtt %"PRIu32"/%"PRIu32"ms, rto %"PRIu32"ms\r\n",
+					conn->stats.tx, conn->stats.txbytes, conn->stats.rx, conn->stats.rxbytes,
+					conn->stats.drop, conn->stats.rxq_max, conn->stats.retransmits,
+					conn->stats.fast_retransmits, conn->stats.eack_tx, conn->stats.eack_rx,
+					conn->stats.acks_piggybacked,
+					conn->stats.rtt, conn->stats.rttvar, conn->stats.rto);
 #if CSP_USE_RDP
 		if (conn->idin.flags & CSP_FRDP)
 			csp_rdp_conn_print(conn);
@@ -446,10 +1068,10 @@ int csp_conn_print_table_str(char * str_buf, int str_size) {
     char buf[100];
 
     /* Display up to 10 connections */
-	if (CSP_CONN_MAX - 10 > 0)
-    	start = CSP_CONN_MAX - 10;
+	if (conn_max - 10 > 0)
+    	start = conn_max - 10;
 
-    for (i = start; i < CSP_CONN_MAX; i++) {
+    for (i = start; i < conn_max; i++) {
 		conn = &arr_conn[i];
 		snprintf(buf, sizeof(buf), "[%02u %p] S:%u, %u -> %u, %u -> %u, sock: %p\r\n",
 				i, conn, conn->state, conn->idin.src, conn->idin.dst,
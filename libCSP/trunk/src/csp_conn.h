@@ -32,6 +32,10 @@ extern "C" {
 #include "arch/csp_queue.h"
 #include "arch/csp_semaphore.h"
 
+#include "csp_timer.h"
+#include "csp_poll.h"
+#include "csp_callback.h"
+
 /** @brief Connection states */
 typedef enum {
     CONN_CLOSED = 0,
@@ -63,9 +67,37 @@ typedef struct {
 	uint32_t ack_timeout;
 	uint32_t ack_delay_count;
 	uint32_t ack_timestamp;
+	uint8_t sack;						/**< Both ends use bitmap EACKs (RDP_OPT_SACK) */
+	uint8_t fastopen;					/**< Data may be sent before the SYN/ACK, see RDP_FASTOPEN_x */
+	volatile uint16_t ack_carried;		/**< ACK number of the last data segment, written by the sending task */
+	volatile uint8_t tx_waiting;		/**< Sending task is waiting for the send window to open */
 	csp_bin_sem_handle_t tx_wait;
-	csp_queue_handle_t tx_queue;
-	csp_queue_handle_t rx_queue;
+	csp_mutex_t tx_lock;				/**< Protects the retransmit ring */
+	uint16_t tx_size;					/**< Retransmit ring slots, covers the accepted range of two windows */
+	csp_packet_t ** tx_ring;			/**< Unacknowledged segments, slot of seq tx_una + n is (tx_base + n) % tx_size */
+	uint16_t * tx_next;					/**< Retransmit list, ordered by retransmit deadline */
+	uint16_t * tx_prev;
+	uint32_t * tx_lost;					/**< Slots reported lost by EACK, or deferred by the congestion window */
+	uint16_t tx_head;					/**< Slot with the earliest retransmit deadline */
+	uint16_t tx_tail;					/**< Slot with the latest retransmit deadline */
+	uint16_t tx_count;					/**< Segments in retransmit ring */
+	uint16_t tx_base;					/**< Slot of seq tx_una */
+	uint16_t tx_una;					/**< Oldest sequence number the ring can hold */
+	uint16_t rx_size;					/**< Receive ring slots, covers the accepted range of two windows */
+	csp_packet_t ** rx_ring;			/**< Out-of-order segments, slot of seq rcv_cur + 1 + n is (rx_base + n) % rx_size */
+	uint32_t * rx_map;					/**< Occupied slots of rx_ring */
+	uint16_t rx_base;					/**< Slot of seq rcv_cur + 1 */
+	csp_timer_t timer;					/**< Retransmission, ACK and connection timer */
+	uint16_t rtt_ambiguous;				/**< Segments before this may have been retransmitted (Karn) */
+	uint32_t srtt;						/**< Smoothed round trip time in ms, scaled by 8, 0 if not measured */
+	uint32_t rttvar;					/**< Round trip time variation in ms, scaled by 4 */
+	uint32_t rto;						/**< Retransmission timeout in ms */
+#if CSP_RDP_CC
+	uint16_t cwnd;						/**< Congestion window in segments */
+	uint16_t ssthresh;					/**< Slow start threshold in segments */
+	uint16_t cwnd_acked;				/**< Segments acknowledged towards next increase in congestion avoidance */
+	uint16_t cc_recover;				/**< Losses of segments before this are part of the last decrease */
+#endif
 } csp_rdp_t;
 
 /** @brief Connection struct */
@@ -78,9 +110,27 @@ struct csp_conn_s {
     csp_queue_handle_t rx_event;	// Event queue for RX packets
 #endif
     csp_queue_handle_t rx_queue[CSP_RX_QUEUES]; // Queue for RX packets
-    csp_queue_handle_t rx_socket;	// Socket to be "woken" when first packet is ready
+    uint16_t rx_queue_length;		// Capacity of each RX queue, see csp_conn_rx_queue_resize
+    csp_socket_t * rx_socket;		// Socket to be "woken" when first packet is ready
     uint32_t timestamp;				// Time the connection was opened
     uint32_t conn_opts;				// Connection options
+    uint8_t ephem_port;				// Ephemeral port reserved by connection, 0 if none
+    uint8_t allocated;				// Queues and locks have been created
+    csp_conn_stats_t stats;			// Connection statistics
+    csp_packet_t * stream_rx;		// Partly consumed packet for csp_stream_read
+    uint16_t stream_offset;			// Bytes of stream_rx already consumed
+    uint8_t rx_hup;					// Close marker was read by csp_read_many, the next read returns it
+    csp_poller_t * volatile poller;	// Task waiting in csp_poll, or NULL
+#if CSP_USE_EVENTFD
+    int efd;						// Readiness eventfd, -1 until requested
+#endif
+    csp_callback_t callback;		// Receive callback, or NULL
+    void * callback_arg;			// Argument passed to callback
+    volatile uint8_t callback_pending; // Connection is on a callback job queue
+    volatile uint8_t callback_running; // Callback job of the connection is being run
+    struct csp_conn_s * callback_next; // Next connection waiting for room on a callback job queue
+    uint8_t callback_hup;			// Callback has been told about remote close
+    struct csp_conn_s * next_free;	// Next connection in free list
 #if CSP_USE_RDP
     csp_rdp_t rdp;					// RDP state
 #endif
@@ -90,6 +140,15 @@ struct csp_conn_s {
 struct csp_socket_s {
     csp_queue_handle_t queue;		/**< Connection queue handle */
     uint32_t opts;					/**< Socket options */
+    struct csp_socket_s * next;		/**< Next socket in reuseport group */
+    csp_poller_t * volatile poller;	/**< Task waiting in csp_poll, or NULL */
+#if CSP_USE_EVENTFD
+    int efd;						/**< Readiness eventfd, -1 until requested */
+#endif
+    csp_callback_t callback;		/**< Receive callback, or NULL */
+    void * callback_arg;			/**< Argument passed to callback */
+    volatile uint8_t callback_pending; /**< Socket is on a callback job queue */
+    struct csp_socket_s * callback_next; /**< Next socket waiting for room on a callback job queue */
 };
 
 int csp_conn_lock(csp_conn_t * conn, int timeout);
@@ -98,9 +157,17 @@ int csp_conn_enqueue_packet(csp_conn_t * conn, csp_packet_t * packet);
 int csp_conn_init(void);
 csp_conn_t * csp_conn_find(uint32_t id, uint32_t mask);
 csp_conn_t * csp_conn_new(csp_id_t idin, csp_id_t idout);
-void csp_conn_check_timeouts(void);
 int csp_conn_get_rxq(int prio);
 
+/**
+ * Recreate the RX queues of a connection with room for length packets each.
+ * The queues must be empty, and no other task may queue packets on them:
+ * call it from the router task, or while the connection is not in the
+ * connection index. On failure the old queues are kept.
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_conn_rx_queue_resize(csp_conn_t * conn, unsigned int length);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,274 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * CSP-layer fragmentation.
+ * Packets larger than the MTU of the outgoing interface are split at egress,
+ * after security trailers and transport headers have been added. Every
+ * fragment carries the CSP_FFRAG flag and a fragment header in front of its
+ * data. The destination collects fragments in a small reassembly table and
+ * passes the packet on once all fragments have arrived. The table is only
+ * touched by the router task, so it needs no locking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_endian.h>
+
+#include "arch/csp_semaphore.h"
+#include "arch/csp_time.h"
+
+#include "csp_frag.h"
+#include "csp_timer.h"
+
+#if CSP_USE_FRAG
+
+/** Fragment header, in front of fragment data */
+typedef struct __attribute__((__packed__)) {
+	uint16_t tag;						/**< Identifies the original packet */
+	uint8_t index;						/**< Fragment number */
+	uint8_t count;						/**< Number of fragments */
+	uint16_t offset;					/**< Offset of fragment data in original packet */
+} csp_frag_header_t;
+
+/** Fragments per packet is limited by the received bitmap */
+#define CSP_FRAG_MAX_COUNT		32
+
+/** Reassembly table entry */
+typedef struct {
+	csp_packet_t * packet;				/**< Reassembly buffer, NULL if entry is free */
+	uint32_t id;						/**< Identifier of fragments */
+	uint16_t tag;						/**< Fragment tag */
+	uint8_t count;						/**< Number of fragments */
+	uint32_t received;					/**< Bitmap of received fragments */
+	uint32_t deadline;					/**< Time to give up on missing fragments */
+} csp_frag_entry_t;
+
+static csp_frag_entry_t frag_table[CSP_FRAG_SLOTS];
+static csp_timer_t frag_timer;
+static csp_frag_stats_t frag_stats;
+static csp_bin_sem_handle_t frag_tag_lock;
+static uint16_t frag_tag;
+
+static void csp_frag_drop(csp_frag_entry_t * entry) {
+
+	csp_buffer_free(entry->packet);
+	entry->packet = NULL;
+
+}
+
+/* Evict entries that have been incomplete for longer than CSP_FRAG_TIMEOUT */
+static void csp_frag_expire(__attribute__ ((unused)) void * arg) {
+
+	int i, armed = 0;
+	uint32_t deadline = 0, time_now = csp_get_ms();
+
+	for (i = 0; i < CSP_FRAG_SLOTS; i++) {
+		csp_frag_entry_t * entry = &frag_table[i];
+		if (entry->packet == NULL)
+			continue;
+		if ((int32_t)(time_now - entry->deadline) >= 0) {
+			csp_debug(CSP_WARN, "Reassembly timeout, tag %u\r\n", entry->tag);
+			csp_frag_drop(entry);
+			frag_stats.timeout++;
+		} else if (!armed || (int32_t)(entry->deadline - deadline) < 0) {
+			deadline = entry->deadline;
+			armed = 1;
+		}
+	}
+
+	if (armed)
+		csp_timer_set(&frag_timer, deadline);
+
+}
+
+int csp_frag_init(void) {
+
+	memset(frag_table, 0, sizeof(frag_table));
+	memset(&frag_stats, 0, sizeof(frag_stats));
+	frag_tag = rand();
+
+	if (csp_bin_sem_create(&frag_tag_lock) != CSP_SEMAPHORE_OK) {
+		csp_debug(CSP_ERROR, "No more memory for fragmentation semaphore\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	csp_timer_create(&frag_timer, csp_frag_expire, NULL);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_frag_send(csp_iface_t * interface, csp_packet_t * packet, unsigned int timeout) {
+
+	int payload = interface->mtu - sizeof(csp_frag_header_t);
+	if (payload <= 0)
+		return 0;
+
+	int count = (packet->length + payload - 1) / payload;
+	if (count > CSP_FRAG_MAX_COUNT) {
+		csp_debug(CSP_WARN, "Packet of %u bytes needs too many fragments\r\n", packet->length);
+		return 0;
+	}
+
+	CSP_ENTER_CRITICAL(frag_tag_lock);
+	uint16_t tag = frag_tag++;
+	CSP_EXIT_CRITICAL(frag_tag_lock);
+
+	int index, offset = 0;
+	for (index = 0; index < count; index++) {
+		int length = packet->length - offset;
+		if (length > payload)
+			length = payload;
+
+		csp_packet_t * fragment = csp_buffer_get(length + sizeof(csp_frag_header_t));
+		if (fragment == NULL)
+			return 0;
+
+		csp_frag_header_t header;
+		header.tag = csp_hton16(tag);
+		header.index = index;
+		header.count = count;
+		header.offset = csp_hton16(offset);
+		memcpy(fragment->data, &header, sizeof(header));
+		memcpy(fragment->data + sizeof(header), packet->data + offset, length);
+		fragment->length = length + sizeof(header);
+		fragment->id.ext = packet->id.ext;
+		fragment->id.flags |= CSP_FFRAG;
+
+		if ((*interface->nexthop)(fragment, timeout) != 1) {
+			csp_buffer_free(fragment);
+			return 0;
+		}
+
+		frag_stats.tx++;
+		offset += length;
+	}
+
+	csp_buffer_free(packet);
+	return 1;
+
+}
+
+csp_packet_t * csp_frag_input(csp_packet_t * packet) {
+
+	int i;
+	csp_frag_header_t header;
+	csp_frag_entry_t * entry = NULL, * oldest = NULL;
+
+	frag_stats.rx++;
+
+	if (packet->length < sizeof(header))
+		goto discard;
+
+	memcpy(&header, packet->data, sizeof(header));
+	header.tag = csp_ntoh16(header.tag);
+	header.offset = csp_ntoh16(header.offset);
+
+	unsigned int length = packet->length - sizeof(header);
+	if (header.count == 0 || header.count > CSP_FRAG_MAX_COUNT || header.index >= header.count
+			|| header.offset + length > (unsigned int) csp_buffer_data_size())
+		goto discard;
+
+	/* Find entry for this packet, or a free one */
+	for (i = 0; i < CSP_FRAG_SLOTS; i++) {
+		csp_frag_entry_t * e = &frag_table[i];
+		if (e->packet == NULL) {
+			if (entry == NULL)
+				entry = e;
+			continue;
+		}
+		if (e->id == packet->id.ext && e->tag == header.tag) {
+			entry = e;
+			break;
+		}
+		if (oldest == NULL || (int32_t)(e->deadline - oldest->deadline) < 0)
+			oldest = e;
+	}
+
+	/* Table full, give up on the oldest packet */
+	if (entry == NULL) {
+		csp_debug(CSP_WARN, "Reassembly table full, dropping tag %u\r\n", oldest->tag);
+		csp_frag_drop(oldest);
+		frag_stats.drop++;
+		entry = oldest;
+	}
+
+	/* Start reassembly of new packet */
+	if (entry->packet == NULL) {
+		entry->packet = csp_buffer_get(csp_buffer_data_size());
+		if (entry->packet == NULL)
+			goto discard;
+		entry->packet->length = 0;
+		entry->id = packet->id.ext;
+		entry->tag = header.tag;
+		entry->count = header.count;
+		entry->received = 0;
+		entry->deadline = csp_get_ms() + CSP_FRAG_TIMEOUT;
+		csp_timer_set_earlier(&frag_timer, entry->deadline);
+	}
+
+	if (header.count != entry->count)
+		goto discard;
+
+	/* Copy fragment unless it is a duplicate */
+	uint32_t bit = (uint32_t) 1 << header.index;
+	if (!(entry->received & bit)) {
+		memcpy(entry->packet->data + header.offset, packet->data + sizeof(header), length);
+		if (header.offset + length > entry->packet->length)
+			entry->packet->length = header.offset + length;
+		entry->received |= bit;
+	}
+	csp_buffer_free(packet);
+
+	uint32_t all = (entry->count == CSP_FRAG_MAX_COUNT) ? 0xFFFFFFFF : ((uint32_t) 1 << entry->count) - 1;
+	if (entry->received != all)
+		return NULL;
+
+	/* Complete, hand reassembled packet on with the original identifier */
+	packet = entry->packet;
+	entry->packet = NULL;
+	packet->id.ext = entry->id;
+	packet->id.flags &= ~CSP_FFRAG;
+	frag_stats.reassembled++;
+
+	return packet;
+
+discard:
+	frag_stats.drop++;
+	csp_buffer_free(packet);
+	return NULL;
+
+}
+
+void csp_frag_get_stats(csp_frag_stats_t * stats) {
+
+	if (stats != NULL)
+		*stats = frag_stats;
+
+}
+
+#endif // CSP_USE_FRAG
@@ -0,0 +1,61 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_FRAG_H_
+#define _CSP_FRAG_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+#if CSP_USE_FRAG
+/**
+ * Initialise fragmentation and reassembly table
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_frag_init(void);
+
+/**
+ * Send packet larger than the interface MTU as a series of fragments
+ * @param interface Outgoing interface
+ * @param packet Packet with all headers and trailers added, freed on success
+ * @param timeout Timeout passed to the next hop function for each fragment
+ * @return 1 if all fragments were sent, 0 otherwise, like a next hop function
+ */
+int csp_frag_send(csp_iface_t * interface, csp_packet_t * packet, unsigned int timeout);
+
+/**
+ * Add received fragment to the reassembly table. Must only be called from
+ * the router task, which also runs the eviction timer.
+ * @param packet Fragment, owned by the reassembly table after the call
+ * @return Reassembled packet when the last fragment arrives, otherwise NULL
+ */
+csp_packet_t * csp_frag_input(csp_packet_t * packet);
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_FRAG_H_
@@ -43,15 +43,19 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "csp_port.h"
 #include "csp_conn.h"
 #include "csp_route.h"
+#include "csp_promisc.h"
+#include "csp_timer.h"
+#include "csp_poll.h"
+#include "csp_callback.h"
+#include "csp_frag.h"
 #include "transport/csp_transport.h"
 
+/** Number of packets handled per pass in csp_send_many and csp_read_many */
+#define CSP_IO_BATCH	16
+
 /** Static local variables */
 unsigned char my_address;
 
-#if CSP_USE_PROMISC
-extern csp_queue_handle_t csp_promisc_queue;
-#endif
-
 int csp_init(unsigned char address) {
 
 	int ret;
@@ -59,6 +63,10 @@ int csp_init(unsigned char address) {
     /* Initialize CSP */
     my_address = address;
 
+	ret = csp_timer_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
 	ret = csp_conn_init();
 	if (ret != CSP_ERR_NONE)
 		return ret;
@@ -67,6 +75,20 @@ int csp_init(unsigned char address) {
 	if (ret != CSP_ERR_NONE)
 		return ret;
 
+	ret = csp_poll_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+	ret = csp_callback_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+
+#if CSP_USE_FRAG
+	ret = csp_frag_init();
+	if (ret != CSP_ERR_NONE)
+		return ret;
+#endif
+
 	ret = csp_route_table_init();
 	if (ret != CSP_ERR_NONE)
 		return ret;
@@ -100,7 +122,10 @@ csp_socket_t * csp_socket(uint32_t opts) {
 	} else if ((opts & CSP_SO_CRC32REQ) && !CSP_ENABLE_CRC32) {
 		csp_debug(CSP_ERROR, "Attempt to create socket that requires CRC32, but CSP was compiled without CRC32 support\r\n");
 		return NULL;
-	} else if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_CONN_LESS)) {
+	} else if ((opts & CSP_SO_RDPFASTOPEN) && !CSP_USE_RDP) {
+		csp_debug(CSP_ERROR, "Attempt to create socket that accepts RDP fast open, but CSP was compiled without RDP support\r\n");
+		return NULL;
+	} else if (opts & ~(CSP_SO_RDPREQ | CSP_SO_XTEAREQ | CSP_SO_HMACREQ | CSP_SO_CRC32REQ | CSP_SO_CONN_LESS | CSP_SO_REUSEPORT | CSP_SO_RDPFASTOPEN)) {
 		csp_debug(CSP_ERROR, "Invalid socket option\r\n");
 		return NULL;
 	}
@@ -120,6 +145,14 @@ csp_socket_t * csp_socket(uint32_t opts) {
     	sock->queue = NULL;
     }
 	sock->opts = opts;
+	sock->next = NULL;
+	sock->poller = NULL;
+	sock->callback = NULL;
+	sock->callback_arg = NULL;
+	sock->callback_pending = 0;
+#if CSP_USE_EVENTFD
+	sock->efd = -1;
+#endif
 
 	return sock;
 
@@ -137,6 +170,10 @@ csp_conn_t * csp_accept(csp_socket_t * sock, unsigned int timeout) {
     if (csp_queue_dequeue(sock->queue, &conn, timeout) == CSP_QUEUE_OK)
         return conn;
 
+#if CSP_USE_EVENTFD
+	csp_eventfd_rearm(sock->efd, sock->queue);
+#endif
+
 	return NULL;
 
 }
@@ -148,17 +185,31 @@ csp_packet_t * csp_read(csp_conn_t * conn, unsigned int timeout) {
 	if (conn == NULL || conn->state != CONN_OPEN)
 		return NULL;
 
+	/* Close marker stopped the last csp_read_many */
+	if (conn->rx_hup) {
+		conn->rx_hup = 0;
+		return NULL;
+	}
+
 #if CSP_USE_QOS
 	int prio, event;
-	if (csp_queue_dequeue(conn->rx_event, &event, timeout) != CSP_QUEUE_OK)
+	if (csp_queue_dequeue(conn->rx_event, &event, timeout) != CSP_QUEUE_OK) {
+#if CSP_USE_EVENTFD
+		csp_eventfd_rearm(conn->efd, conn->rx_event);
+#endif
 		return NULL;
+	}
 
 	for (prio = 0; prio < CSP_RX_QUEUES; prio++)
 		if (csp_queue_dequeue(conn->rx_queue[prio], &packet, 0) == CSP_QUEUE_OK)
 			break;
 #else
-    if (csp_queue_dequeue(conn->rx_queue[0], &packet, timeout) != CSP_QUEUE_OK)
+    if (csp_queue_dequeue(conn->rx_queue[0], &packet, timeout) != CSP_QUEUE_OK) {
+#if CSP_USE_EVENTFD
+    	csp_eventfd_rearm(conn->efd, conn->rx_queue[0]);
+#endif
     	return NULL;
+    }
 #endif
 
 #if CSP_USE_RDP
@@ -171,29 +222,99 @@ csp_packet_t * csp_read(csp_conn_t * conn, unsigned int timeout) {
 
 }
 
-int csp_send_direct(csp_id_t idout, csp_packet_t * packet, unsigned int timeout) {
+int csp_read_many(csp_conn_t * conn, csp_packet_t ** packets, int max, unsigned int timeout) {
 
-	if (packet == NULL) {
-		csp_debug(CSP_ERROR, "csp_send_direct called with NULL packet\r\n");
-		goto err;
+	int count = 0;
+
+	if (conn == NULL || packets == NULL || max <= 0 || conn->state != CONN_OPEN)
+		return 0;
+
+	/* Close marker stopped the last call */
+	if (conn->rx_hup) {
+		conn->rx_hup = 0;
+		return 0;
 	}
 
-	csp_route_t * ifout = csp_route_if(idout.dst);
+	/* A NULL packet is the close marker. The batch stops there, and the
+	 * marker is returned by the next read if packets came before it. */
+	int hup = 0;
 
-	if ((ifout == NULL) || (ifout->interface == NULL) || (ifout->interface->nexthop == NULL)) {
-		csp_debug(CSP_ERROR, "No route to host: %#08x\r\n", idout.ext);
-		goto err;
+#if CSP_USE_QOS
+	/* Each event corresponds to one queued packet. Wait for the first,
+	 * then collect the rest in bulk without blocking. */
+	int prio, events[CSP_IO_BATCH];
+	int pending = csp_queue_dequeue_many(conn->rx_event, events, sizeof(events[0]), 1, timeout);
+
+	while (pending > 0 && !hup) {
+		while (pending > 0 && !hup) {
+			pending--;
+			for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
+				if (csp_queue_dequeue(conn->rx_queue[prio], &packets[count], 0) == CSP_QUEUE_OK) {
+					if (packets[count] == NULL)
+						hup = 1;
+					else
+						count++;
+					break;
+				}
+			}
+		}
+
+		int want = max - count;
+		if (want <= 0 || hup)
+			break;
+		if (want > CSP_IO_BATCH)
+			want = CSP_IO_BATCH;
+		pending = csp_queue_dequeue_many(conn->rx_event, events, sizeof(events[0]), want, 0);
 	}
 
-	csp_debug(CSP_PACKET, "Sending packet size %u from %u to %u port %u via interface %s\r\n", packet->length, idout.src, idout.dst, idout.dport, ifout->interface->name);
-	
-#if CSP_USE_PROMISC
-    /* Loopback traffic is added to promisc queue by the router */
-    if (idout.dst != my_address) {
-        packet->id.ext = idout.ext;
-        csp_promisc_add(packet, csp_promisc_queue);
-    }
+	/* Events are all alike, so the ones taken for packets behind the marker go back */
+	while (pending-- > 0)
+		csp_queue_enqueue(conn->rx_event, &events[0], 0);
+#else
+	int i, n = csp_queue_dequeue_many(conn->rx_queue[0], packets, sizeof(packets[0]), max, timeout);
+
+	/* The queue cannot be pushed back, so a packet read along behind the
+	 * marker is returned in this batch rather than lost */
+	for (i = 0; i < n; i++) {
+		if (packets[i] == NULL)
+			hup = 1;
+		else
+			packets[count++] = packets[i];
+	}
+#endif
+
+	if (hup && count > 0)
+		conn->rx_hup = 1;
+
+	if (count == 0) {
+#if CSP_USE_EVENTFD
+#if CSP_USE_QOS
+		csp_eventfd_rearm(conn->efd, conn->rx_event);
+#else
+		csp_eventfd_rearm(conn->efd, conn->rx_queue[0]);
 #endif
+#endif
+		return 0;
+	}
+
+#if CSP_USE_RDP
+	/* Check once for the whole batch if an ACK should be sent */
+	if (conn->idin.flags & CSP_FRDP)
+		csp_rdp_check_ack(conn);
+#endif
+
+	return count;
+
+}
+
+/**
+ * Apply security trailers and copy identifier to an outgoing packet
+ * @param idout Outgoing identifier
+ * @param packet Packet to prepare
+ * @param interface Interface the packet will be sent on
+ * @return CSP_ERR_NONE on success, CSP_ERR_TX if the packet cannot be sent
+ */
+static int csp_send_prepare(csp_id_t idout, csp_packet_t * packet, csp_iface_t * interface) {
 
 	/* Only encrypt packets from the current node */
     if (idout.src == my_address) {
@@ -204,11 +325,11 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, unsigned int timeout)
 			if (csp_hmac_append(packet) != 0) {
 				/* HMAC append failed */
 				csp_debug(CSP_WARN, "HMAC append failed!\r\n");
-				goto tx_err;
+				return CSP_ERR_TX;
 			}
 #else
 			csp_debug(CSP_WARN, "Attempt to send packet with HMAC, but CSP was compiled without HMAC support. Discarding packet\r\n");
-			goto tx_err;
+			return CSP_ERR_TX;
 #endif
 		}
 
@@ -219,11 +340,11 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, unsigned int timeout)
 			if (csp_crc32_append(packet) != 0) {
 				/* CRC32 append failed */
 				csp_debug(CSP_WARN, "CRC32 append failed!\r\n");
-				goto tx_err;
+				return CSP_ERR_TX;
 			}
 #else
 			csp_debug(CSP_WARN, "Attempt to send packet with CRC32, but CSP was compiled without CRC32 support. Discarding packet\r\n");
-			goto tx_err;
+			return CSP_ERR_TX;
 #endif
 		}
 
@@ -242,13 +363,13 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, unsigned int timeout)
 			if (csp_xtea_encrypt(packet->data, packet->length, iv) != 0) {
 				/* Encryption failed */
 				csp_debug(CSP_WARN, "Encryption failed! Discarding packet\r\n");
-				goto tx_err;
+				return CSP_ERR_TX;
 			}
 
 			packet->length += sizeof(nonce_n);
 #else
 			csp_debug(CSP_WARN, "Attempt to send XTEA encrypted packet, but CSP was compiled without XTEA support. Discarding packet\r\n");
-			goto tx_err;
+			return CSP_ERR_TX;
 #endif
 		}
 	}
@@ -256,14 +377,59 @@ int csp_send_direct(csp_id_t idout, csp_packet_t * packet, unsigned int timeout)
     /* Copy identifier to packet */
     packet->id.ext = idout.ext;
 
+#if CSP_USE_PROMISC
+    /* Loopback traffic is added to promisc queue by the router.
+     * Capture after security processing, so taps see the packet as sent. */
+    if (idout.dst != my_address)
+        csp_promisc_add(packet, interface, CSP_PROMISC_OUT);
+#endif
+
+	return CSP_ERR_NONE;
+
+}
+
+/**
+ * Pass prepared packet to interface, fragmenting it if it exceeds the MTU
+ * @return 1 if the packet was accepted and 0 otherwise, like the next hop function
+ */
+static int csp_send_nexthop(csp_iface_t * interface, csp_packet_t * packet, unsigned int timeout) {
+
+	if (interface->mtu > 0 && packet->length > interface->mtu) {
+#if CSP_USE_FRAG
+		/* Fragments are never split again */
+		if (!(packet->id.flags & CSP_FFRAG))
+			return csp_frag_send(interface, packet, timeout);
+#endif
+		return 0;
+	}
+
+	return (*interface->nexthop)(packet, timeout);
+
+}
+
+int csp_send_direct(csp_id_t idout, csp_packet_t * packet, unsigned int timeout) {
+
+	if (packet == NULL) {
+		csp_debug(CSP_ERROR, "csp_send_direct called with NULL packet\r\n");
+		goto err;
+	}
+
+	csp_route_t * ifout = csp_route_if(idout.dst);
+
+	if ((ifout == NULL) || (ifout->interface == NULL) || (ifout->interface->nexthop == NULL)) {
+		csp_debug(CSP_ERROR, "No route to host: %#08x\r\n", idout.ext);
+		goto err;
+	}
+
+	csp_debug(CSP_PACKET, "Sending packet size %u from %u to %u port %u via interface %s\r\n", packet->length, idout.src, idout.dst, idout.dport, ifout->interface->name);
+
+	if (csp_send_prepare(idout, packet, ifout->interface) != CSP_ERR_NONE)
+		goto tx_err;
+
     /* Store length before passing to interface */
     uint16_t bytes = packet->length;
-    uint16_t mtu = ifout->interface->mtu;
 
-    if (mtu > 0 && bytes > mtu)
-    	goto tx_err;
-
-	if ((*ifout->interface->nexthop)(packet, timeout) != 1)
+	if (csp_send_nexthop(ifout->interface, packet, timeout) != 1)
 		goto tx_err;
 
 	ifout->interface->tx++;
@@ -286,6 +452,9 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout) {
 		return 0;
 	}
 
+	/* User data length, before transport headers are added */
+	uint16_t length = packet->length;
+
 #if CSP_USE_RDP
 	if (conn->idout.flags & CSP_FRDP) {
 		if (csp_rdp_send(conn, packet, timeout) != CSP_ERR_NONE) {
@@ -299,8 +468,220 @@ int csp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout) {
 #endif
 
 	ret = csp_send_direct(conn->idout, packet, timeout);
+	if (ret != CSP_ERR_NONE)
+		return 0;
+
+	/* Several tasks may send on one connection */
+	__sync_fetch_and_add(&conn->stats.tx, 1);
+	__sync_fetch_and_add(&conn->stats.txbytes, length);
+
+	return 1;
+
+}
+
+int csp_send_many(csp_conn_t * conn, csp_packet_t ** packets, unsigned int count, unsigned int timeout) {
+
+	uint16_t length[CSP_IO_BATCH], bytes[CSP_IO_BATCH];
+	unsigned int sent = 0, batch, i, oversize, queued;
+	uint32_t txbytes;
+
+	if ((conn == NULL) || (packets == NULL) || (conn->state != CONN_OPEN)) {
+		csp_debug(CSP_ERROR, "Invalid call to csp_send_many\r\n");
+		return 0;
+	}
+
+	/* Route lookup once for the whole batch */
+	csp_route_t * ifout = csp_route_if(conn->idout.dst);
+	if ((ifout == NULL) || (ifout->interface == NULL) || (ifout->interface->nexthop == NULL)) {
+		csp_debug(CSP_ERROR, "No route to host: %#08x\r\n", conn->idout.ext);
+		return 0;
+	}
+	csp_iface_t * ifc = ifout->interface;
 
-	return (ret == CSP_ERR_NONE) ? 1 : 0;
+	while (sent < count) {
+
+		batch = count - sent;
+		if (batch > CSP_IO_BATCH)
+			batch = CSP_IO_BATCH;
+
+#if CSP_USE_RDP
+		/* Limit batch to the free part of the send window. When the window
+		 * is full, a batch of one lets csp_rdp_send block for space. */
+		if (conn->idout.flags & CSP_FRDP) {
+			int room = csp_rdp_tx_room(conn);
+			if (room < 1)
+				room = 1;
+			if (batch > (unsigned int) room)
+				batch = room;
+		}
+#endif
+
+		/* Transport and security processing */
+		oversize = 0;
+		queued = 0;
+		for (i = 0; i < batch; i++) {
+			csp_packet_t * packet = packets[sent + i];
+			if (packet == NULL)
+				break;
+			length[i] = packet->length;
+#if CSP_USE_RDP
+			if (conn->idout.flags & CSP_FRDP) {
+				if (csp_rdp_send(conn, packet, timeout) != CSP_ERR_NONE) {
+					csp_debug(CSP_WARN, "RDP send failed\r\n");
+					break;
+				}
+				queued = i + 1;
+			}
+#endif
+			if (csp_send_prepare(conn->idout, packet, ifc) != CSP_ERR_NONE)
+				break;
+			bytes[i] = packet->length;
+			if (ifc->mtu > 0 && bytes[i] > ifc->mtu)
+				oversize = 1;
+		}
+
+		/* Packet i failed processing, send the ones before it */
+		unsigned int ready = i, done = 0;
+
+		/* Packets that must be fragmented go through csp_send_nexthop one by one */
+		if (ifc->nexthop_many != NULL && ready > 0 && !oversize) {
+			int ret = (*ifc->nexthop_many)(&packets[sent], ready, timeout);
+			if (ret > 0)
+				done = ret;
+		} else {
+			while (done < ready && csp_send_nexthop(ifc, packets[sent + done], timeout) == 1)
+				done++;
+		}
+
+		txbytes = 0;
+		for (i = 0; i < done; i++) {
+			ifc->tx++;
+			ifc->txbytes += bytes[i];
+			txbytes += length[i];
+		}
+		__sync_fetch_and_add(&conn->stats.tx, done);
+		__sync_fetch_and_add(&conn->stats.txbytes, txbytes);
+
+		if (done < batch) {
+			ifc->tx_error++;
+			/* Packets that reached the RDP send window are retransmitted
+			 * from their copy there, so they count as sent */
+			for (i = done; i < queued; i++)
+				csp_buffer_free(packets[sent + i]);
+			if (queued > done)
+				done = queued;
+			sent += done;
+			break;
+		}
+
+		sent += done;
+
+	}
+
+	return sent;
+
+}
+
+/** Largest user payload per packet on a connection, after transport header and trailers */
+static int csp_stream_segment_size(csp_conn_t * conn) {
+
+	int size = csp_buffer_data_size();
+
+	csp_route_t * ifout = csp_route_if(conn->idout.dst);
+	if (ifout != NULL && ifout->interface != NULL && ifout->interface->mtu > 0 && ifout->interface->mtu < size)
+		size = ifout->interface->mtu;
+
+#if CSP_USE_RDP
+	if (conn->idout.flags & CSP_FRDP)
+		size -= csp_rdp_header_size();
+#endif
+	if (conn->idout.flags & CSP_FHMAC)
+		size -= CSP_HMAC_LENGTH;
+	if (conn->idout.flags & CSP_FCRC32)
+		size -= sizeof(uint32_t);
+	if (conn->idout.flags & CSP_FXTEA)
+		size -= sizeof(uint32_t);
+
+	return size;
+
+}
+
+int csp_stream_write(csp_conn_t * conn, const void * buf, size_t len, unsigned int timeout) {
+
+	size_t done = 0;
+	int ret = CSP_ERR_NONE;
+
+	if (conn == NULL || (buf == NULL && len > 0) || conn->state != CONN_OPEN)
+		return CSP_ERR_INVAL;
+
+	int segment = csp_stream_segment_size(conn);
+	if (segment <= 0)
+		return CSP_ERR_INVAL;
+
+	while (done < len) {
+		size_t chunk = len - done;
+		if (chunk > (size_t) segment)
+			chunk = segment;
+
+		csp_packet_t * packet = csp_buffer_get(chunk);
+		if (packet == NULL) {
+			ret = CSP_ERR_NOMEM;
+			break;
+		}
+
+		memcpy(packet->data, (const uint8_t *) buf + done, chunk);
+		packet->length = chunk;
+
+		if (!csp_send(conn, packet, timeout)) {
+			csp_buffer_free(packet);
+			ret = CSP_ERR_TX;
+			break;
+		}
+
+		done += chunk;
+	}
+
+	if (done == 0 && ret != CSP_ERR_NONE)
+		return ret;
+
+	return done;
+
+}
+
+int csp_stream_read(csp_conn_t * conn, void * buf, size_t len, unsigned int timeout) {
+
+	size_t done = 0;
+	uint32_t start = csp_get_ms();
+
+	if (conn == NULL || (buf == NULL && len > 0))
+		return CSP_ERR_INVAL;
+
+	while (done < len) {
+		if (conn->stream_rx == NULL) {
+			uint32_t elapsed = csp_get_ms() - start;
+			csp_packet_t * packet = csp_read(conn, (elapsed < timeout) ? timeout - elapsed : 0);
+			if (packet == NULL)
+				break;
+			conn->stream_rx = packet;
+			conn->stream_offset = 0;
+		}
+
+		csp_packet_t * packet = conn->stream_rx;
+		size_t chunk = packet->length - conn->stream_offset;
+		if (chunk > len - done)
+			chunk = len - done;
+
+		memcpy((uint8_t *) buf + done, packet->data + conn->stream_offset, chunk);
+		conn->stream_offset += chunk;
+		done += chunk;
+
+		if (conn->stream_offset >= packet->length) {
+			conn->stream_rx = NULL;
+			csp_buffer_free(packet);
+		}
+	}
+
+	return done;
 
 }
 
@@ -346,15 +727,7 @@ int csp_transaction_persistent(csp_conn_t * conn, unsigned int timeout, void * o
 
 int csp_transaction(uint8_t prio, uint8_t dest, uint8_t port, unsigned int timeout, void * outbuf, int outlen, void * inbuf, int inlen) {
 
-	csp_conn_t * conn = csp_connect(prio, dest, port, 0, 0);
-	if (conn == NULL)
-		return 0;
-
-	int status = csp_transaction_persistent(conn, timeout, outbuf, outlen, inbuf, inlen);
-
-	csp_close(conn);
-
-	return status;
+	return csp_transaction2(prio, dest, port, timeout, outbuf, outlen, inbuf, inlen, 0);
 
 }
 
@@ -364,7 +737,12 @@ csp_packet_t * csp_recvfrom(csp_socket_t * socket, unsigned int timeout) {
 		return NULL;
 
 	csp_packet_t * packet = NULL;
-    csp_queue_dequeue(socket->queue, &packet, timeout);
+    if (csp_queue_dequeue(socket->queue, &packet, timeout) != CSP_QUEUE_OK) {
+#if CSP_USE_EVENTFD
+    	csp_eventfd_rearm(socket->efd, socket->queue);
+#endif
+    	return NULL;
+    }
 
 	return packet;
 
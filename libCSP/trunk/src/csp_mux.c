@@ -0,0 +1,374 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Multiplexed transactions.
+ * Each multiplexed connection has CSP_MUX_INFLIGHT request slots. Free slot
+ * numbers are kept in a queue, so csp_mux_request blocks on the queue when
+ * all slots are in use. Replies arrive through the connection callback and
+ * are matched to a slot by request id. Per-request timeouts use the timer
+ * wheel, so requests are completed from either a callback executor or the
+ * router task, whichever comes first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_endian.h>
+#include <csp/csp_mux.h>
+
+#include "arch/csp_queue.h"
+#include "arch/csp_semaphore.h"
+#include "arch/csp_time.h"
+#include "arch/csp_malloc.h"
+
+#include "csp_conn.h"
+#include "csp_timer.h"
+
+/** Request slot states */
+#define CSP_MUX_FREE		0
+#define CSP_MUX_PENDING		1
+#define CSP_MUX_DONE		2
+
+struct csp_mux_req_s {
+	csp_mux_t * mux;					/**< Owning connection */
+	uint8_t index;						/**< Slot number */
+	uint8_t state;						/**< Slot state */
+	uint16_t id;						/**< Request id of outstanding request */
+	uint32_t deadline;					/**< Request timeout in ms */
+	csp_timer_t timer;					/**< Request timeout timer */
+	csp_mux_callback_t callback;		/**< Completion callback, NULL for csp_mux_wait */
+	void * arg;							/**< Completion callback argument */
+	int status;							/**< Completion status */
+	csp_packet_t * reply;				/**< Reply packet */
+	csp_bin_sem_handle_t done;			/**< Posted on completion for csp_mux_wait */
+};
+
+struct csp_mux_s {
+	csp_conn_t * conn;					/**< Underlying connection */
+	csp_bin_sem_handle_t lock;			/**< Protects slot state */
+	csp_queue_handle_t slots;			/**< Free slot numbers */
+	uint16_t next_id;					/**< Next request id */
+	volatile uint8_t closed;			/**< Connection closed by remote end */
+	csp_mux_req_t req[CSP_MUX_INFLIGHT];
+};
+
+static void csp_mux_release(csp_mux_req_t * req) {
+
+	csp_mux_t * mux = req->mux;
+
+	CSP_ENTER_CRITICAL(mux->lock);
+	req->state = CSP_MUX_FREE;
+	req->reply = NULL;
+	CSP_EXIT_CRITICAL(mux->lock);
+
+	csp_queue_enqueue(mux->slots, &req->index, 0);
+
+}
+
+/** Complete pending request. Called with the lock held, returns with it released. */
+static void csp_mux_complete(csp_mux_req_t * req, int status, csp_packet_t * reply) {
+
+	csp_mux_t * mux = req->mux;
+
+	req->state = CSP_MUX_DONE;
+	req->status = status;
+	req->reply = reply;
+	csp_timer_cancel(&req->timer);
+
+	csp_mux_callback_t callback = req->callback;
+	void * arg = req->arg;
+	CSP_EXIT_CRITICAL(mux->lock);
+
+	if (callback != NULL) {
+		callback(status, reply, arg);
+		csp_mux_release(req);
+	} else {
+		csp_bin_sem_post(&req->done);
+	}
+
+}
+
+static void csp_mux_fail_all(csp_mux_t * mux, int status) {
+
+	int i;
+	for (i = 0; i < CSP_MUX_INFLIGHT; i++) {
+		CSP_ENTER_CRITICAL(mux->lock);
+		if (mux->req[i].state == CSP_MUX_PENDING)
+			csp_mux_complete(&mux->req[i], status, NULL);
+		else
+			CSP_EXIT_CRITICAL(mux->lock);
+	}
+
+}
+
+static void csp_mux_expire(void * arg) {
+
+	csp_mux_req_t * req = arg;
+	csp_mux_t * mux = req->mux;
+
+	/* The slot may have completed and been reused since the timer was armed */
+	CSP_ENTER_CRITICAL(mux->lock);
+	if (req->state == CSP_MUX_PENDING && (int32_t)(csp_get_ms() - req->deadline) >= 0) {
+		csp_debug(CSP_WARN, "Request %u timeout\r\n", req->id);
+		csp_mux_complete(req, CSP_ERR_TIMEDOUT, NULL);
+	} else {
+		CSP_EXIT_CRITICAL(mux->lock);
+	}
+
+}
+
+static void csp_mux_deliver(csp_conn_t * conn, csp_packet_t * packet, void * arg) {
+
+	csp_mux_t * mux = arg;
+	uint16_t id;
+	int i;
+
+	/* Remote end closed the connection */
+	if (packet == NULL) {
+		mux->closed = 1;
+		csp_mux_fail_all(mux, CSP_ERR_RESET);
+		return;
+	}
+
+	if (csp_mux_get_id(packet, &id) != CSP_ERR_NONE) {
+		csp_buffer_free(packet);
+		return;
+	}
+
+	CSP_ENTER_CRITICAL(mux->lock);
+	for (i = 0; i < CSP_MUX_INFLIGHT; i++) {
+		if (mux->req[i].state == CSP_MUX_PENDING && mux->req[i].id == id) {
+			csp_mux_complete(&mux->req[i], CSP_ERR_NONE, packet);
+			return;
+		}
+	}
+	CSP_EXIT_CRITICAL(mux->lock);
+
+	/* Late reply to a request that already timed out */
+	csp_debug(CSP_WARN, "No outstanding request with id %u\r\n", id);
+	csp_buffer_free(packet);
+
+}
+
+csp_mux_t * csp_mux_open(uint8_t prio, uint8_t dest, uint8_t port, unsigned int timeout, uint32_t opts) {
+
+	uint8_t i;
+
+	csp_mux_t * mux = csp_malloc(sizeof(*mux));
+	if (mux == NULL)
+		return NULL;
+	memset(mux, 0, sizeof(*mux));
+
+	if (csp_bin_sem_create(&mux->lock) != CSP_SEMAPHORE_OK)
+		goto err_free;
+
+	mux->slots = csp_queue_create(CSP_MUX_INFLIGHT, sizeof(uint8_t));
+	if (mux->slots == NULL)
+		goto err_lock;
+
+	for (i = 0; i < CSP_MUX_INFLIGHT; i++) {
+		csp_mux_req_t * req = &mux->req[i];
+		if (csp_bin_sem_create(&req->done) != CSP_SEMAPHORE_OK)
+			goto err_sems;
+		req->mux = mux;
+		req->index = i;
+		csp_timer_create(&req->timer, csp_mux_expire, req);
+		csp_queue_enqueue(mux->slots, &req->index, 0);
+	}
+
+	mux->next_id = rand();
+
+	mux->conn = csp_connect(prio, dest, port, timeout, opts);
+	if (mux->conn == NULL)
+		goto err_sems;
+
+	if (csp_conn_set_callback(mux->conn, csp_mux_deliver, mux) != CSP_ERR_NONE) {
+		csp_close(mux->conn);
+		goto err_sems;
+	}
+
+	return mux;
+
+err_sems:
+	while (i-- > 0)
+		csp_bin_sem_remove(&mux->req[i].done);
+	csp_queue_remove(mux->slots);
+err_lock:
+	csp_bin_sem_remove(&mux->lock);
+err_free:
+	csp_free(mux);
+	return NULL;
+
+}
+
+int csp_mux_close(csp_mux_t * mux) {
+
+	int i;
+
+	if (mux == NULL)
+		return CSP_ERR_INVAL;
+
+	/* Stop deliveries and wait for one in progress before failing outstanding requests */
+	csp_conn_set_callback(mux->conn, NULL, NULL);
+	csp_callback_flush_conn(mux->conn);
+	csp_mux_fail_all(mux, CSP_ERR_RESET);
+	csp_close(mux->conn);
+
+	/* An expiry may be completing a request in the router task */
+	for (i = 0; i < CSP_MUX_INFLIGHT; i++) {
+		csp_timer_cancel_sync(&mux->req[i].timer);
+		csp_bin_sem_remove(&mux->req[i].done);
+	}
+	csp_queue_remove(mux->slots);
+	csp_bin_sem_remove(&mux->lock);
+	csp_free(mux);
+
+	return CSP_ERR_NONE;
+
+}
+
+csp_mux_req_t * csp_mux_request(csp_mux_t * mux, csp_packet_t * packet, unsigned int timeout, csp_mux_callback_t callback, void * arg) {
+
+	uint8_t index;
+
+	if (mux == NULL || packet == NULL || mux->closed)
+		return NULL;
+
+	if (packet->length + CSP_MUX_HEADER_SIZE > csp_buffer_data_size()) {
+		csp_debug(CSP_ERROR, "No room for request id in packet\r\n");
+		return NULL;
+	}
+
+	/* Wait for a free slot, this bounds the number of requests in flight */
+	if (csp_queue_dequeue(mux->slots, &index, timeout) != CSP_QUEUE_OK) {
+		csp_debug(CSP_WARN, "Timeout waiting for free request slot\r\n");
+		return NULL;
+	}
+
+	csp_mux_req_t * req = &mux->req[index];
+	csp_bin_sem_wait(&req->done, 0);
+
+	/* Mark pending before sending, the reply may arrive before csp_send returns */
+	CSP_ENTER_CRITICAL(mux->lock);
+	uint16_t id = mux->next_id++;
+	req->id = id;
+	req->callback = callback;
+	req->arg = arg;
+	req->reply = NULL;
+	req->deadline = csp_get_ms() + timeout;
+	req->state = CSP_MUX_PENDING;
+	CSP_EXIT_CRITICAL(mux->lock);
+
+	/* Add request id header */
+	uint16_t id_n = csp_hton16(id);
+	memmove(packet->data + CSP_MUX_HEADER_SIZE, packet->data, packet->length);
+	memcpy(packet->data, &id_n, sizeof(id_n));
+	packet->length += CSP_MUX_HEADER_SIZE;
+
+	int sent = csp_send(mux->conn, packet, timeout);
+
+	CSP_ENTER_CRITICAL(mux->lock);
+	if (req->state != CSP_MUX_PENDING || req->id != id) {
+		/* Completed while sending, only possible if the request got through */
+		CSP_EXIT_CRITICAL(mux->lock);
+		if (!sent)
+			csp_buffer_free(packet);
+		return req;
+	}
+
+	if (!sent) {
+		req->state = CSP_MUX_FREE;
+		CSP_EXIT_CRITICAL(mux->lock);
+		packet->length -= CSP_MUX_HEADER_SIZE;
+		memmove(packet->data, packet->data + CSP_MUX_HEADER_SIZE, packet->length);
+		csp_queue_enqueue(mux->slots, &index, 0);
+		return NULL;
+	}
+
+	csp_timer_set(&req->timer, req->deadline);
+	CSP_EXIT_CRITICAL(mux->lock);
+
+	return req;
+
+}
+
+int csp_mux_wait(csp_mux_req_t * req, csp_packet_t ** reply) {
+
+	if (req == NULL || req->callback != NULL)
+		return CSP_ERR_INVAL;
+
+	/* Every request completes, at the latest when its timeout passes */
+	csp_bin_sem_wait(&req->done, CSP_MAX_DELAY);
+
+	int status = req->status;
+	if (reply != NULL)
+		*reply = req->reply;
+	else if (req->reply != NULL)
+		csp_buffer_free(req->reply);
+
+	csp_mux_release(req);
+
+	return status;
+
+}
+
+int csp_mux_get_id(csp_packet_t * packet, uint16_t * id) {
+
+	uint16_t id_n;
+
+	if (packet == NULL || packet->length < CSP_MUX_HEADER_SIZE)
+		return CSP_ERR_INVAL;
+
+	memcpy(&id_n, packet->data, sizeof(id_n));
+	packet->length -= CSP_MUX_HEADER_SIZE;
+	memmove(packet->data, packet->data + CSP_MUX_HEADER_SIZE, packet->length);
+
+	if (id != NULL)
+		*id = csp_ntoh16(id_n);
+
+	return CSP_ERR_NONE;
+
+}
+
+int csp_mux_reply(csp_conn_t * conn, csp_packet_t * packet, uint16_t id, unsigned int timeout) {
+
+	if (packet == NULL || packet->length + CSP_MUX_HEADER_SIZE > csp_buffer_data_size())
+		return 0;
+
+	uint16_t id_n = csp_hton16(id);
+	memmove(packet->data + CSP_MUX_HEADER_SIZE, packet->data, packet->length);
+	memcpy(packet->data, &id_n, sizeof(id_n));
+	packet->length += CSP_MUX_HEADER_SIZE;
+
+	if (!csp_send(conn, packet, timeout)) {
+		packet->length -= CSP_MUX_HEADER_SIZE;
+		memmove(packet->data, packet->data + CSP_MUX_HEADER_SIZE, packet->length);
+		return 0;
+	}
+
+	return 1;
+
+}
@@ -0,0 +1,292 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Wait for several connections and sockets from one task.
+ * The polling task registers one wait object on every polled object, and
+ * the router posts it whenever a packet or connection is queued. An object
+ * holds one wait object, so it can only be polled by one task at a time.
+ * Readiness is always checked on the queues themselves after registering,
+ * so a wake up cannot be lost, and a stale wake up only causes another check.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+
+#include "arch/csp_queue.h"
+#include "arch/csp_semaphore.h"
+#include "arch/csp_time.h"
+
+#include "csp_conn.h"
+#include "csp_poll.h"
+
+#if CSP_USE_EVENTFD
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+static csp_poller_t pollers[CSP_POLL_WAITERS];
+
+int csp_poll_init(void) {
+
+	int i;
+
+	for (i = 0; i < CSP_POLL_WAITERS; i++) {
+		if (csp_bin_sem_create(&pollers[i].sem) != CSP_SEMAPHORE_OK) {
+			csp_debug(CSP_ERROR, "No more memory for poll semaphore\r\n");
+			return CSP_ERR_NOMEM;
+		}
+		pollers[i].used = 0;
+	}
+
+	return CSP_ERR_NONE;
+
+}
+
+static csp_poller_t * csp_poll_claim(void) {
+
+	int i;
+
+	for (i = 0; i < CSP_POLL_WAITERS; i++)
+		if (__sync_bool_compare_and_swap(&pollers[i].used, 0, 1))
+			return &pollers[i];
+
+	return NULL;
+
+}
+
+/**
+ * Register poller on an object, unless another task polls it already.
+ * The same object may appear more than once in the set.
+ */
+static int csp_poll_claim_object(csp_poller_t * volatile * obj, csp_poller_t * poller) {
+
+	return __sync_bool_compare_and_swap(obj, NULL, poller) || *obj == poller;
+
+}
+
+static void csp_poll_unregister(csp_pollfd_t * fds, unsigned int nfds, csp_poller_t * poller) {
+
+	unsigned int i;
+
+	/* Leave objects alone that are registered by another task */
+	for (i = 0; i < nfds; i++) {
+		if (fds[i].conn != NULL)
+			__sync_bool_compare_and_swap(&fds[i].conn->poller, poller, NULL);
+		if (fds[i].socket != NULL)
+			__sync_bool_compare_and_swap(&fds[i].socket->poller, poller, NULL);
+	}
+
+}
+
+static int csp_poll_register(csp_pollfd_t * fds, unsigned int nfds, csp_poller_t * poller) {
+
+	unsigned int i;
+
+	for (i = 0; i < nfds; i++) {
+		if ((fds[i].conn != NULL && !csp_poll_claim_object(&fds[i].conn->poller, poller)) ||
+				(fds[i].socket != NULL && !csp_poll_claim_object(&fds[i].socket->poller, poller))) {
+			csp_poll_unregister(fds, i + 1, poller);
+			return CSP_ERR_BUSY;
+		}
+	}
+
+	/* Registration must be visible before queues are checked */
+	__sync_synchronize();
+
+	return CSP_ERR_NONE;
+
+}
+
+static int csp_poll_check(csp_pollfd_t * fds, unsigned int nfds) {
+
+	unsigned int i;
+	int ready = 0;
+	csp_conn_t * conn;
+
+	for (i = 0; i < nfds; i++) {
+
+		fds[i].revents = 0;
+
+		if ((conn = fds[i].conn) != NULL) {
+#if CSP_USE_QOS
+			if (csp_queue_size(conn->rx_event) > 0)
+#else
+			if (csp_queue_size(conn->rx_queue[0]) > 0)
+#endif
+				fds[i].revents |= CSP_POLLIN;
+			if (conn->state != CONN_OPEN)
+				fds[i].revents |= CSP_POLLHUP;
+#if CSP_USE_RDP
+			else if ((conn->idout.flags & CSP_FRDP) && conn->rdp.state != RDP_OPEN
+					&& conn->rdp.state != RDP_SYN_SENT && conn->rdp.state != RDP_SYN_RCVD)
+				fds[i].revents |= CSP_POLLHUP;
+#endif
+		}
+
+		if (fds[i].socket != NULL && fds[i].socket->queue != NULL)
+			if (csp_queue_size(fds[i].socket->queue) > 0)
+				fds[i].revents |= CSP_POLLIN;
+
+		/* Hang up is always reported */
+		fds[i].revents &= fds[i].events | CSP_POLLHUP;
+		if (fds[i].revents)
+			ready++;
+
+	}
+
+	return ready;
+
+}
+
+int csp_poll(csp_pollfd_t * fds, unsigned int nfds, unsigned int timeout) {
+
+	csp_poller_t * poller;
+	int ready;
+	uint32_t start, elapsed;
+
+	if (fds == NULL && nfds > 0)
+		return CSP_ERR_INVAL;
+
+	/* Do not register anything if the result is known already */
+	ready = csp_poll_check(fds, nfds);
+	if (ready > 0 || timeout == 0)
+		return ready;
+
+	poller = csp_poll_claim();
+	if (poller == NULL) {
+		csp_debug(CSP_WARN, "No free poll wait object\r\n");
+		return CSP_ERR_BUSY;
+	}
+
+	/* Clear stale wake up from previous user */
+	csp_bin_sem_wait(&poller->sem, 0);
+	if (csp_poll_register(fds, nfds, poller) != CSP_ERR_NONE) {
+		csp_debug(CSP_WARN, "Connection or socket is polled by another task\r\n");
+		__sync_synchronize();
+		poller->used = 0;
+		return CSP_ERR_BUSY;
+	}
+
+	start = csp_get_ms();
+	while ((ready = csp_poll_check(fds, nfds)) == 0) {
+		elapsed = csp_get_ms() - start;
+		if (timeout != CSP_MAX_DELAY && elapsed >= timeout)
+			break;
+		csp_bin_sem_wait(&poller->sem, timeout == CSP_MAX_DELAY ? CSP_MAX_DELAY : timeout - elapsed);
+	}
+
+	csp_poll_unregister(fds, nfds, poller);
+	__sync_synchronize();
+	poller->used = 0;
+
+	return ready;
+
+}
+
+#if CSP_USE_EVENTFD
+/*
+ * Eventfds are created on first request and live as long as the connection
+ * or socket struct, so the router never writes to a closed fd number.
+ */
+
+void csp_eventfd_signal(int fd, csp_queue_handle_t queue) {
+
+	uint64_t one = 1;
+
+	if (fd < 0)
+		return;
+
+	/* Only the first packet in an empty queue needs a system call */
+	if (queue == NULL || csp_queue_size(queue) == 1)
+		if (write(fd, &one, sizeof(one)) < 0)
+			csp_debug(CSP_WARN, "Failed to signal eventfd %d\r\n", fd);
+
+}
+
+void csp_eventfd_rearm(int fd, csp_queue_handle_t queue) {
+
+	uint64_t value;
+
+	if (fd < 0)
+		return;
+
+	if (read(fd, &value, sizeof(value)) < 0)
+		value = 0;
+
+	/* A packet queued between the empty check and the read lost its signal */
+	if (queue != NULL && csp_queue_size(queue) > 0)
+		csp_eventfd_signal(fd, NULL);
+
+}
+
+static int csp_eventfd_get(int * efd, csp_queue_handle_t queue) {
+
+	int fd;
+
+	if (*efd >= 0)
+		return *efd;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		csp_debug(CSP_ERROR, "Failed to create eventfd\r\n");
+		return CSP_ERR_NOMEM;
+	}
+
+	/* Another task may have created one first */
+	if (!__sync_bool_compare_and_swap(efd, -1, fd)) {
+		close(fd);
+		return *efd;
+	}
+
+	/* Report packets that were queued before the fd existed */
+	if (queue != NULL && csp_queue_size(queue) > 0)
+		csp_eventfd_signal(fd, NULL);
+
+	return fd;
+
+}
+
+int csp_conn_fd(csp_conn_t * conn) {
+
+	if (conn == NULL || conn->state != CONN_OPEN)
+		return CSP_ERR_INVAL;
+
+#if CSP_USE_QOS
+	return csp_eventfd_get(&conn->efd, conn->rx_event);
+#else
+	return csp_eventfd_get(&conn->efd, conn->rx_queue[0]);
+#endif
+
+}
+
+int csp_socket_fd(csp_socket_t * socket) {
+
+	if (socket == NULL || socket->queue == NULL)
+		return CSP_ERR_INVAL;
+
+	return csp_eventfd_get(&socket->efd, socket->queue);
+
+}
+#endif
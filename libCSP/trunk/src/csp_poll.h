@@ -0,0 +1,87 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_POLL_H_
+#define _CSP_POLL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+#include "arch/csp_queue.h"
+#include "arch/csp_semaphore.h"
+
+/** @brief Wait object of a task blocked in csp_poll */
+typedef struct csp_poller_s {
+	csp_bin_sem_handle_t sem;			/**< Posted when a polled object becomes ready */
+	volatile uint8_t used;				/**< Claimed by a task in csp_poll */
+} csp_poller_t;
+
+/**
+ * Create wait objects for csp_poll
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_poll_init(void);
+
+/**
+ * Wake task polling an object. Must be called after the packet or
+ * connection has been queued, with the poller field of the object.
+ * @param poller Poller registered on the object, may be NULL
+ */
+static inline void csp_poll_wake(csp_poller_t * poller) {
+	if (poller != NULL)
+		csp_bin_sem_post(&poller->sem);
+}
+
+#if CSP_USE_EVENTFD
+/**
+ * Signal eventfd of a connection or socket if its queue went from empty to
+ * non-empty. Does nothing if no eventfd has been requested.
+ * @param fd eventfd, or -1
+ * @param queue Queue that was added to, NULL to signal unconditionally
+ */
+void csp_eventfd_signal(int fd, csp_queue_handle_t queue);
+
+/**
+ * Clear eventfd after its queue was found empty. The fd is signalled again
+ * if the router queued something in the meantime.
+ * @param fd eventfd, or -1
+ * @param queue Queue that was found empty, NULL to only clear the fd
+ */
+void csp_eventfd_rearm(int fd, csp_queue_handle_t queue);
+
+/** Wake csp_poll and eventfd waiters of a connection or socket */
+#define csp_poll_signal(obj, queue) do { \
+		csp_poll_wake((obj)->poller); \
+		csp_eventfd_signal((obj)->efd, queue); \
+	} while (0)
+#else
+#define csp_poll_signal(obj, queue) csp_poll_wake((obj)->poller)
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_POLL_H_
@@ -36,18 +36,37 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 /* Allocation of ports */
 static csp_port_t ports[CSP_MAX_BIND_PORT + 2];
 
-csp_socket_t * csp_port_get_socket(unsigned int port) {
+#ifdef _CSP_POSIX_
+static csp_bin_sem_handle_t port_lock;
+#endif
 
-	csp_socket_t * ret = NULL;
+csp_socket_t * csp_port_get_socket(csp_id_t id) {
 
-	if (port > CSP_ANY)
+	csp_port_t * port;
+	csp_socket_t * ret;
+	unsigned int i;
+
+	if (id.dport > CSP_ANY)
 		return NULL;
 
 	/* Match dport to socket or local "catch all" port number */
-	if (ports[port].state == PORT_OPEN)
-		ret = ports[port].socket;
+	if (ports[id.dport].state == PORT_OPEN)
+		port = &ports[id.dport];
 	else if (ports[CSP_ANY].state == PORT_OPEN)
-		ret = ports[CSP_ANY].socket;
+		port = &ports[CSP_ANY];
+	else
+		return NULL;
+
+	ret = port->socket;
+
+	/* Select group member by source address and port. Sockets are only
+	 * appended to a group, and count is updated last, so the first count
+	 * sockets of the list are always valid. */
+	if (port->count > 1) {
+		i = ((((uint32_t) id.src << 6) | id.sport) * 2654435761u >> 16) % port->count;
+		while (i-- > 0)
+			ret = ret->next;
+	}
 
 	return ret;
 
@@ -55,6 +74,13 @@ csp_socket_t * csp_port_get_socket(unsigned int port) {
 
 int csp_port_init(void) {
 
+#ifdef _CSP_POSIX_
+	if (csp_bin_sem_create(&port_lock) != CSP_SEMAPHORE_OK) {
+		csp_debug(CSP_ERROR, "No more memory for port semaphore\r\n");
+		return CSP_ERR_NOMEM;
+	}
+#endif
+
 	memset(ports, PORT_CLOSED, sizeof(csp_port_t) * (CSP_MAX_BIND_PORT + 2));
 
 	return CSP_ERR_NONE;
@@ -81,18 +107,46 @@ int csp_bind(csp_socket_t * socket, uint8_t port) {
 		return CSP_ERR_INVAL;
 	}
 
-	/* Check if port number is valid */
+	CSP_ENTER_CRITICAL(port_lock);
+
+	/* Join reuseport group if all sockets allow it */
 	if (ports[port].state != PORT_CLOSED) {
-		csp_debug(CSP_ERROR, "Port %d is already in use\r\n", port);
-		return CSP_ERR_USED;
+		csp_socket_t * last = ports[port].socket;
+		int used = !(socket->opts & CSP_SO_REUSEPORT) || last->opts != socket->opts || ports[port].count == UINT8_MAX;
+
+		/* Find end of group, a socket can only be in it once */
+		while (!used && last->next != NULL) {
+			used = (last == socket);
+			last = last->next;
+		}
+		if (used || last == socket) {
+			CSP_EXIT_CRITICAL(port_lock);
+			csp_debug(CSP_ERROR, "Port %d is already in use\r\n", port);
+			return CSP_ERR_USED;
+		}
+
+		csp_debug(CSP_INFO, "Binding socket %p to port %u, group of %u\r\n", socket, port, ports[port].count + 1);
+
+		socket->next = NULL;
+		last->next = socket;
+		__sync_synchronize();
+		ports[port].count++;
+
+		CSP_EXIT_CRITICAL(port_lock);
+		return CSP_ERR_NONE;
 	}
 
 	csp_debug(CSP_INFO, "Binding socket %p to port %u\r\n", socket, port);
 
 	/* Save listener */
+	socket->next = NULL;
 	ports[port].socket = socket;
+	ports[port].count = 1;
+	__sync_synchronize();
 	ports[port].state = PORT_OPEN;
 
+	CSP_EXIT_CRITICAL(port_lock);
+
     return CSP_ERR_NONE;
 
 }
@@ -39,6 +39,7 @@ typedef enum {
 typedef struct {
     csp_port_state_t state;         // Port state
     csp_socket_t * socket;          // New connections are added to this socket's conn queue
+    uint8_t count;                  // Number of sockets in reuseport group
 } csp_port_t;
 
 /**
@@ -46,7 +47,12 @@ typedef struct {
  */
 int csp_port_init(void);
 
-csp_socket_t * csp_port_get_socket(unsigned int dport);
+/**
+ * Find socket for an incoming packet
+ * @param id CSP id of packet, the source address and port select the socket in a reuseport group
+ * @return socket bound to the destination port or CSP_ANY, NULL if none
+ */
+csp_socket_t * csp_port_get_socket(csp_id_t id);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,402 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Promiscuous mode capture taps.
+ * Each tap is a lossy ring of fixed size slots, holding a record header and
+ * up to snaplen bytes of packet data. Writers take a sequence number by
+ * incrementing the ring head and never block, so the oldest records are
+ * overwritten when a reader falls behind. Every slot carries a sequence word,
+ * which is odd while the slot is being written, so readers can detect torn or
+ * overwritten records without taking a lock. A writer claims its slot by a
+ * compare-and-swap on the sequence word, and gives up the record if a writer
+ * one lap behind is still using the slot. Captures are copied into the tap
+ * memory, and therefore never consume elements from the packet buffer pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+
+#include "arch/csp_semaphore.h"
+#include "arch/csp_malloc.h"
+#include "arch/csp_time.h"
+
+#include "csp_promisc.h"
+
+#if CSP_USE_PROMISC
+
+struct csp_promisc_tap_s {
+	uint32_t id;					/**< Identifier to match */
+	uint32_t mask;					/**< Identifier mask, 0 matches all packets */
+	unsigned int slots;				/**< Number of records in ring */
+	unsigned int snaplen;			/**< Maximum number of data bytes per record */
+	unsigned int slot_size;			/**< Size of one ring slot in bytes */
+	volatile uint8_t enabled;		/**< Tap is capturing */
+	volatile uint8_t waiting;		/**< Reader is blocked on wake semaphore */
+	volatile uint32_t head;			/**< Sequence number of next record to write */
+	uint32_t tail;					/**< Sequence number of next record to read */
+	uint32_t lost;					/**< Records overwritten before they were read */
+	csp_bin_sem_handle_t wake;		/**< Posted by writers when reader is waiting */
+	uint8_t * ring;					/**< Slot memory */
+};
+
+/* Ring slot layout */
+typedef struct {
+	volatile uint32_t seq;
+	volatile uint32_t skip;			/**< Sequence number of a record given up by its writer */
+	csp_promisc_record_t record;
+} csp_promisc_slot_t;
+
+/* Tap table */
+static csp_promisc_tap_t * volatile csp_promisc_taps[CSP_PROMISC_TAPS];
+
+/* Number of writers using each table entry. Entered before the tap pointer is
+ * loaded, so a tap is not freed while a writer may still hold the pointer. */
+static volatile uint32_t csp_promisc_busy[CSP_PROMISC_TAPS];
+
+/* Number of open taps, used as fast path when nobody is capturing */
+static volatile int csp_promisc_tap_count = 0;
+
+/* Tap used by the csp_promisc_enable/read interface */
+static csp_promisc_tap_t * csp_promisc_default = NULL;
+
+static inline csp_promisc_slot_t * csp_promisc_slot(csp_promisc_tap_t * tap, uint32_t seq) {
+	return (csp_promisc_slot_t *) (tap->ring + (seq % tap->slots) * tap->slot_size);
+}
+
+static void csp_promisc_tap_write(csp_promisc_tap_t * tap, csp_packet_t * packet, csp_iface_t * interface, uint8_t direction, uint32_t sec, uint32_t usec) {
+
+	uint32_t seq = __sync_fetch_and_add(&tap->head, 1);
+	csp_promisc_slot_t * slot = csp_promisc_slot(tap, seq);
+
+	/* Claim slot by marking it as being written */
+	while (1) {
+		uint32_t cur = slot->seq;
+
+		/* A writer one lap ahead has taken the slot, this record is lost */
+		if ((int32_t) (cur - (2 * seq + 1)) > 0)
+			return;
+
+		/* A writer one lap behind is still writing, give up this record */
+		if (cur & 1) {
+			slot->skip = seq;
+			if (tap->waiting)
+				csp_bin_sem_post(&tap->wake);
+			return;
+		}
+
+		if (__sync_bool_compare_and_swap(&slot->seq, cur, 2 * seq + 1))
+			break;
+	}
+
+	uint16_t caplen = (packet->length > tap->snaplen) ? tap->snaplen : packet->length;
+	slot->record.tv_sec = sec;
+	slot->record.tv_usec = usec;
+	slot->record.interface = interface;
+	slot->record.direction = direction;
+	slot->record.length = packet->length;
+	slot->record.caplen = caplen;
+	slot->record.id = packet->id;
+	memcpy(slot->record.data, packet->data, caplen);
+
+	/* Publish slot */
+	__sync_synchronize();
+	slot->seq = 2 * seq + 2;
+
+	if (tap->waiting)
+		csp_bin_sem_post(&tap->wake);
+
+}
+
+void csp_promisc_add(csp_packet_t * packet, csp_iface_t * interface, uint8_t direction) {
+
+	int i, stamped = 0;
+	uint32_t sec = 0, usec = 0;
+	csp_promisc_tap_t * tap;
+
+	if (csp_promisc_tap_count == 0)
+		return;
+
+	for (i = 0; i < CSP_PROMISC_TAPS; i++) {
+		if (csp_promisc_taps[i] == NULL)
+			continue;
+
+		/* Hold table entry while using the tap, so it is not released under us */
+		__sync_fetch_and_add(&csp_promisc_busy[i], 1);
+		tap = csp_promisc_taps[i];
+		if (tap != NULL && tap->enabled && (packet->id.ext & tap->mask) == (tap->id & tap->mask)) {
+			if (!stamped) {
+				csp_get_timestamp(&sec, &usec);
+				stamped = 1;
+			}
+			csp_promisc_tap_write(tap, packet, interface, direction, sec, usec);
+		}
+		__sync_fetch_and_sub(&csp_promisc_busy[i], 1);
+	}
+
+}
+
+csp_promisc_tap_t * csp_promisc_tap_open(unsigned int slots, unsigned int snaplen, uint32_t id, uint32_t mask) {
+
+	int i;
+
+	if (slots == 0 || snaplen > UINT16_MAX)
+		return NULL;
+
+	csp_promisc_tap_t * tap = csp_malloc(sizeof(csp_promisc_tap_t));
+	if (tap == NULL)
+		return NULL;
+
+	tap->id = id;
+	tap->mask = mask;
+	tap->slots = slots;
+	tap->snaplen = snaplen;
+	tap->slot_size = (sizeof(csp_promisc_slot_t) + snaplen + 3) & ~3;
+	tap->enabled = 1;
+	tap->waiting = 0;
+	tap->head = 0;
+	tap->tail = 0;
+	tap->lost = 0;
+
+	tap->ring = csp_malloc(slots * tap->slot_size);
+	if (tap->ring == NULL) {
+		csp_free(tap);
+		return NULL;
+	}
+
+	/* No slot has been published yet */
+	for (i = 0; i < (int) slots; i++) {
+		csp_promisc_slot(tap, i)->seq = 0;
+		csp_promisc_slot(tap, i)->skip = i - slots;
+	}
+
+	if (csp_bin_sem_create(&tap->wake) != CSP_SEMAPHORE_OK) {
+		csp_free(tap->ring);
+		csp_free(tap);
+		return NULL;
+	}
+
+	/* Ensure semaphore is busy, so writers can release it */
+	csp_bin_sem_wait(&tap->wake, 0);
+
+	/* Insert in tap table */
+	for (i = 0; i < CSP_PROMISC_TAPS; i++) {
+		if (__sync_bool_compare_and_swap(&csp_promisc_taps[i], NULL, tap)) {
+			__sync_fetch_and_add(&csp_promisc_tap_count, 1);
+			return tap;
+		}
+	}
+
+	csp_debug(CSP_ERROR, "No more free promiscuous mode taps\r\n");
+	csp_bin_sem_remove(&tap->wake);
+	csp_free(tap->ring);
+	csp_free(tap);
+	return NULL;
+
+}
+
+void csp_promisc_tap_close(csp_promisc_tap_t * tap) {
+
+	int i;
+
+	if (tap == NULL)
+		return;
+
+	for (i = 0; i < CSP_PROMISC_TAPS; i++) {
+		if (__sync_bool_compare_and_swap(&csp_promisc_taps[i], tap, NULL)) {
+			__sync_fetch_and_sub(&csp_promisc_tap_count, 1);
+
+			/* Wait for writers that may have loaded the pointer to leave */
+			while (csp_promisc_busy[i])
+				__sync_synchronize();
+			break;
+		}
+	}
+
+	if (tap == csp_promisc_default)
+		csp_promisc_default = NULL;
+
+	csp_bin_sem_remove(&tap->wake);
+	csp_free(tap->ring);
+	csp_free(tap);
+
+}
+
+void csp_promisc_tap_enable(csp_promisc_tap_t * tap, int enable) {
+
+	if (tap != NULL)
+		tap->enabled = enable ? 1 : 0;
+
+}
+
+uint32_t csp_promisc_tap_lost(csp_promisc_tap_t * tap) {
+
+	return (tap != NULL) ? tap->lost : 0;
+
+}
+
+/**
+ * Copy the oldest unread record out of a tap, without blocking
+ * @return 1 if a record was copied, 0 if the tap is empty
+ */
+static int csp_promisc_tap_get(csp_promisc_tap_t * tap, csp_promisc_record_t * header, uint8_t * data, unsigned int size) {
+
+	uint32_t head, seq;
+	csp_promisc_slot_t * slot;
+
+	while (1) {
+
+		head = tap->head;
+		if (tap->tail == head)
+			return 0;
+
+		/* Skip records that have already been overwritten */
+		if (head - tap->tail > tap->slots) {
+			tap->lost += head - tap->tail - tap->slots;
+			tap->tail = head - tap->slots;
+		}
+
+		slot = csp_promisc_slot(tap, tap->tail);
+		seq = slot->seq;
+		__sync_synchronize();
+
+		/* Writer has claimed the slot, but not published it yet */
+		if ((int32_t) (seq - (2 * tap->tail + 2)) < 0) {
+			if (slot->skip != tap->tail)
+				return 0;
+
+			/* Writer gave up the record, as the slot was still in use */
+			tap->lost++;
+			tap->tail++;
+			continue;
+		}
+
+		if (seq == 2 * tap->tail + 2) {
+			*header = slot->record;
+			if (header->caplen > size)
+				header->caplen = size;
+			memcpy(data, slot->record.data, header->caplen);
+			__sync_synchronize();
+
+			/* Record was not touched while copying */
+			if (slot->seq == seq) {
+				tap->tail++;
+				return 1;
+			}
+		}
+
+		/* Overwritten, try the next record */
+		tap->lost++;
+		tap->tail++;
+
+	}
+
+}
+
+static int csp_promisc_tap_wait(csp_promisc_tap_t * tap, csp_promisc_record_t * header, uint8_t * data, unsigned int size, unsigned int timeout) {
+
+	if (csp_promisc_tap_get(tap, header, data, size))
+		return 1;
+
+	if (timeout == 0)
+		return 0;
+
+	/* Ask writers to wake us, and check again to avoid missing a record */
+	tap->waiting = 1;
+	__sync_synchronize();
+	if (!csp_promisc_tap_get(tap, header, data, size))
+		csp_bin_sem_wait(&tap->wake, timeout);
+	else {
+		tap->waiting = 0;
+		return 1;
+	}
+	tap->waiting = 0;
+
+	return csp_promisc_tap_get(tap, header, data, size);
+
+}
+
+int csp_promisc_tap_read(csp_promisc_tap_t * tap, csp_promisc_record_t * record, unsigned int size, unsigned int timeout) {
+
+	if (tap == NULL || record == NULL || size < sizeof(csp_promisc_record_t))
+		return CSP_ERR_INVAL;
+
+	if (!csp_promisc_tap_wait(tap, record, record->data, size - sizeof(csp_promisc_record_t), timeout))
+		return CSP_ERR_TIMEDOUT;
+
+	return record->caplen;
+
+}
+
+int csp_promisc_enable(unsigned int buf_size) {
+
+	/* If tap already initialised */
+	if (csp_promisc_default != NULL) {
+		csp_promisc_tap_enable(csp_promisc_default, 1);
+		return 1;
+	}
+
+	if (buf_size == 0)
+		return 0;
+
+	/* Capture complete packets, up to the size of a packet buffer */
+	csp_promisc_default = csp_promisc_tap_open(buf_size, csp_buffer_data_size(), 0, 0);
+
+	return (csp_promisc_default != NULL) ? 1 : 0;
+
+}
+
+void csp_promisc_disable(void) {
+
+	csp_promisc_tap_enable(csp_promisc_default, 0);
+
+}
+
+csp_packet_t * csp_promisc_read(unsigned int timeout) {
+
+	csp_promisc_tap_t * tap = csp_promisc_default;
+	csp_promisc_record_t header;
+
+	if (tap == NULL)
+		return NULL;
+
+	csp_packet_t * packet = csp_buffer_get(tap->snaplen);
+	if (packet == NULL)
+		return NULL;
+
+	if (!csp_promisc_tap_wait(tap, &header, packet->data, tap->snaplen, timeout)) {
+		csp_buffer_free(packet);
+		return NULL;
+	}
+
+	packet->id = header.id;
+	packet->length = header.caplen;
+
+	return packet;
+
+}
+
+#endif // CSP_USE_PROMISC
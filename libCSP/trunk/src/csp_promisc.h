@@ -0,0 +1,49 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_PROMISC_H_
+#define _CSP_PROMISC_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+#if CSP_USE_PROMISC
+/**
+ * Offer packet to all promiscuous mode taps
+ * The packet is copied into every enabled tap with a matching filter.
+ * This call never blocks and never allocates packet buffers.
+ *
+ * @param packet Packet to capture
+ * @param interface Interface the packet was received or sent on
+ * @param direction CSP_PROMISC_IN or CSP_PROMISC_OUT
+ */
+void csp_promisc_add(csp_packet_t * packet, csp_iface_t * interface, uint8_t direction);
+#endif
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_PROMISC_H_
@@ -45,6 +45,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "csp_route.h"
 #include "csp_conn.h"
 #include "csp_io.h"
+#include "csp_promisc.h"
+#include "csp_timer.h"
+#include "csp_callback.h"
+#include "csp_frag.h"
 #include "transport/csp_transport.h"
 
 csp_thread_handle_t handle_router;
@@ -54,16 +58,14 @@ csp_iface_t * interfaces;
 csp_route_t routes[CSP_ID_HOST_MAX + 2];
 csp_mutex_t routes_lock;
 
+/* Longest time the router blocks for input, when no timer is due earlier */
+#define CSP_ROUTE_MAX_WAIT	100
+
 static csp_queue_handle_t router_input_fifo[CSP_ROUTE_FIFOS];
 #if CSP_USE_QOS
 static csp_queue_handle_t router_input_event;
 #endif
 
-#if CSP_USE_PROMISC
-csp_queue_handle_t csp_promisc_queue = NULL;
-int csp_promisc_enabled = 0;
-#endif
-
 extern int csp_route_input_hook(csp_packet_t * packet) __attribute__((weak));
 
 typedef struct {
@@ -187,11 +189,14 @@ int csp_route_table_init(void) {
 
 int csp_route_next_packet(csp_route_queue_t * input) {
 
+	/* Wake up in time for the next connection timer */
+	uint32_t timeout = csp_timer_next_timeout(CSP_ROUTE_MAX_WAIT);
+
 #if CSP_USE_QOS
 	int prio, found, event;
 
 	/* Wait for packet in any queue */
-	if (csp_queue_dequeue(router_input_event, &event, 100) != CSP_QUEUE_OK)
+	if (csp_queue_dequeue(router_input_event, &event, timeout) != CSP_QUEUE_OK)
 		return CSP_ERR_TIMEDOUT;
 
 	/* Find packet with highest priority */
@@ -208,10 +213,14 @@ int csp_route_next_packet(csp_route_queue_t * input) {
 		return CSP_ERR_TIMEDOUT;
 	}
 #else
-	if (csp_queue_dequeue(router_input_fifo[0], input, 100) != CSP_QUEUE_OK)
+	if (csp_queue_dequeue(router_input_fifo[0], input, timeout) != CSP_QUEUE_OK)
 		return CSP_ERR_TIMEDOUT;
 #endif
 
+	/* Wakeup from csp_route_wakeup, not a packet */
+	if (input->packet == NULL)
+		return CSP_ERR_TIMEDOUT;
+
 	return CSP_ERR_NONE;
 
 }
@@ -236,8 +245,11 @@ csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters)
     /* Here there be routing */
 	while (1) {
 
-		/* Check connection timeouts */
-		csp_conn_check_timeouts();
+		/* Call expired connection timers */
+		csp_timer_run();
+
+		/* Deliver packets queued for receive callbacks */
+		csp_callback_run();
 
 		/* Get next packet to route */
 		if (csp_route_next_packet(&input) != CSP_ERR_NONE)
@@ -257,7 +269,7 @@ csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters)
 
 		/* Here there be promiscuous mode */
 #if CSP_USE_PROMISC
-		csp_promisc_add(packet, csp_promisc_queue);
+		csp_promisc_add(packet, input.interface, CSP_PROMISC_IN);
 #endif
 
 		/* If the message is not to me, route the message to the correct interface */
@@ -283,8 +295,17 @@ csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters)
 
 		}
 
+#if CSP_USE_FRAG
+		/* Collect fragments until the whole packet has arrived */
+		if (packet->id.flags & CSP_FFRAG) {
+			packet = csp_frag_input(packet);
+			if (packet == NULL)
+				continue;
+		}
+#endif
+
 		/* The message is to me, search for incoming socket */
-		socket = csp_port_get_socket(packet->id.dport);
+		socket = csp_port_get_socket(packet->id);
 
 		/* If the socket is connection-less, deliver now */
 		if (socket && (socket->opts & CSP_SO_CONN_LESS)) {
@@ -297,6 +318,8 @@ csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters)
 				csp_buffer_free(packet);
 				continue;
 			}
+			csp_poll_signal(socket, socket->queue);
+			csp_callback_schedule_socket(socket);
 			continue;
 		}
 
@@ -330,9 +353,11 @@ csp_thread_return_t vTaskCSPRouter(__attribute__ ((unused)) void * pvParameters)
 				continue;
 			}
 
-			/* Store the socket queue and options */
-			conn->rx_socket = socket->queue;
+			/* Store the socket and options */
+			conn->rx_socket = socket;
 			conn->conn_opts = socket->opts;
+			conn->callback_arg = socket->callback_arg;
+			conn->callback = socket->callback;
 
 		}
 
@@ -495,6 +520,17 @@ void csp_new_packet(csp_packet_t * packet, csp_iface_t * interface, CSP_BASE_TYP
 
 }
 
+void csp_route_wakeup(void) {
+
+	csp_route_queue_t queue_element;
+	queue_element.interface = NULL;
+	queue_element.packet = NULL;
+
+	/* If the queue is full, the router task is not waiting anyway */
+	csp_route_enqueue(router_input_fifo[CSP_ROUTE_FIFOS - 1], &queue_element, 0, NULL);
+
+}
+
 uint8_t csp_route_get_nexthop_mac(uint8_t node) {
 
 	csp_route_t * route = csp_route_if(node);
@@ -576,61 +612,3 @@ void csp_route_print_table(void) {
 
 }
 #endif
-
-#if CSP_USE_PROMISC
-int csp_promisc_enable(unsigned int buf_size) {
-
-	/* If queue already initialised */
-    if (csp_promisc_queue != NULL) {
-    	csp_promisc_enabled = 1;
-    	return 1;
-    }
-    
-    /* Create packet queue */
-    csp_promisc_queue = csp_queue_create(buf_size, sizeof(csp_packet_t *));
-    
-    if (csp_promisc_queue != NULL) {
-    	csp_promisc_enabled = 1;
-    	return 1;
-    } else {
-    	return 0;
-    }
-
-}
-
-void csp_promisc_disable(void) {
-	csp_promisc_enabled = 0;
-}
-
-csp_packet_t * csp_promisc_read(unsigned int timeout) {
-
-    if (csp_promisc_queue == NULL)
-    	return NULL;
-
-    csp_packet_t * packet = NULL;
-    csp_queue_dequeue(csp_promisc_queue, &packet, timeout);
-
-    return packet;
-
-}
-
-
-void csp_promisc_add(csp_packet_t * packet, csp_queue_handle_t queue) {
-
-	if (csp_promisc_enabled == 0)
-		return;
-
-	if (queue != NULL) {
-		/* Make a copy of the message and queue it to the promiscuous task */
-		csp_packet_t * packet_copy = csp_buffer_get(packet->length);
-		if (packet_copy != NULL) {
-			memcpy(&packet_copy->length, &packet->length, packet->length + 6);
-			if (csp_queue_enqueue(queue, &packet_copy, 0) != CSP_QUEUE_OK) {
-				csp_debug(CSP_ERROR, "Promiscuous mode input queue full\r\n");
-				csp_buffer_free(packet_copy);
-			}
-		}
-	}
-
-}
-#endif
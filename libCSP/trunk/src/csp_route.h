@@ -51,6 +51,13 @@ int csp_route_table_init(void);
  */
 csp_route_t * csp_route_if(uint8_t id);
 
+/**
+ * Wake the router task from waiting for input, so it calls expired
+ * timers and computes a new wait. Used when a timer is armed to expire
+ * before the router task would otherwise wake up.
+ */
+void csp_route_wakeup(void);
+
 /**
  * Router Task
  * This task received any non-local connection and collects the data
@@ -59,17 +66,6 @@ csp_route_t * csp_route_if(uint8_t id);
  */
 csp_thread_return_t vTaskCSPRouter(void * pvParameters);
 
-#if CSP_USE_PROMISC
-/**
- * Add packet to promiscuous mode packet queue
- *
- * @param packet Packet to add to the queue
- * @param queue Promiscuous mode packet queue
- *
- */
-void csp_promisc_add(csp_packet_t * packet, csp_queue_handle_t queue);
-#endif
-
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
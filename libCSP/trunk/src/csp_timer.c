@@ -0,0 +1,287 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Hierarchical timer wheel.
+ * The near wheel has one slot per tick of CSP_TIMER_RESOLUTION ms. The far
+ * wheel has one slot per revolution of the near wheel, and its timers are
+ * moved to the near wheel when the near wheel wraps. Arming, moving and
+ * cancelling a timer is O(1), and advancing the wheel only touches timers
+ * in the slots that are passed. Timers further away than the far wheel are
+ * parked in its last slot and cascaded again until they are in range.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* CSP includes */
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+
+#include "arch/csp_semaphore.h"
+#include "arch/csp_thread.h"
+#include "arch/csp_time.h"
+
+#include "csp_timer.h"
+#include "csp_route.h"
+
+#define TIMER_NEAR_BITS		8
+#define TIMER_FAR_BITS		6
+#define TIMER_NEAR_SIZE		(1 << TIMER_NEAR_BITS)
+#define TIMER_FAR_SIZE		(1 << TIMER_FAR_BITS)
+#define TIMER_NEAR_MASK		(TIMER_NEAR_SIZE - 1)
+#define TIMER_FAR_MASK		(TIMER_FAR_SIZE - 1)
+
+static csp_timer_t * timer_near[TIMER_NEAR_SIZE];
+static csp_timer_t * timer_far[TIMER_FAR_SIZE];
+
+/* Current tick, and the time in ms it was reached */
+static uint32_t timer_tick;
+static uint32_t timer_ms;
+
+/* Time the router task wakes up, if it is blocked */
+static uint32_t timer_wake_ms;
+static uint8_t timer_sleeping;
+
+#ifdef _CSP_POSIX_
+static csp_bin_sem_handle_t timer_lock;
+#endif
+
+static void csp_timer_link(csp_timer_t * timer) {
+
+	csp_timer_t ** head;
+	uint32_t delta = timer->tick - timer_tick;
+
+	if (delta < TIMER_NEAR_SIZE) {
+		head = &timer_near[timer->tick & TIMER_NEAR_MASK];
+	} else if (delta < (TIMER_FAR_SIZE - 1) << TIMER_NEAR_BITS) {
+		head = &timer_far[(timer->tick >> TIMER_NEAR_BITS) & TIMER_FAR_MASK];
+	} else {
+		/* Out of range, park in the slot that cascades last */
+		head = &timer_far[((timer_tick >> TIMER_NEAR_BITS) + TIMER_FAR_SIZE - 1) & TIMER_FAR_MASK];
+	}
+
+	timer->next = *head;
+	if (timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+	timer->pending = 1;
+
+}
+
+static void csp_timer_unlink(csp_timer_t * timer) {
+
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->pending = 0;
+
+}
+
+int csp_timer_init(void) {
+
+	int i;
+
+#ifdef _CSP_POSIX_
+	if (csp_bin_sem_create(&timer_lock) != CSP_SEMAPHORE_OK) {
+		csp_debug(CSP_ERROR, "No more memory for timer semaphore\r\n");
+		return CSP_ERR_NOMEM;
+	}
+#endif
+
+	for (i = 0; i < TIMER_NEAR_SIZE; i++)
+		timer_near[i] = NULL;
+	for (i = 0; i < TIMER_FAR_SIZE; i++)
+		timer_far[i] = NULL;
+
+	timer_tick = 0;
+	timer_ms = csp_get_ms();
+
+	return CSP_ERR_NONE;
+
+}
+
+void csp_timer_create(csp_timer_t * timer, csp_timer_callback_t callback, void * arg) {
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->callback = callback;
+	timer->arg = arg;
+	timer->pending = 0;
+	timer->running = 0;
+
+}
+
+static int csp_timer_arm(csp_timer_t * timer, uint32_t expires) {
+
+	int32_t delta = expires - timer_ms;
+
+	if (timer->pending)
+		csp_timer_unlink(timer);
+
+	/* Never expire before the requested time, and never in the current tick */
+	timer->expires = expires;
+	timer->tick = timer_tick + 1;
+	if (delta > CSP_TIMER_RESOLUTION)
+		timer->tick = timer_tick + (delta + CSP_TIMER_RESOLUTION - 1) / CSP_TIMER_RESOLUTION;
+
+	csp_timer_link(timer);
+
+	/* Return if the router task sleeps past the expiry, and must be woken */
+	if (timer_sleeping && (int32_t) (expires - timer_wake_ms) < 0) {
+		timer_sleeping = 0;
+		return 1;
+	}
+
+	return 0;
+
+}
+
+void csp_timer_set(csp_timer_t * timer, uint32_t expires) {
+
+	int wake;
+
+	CSP_ENTER_CRITICAL(timer_lock);
+	wake = csp_timer_arm(timer, expires);
+	CSP_EXIT_CRITICAL(timer_lock);
+
+	if (wake)
+		csp_route_wakeup();
+
+}
+
+void csp_timer_set_earlier(csp_timer_t * timer, uint32_t expires) {
+
+	int wake = 0;
+
+	CSP_ENTER_CRITICAL(timer_lock);
+	if (!timer->pending || (int32_t) (expires - timer->expires) < 0)
+		wake = csp_timer_arm(timer, expires);
+	CSP_EXIT_CRITICAL(timer_lock);
+
+	if (wake)
+		csp_route_wakeup();
+
+}
+
+void csp_timer_cancel(csp_timer_t * timer) {
+
+	CSP_ENTER_CRITICAL(timer_lock);
+	if (timer->pending)
+		csp_timer_unlink(timer);
+	CSP_EXIT_CRITICAL(timer_lock);
+
+}
+
+void csp_timer_cancel_sync(csp_timer_t * timer) {
+
+	int running;
+
+	/* The callback may arm the timer again while we wait */
+	do {
+		CSP_ENTER_CRITICAL(timer_lock);
+		if (timer->pending)
+			csp_timer_unlink(timer);
+		running = timer->running;
+		CSP_EXIT_CRITICAL(timer_lock);
+		if (running)
+			csp_sleep_ms(1);
+	} while (running);
+
+}
+
+uint32_t csp_timer_next_timeout(uint32_t max_ms) {
+
+	uint32_t d, ticks;
+	int32_t timeout;
+	uint32_t now = csp_get_ms();
+
+	CSP_ENTER_CRITICAL(timer_lock);
+
+	/* Ticks to look ahead, never past the next wrap, which cascades the far wheel */
+	ticks = max_ms / CSP_TIMER_RESOLUTION + 1;
+	if (ticks > TIMER_NEAR_SIZE - (timer_tick & TIMER_NEAR_MASK))
+		ticks = TIMER_NEAR_SIZE - (timer_tick & TIMER_NEAR_MASK);
+
+	for (d = 1; d < ticks; d++)
+		if (timer_near[(timer_tick + d) & TIMER_NEAR_MASK] != NULL)
+			break;
+
+	timeout = timer_ms + d * CSP_TIMER_RESOLUTION - now;
+	if (timeout < 0)
+		timeout = 0;
+	if ((uint32_t) timeout > max_ms)
+		timeout = max_ms;
+
+	/* Timers armed to expire before this must wake the caller */
+	timer_wake_ms = now + timeout;
+	timer_sleeping = 1;
+
+	CSP_EXIT_CRITICAL(timer_lock);
+
+	return timeout;
+
+}
+
+void csp_timer_run(void) {
+
+	csp_timer_t * timer;
+	csp_timer_t ** slot;
+	uint32_t now = csp_get_ms();
+
+	CSP_ENTER_CRITICAL(timer_lock);
+
+	/* The router task is awake, and will look at new timers before blocking */
+	timer_sleeping = 0;
+
+	while ((int32_t) (now - timer_ms) >= CSP_TIMER_RESOLUTION) {
+
+		timer_tick++;
+		timer_ms += CSP_TIMER_RESOLUTION;
+
+		/* Near wheel wrapped, move next far slot into near wheel */
+		if ((timer_tick & TIMER_NEAR_MASK) == 0) {
+			slot = &timer_far[(timer_tick >> TIMER_NEAR_BITS) & TIMER_FAR_MASK];
+			while ((timer = *slot) != NULL) {
+				csp_timer_unlink(timer);
+				csp_timer_link(timer);
+			}
+		}
+
+		/* Expire timers in current slot. The lock is released while calling
+		 * back, so callbacks can arm and cancel timers, also this one. */
+		slot = &timer_near[timer_tick & TIMER_NEAR_MASK];
+		while ((timer = *slot) != NULL) {
+			csp_timer_unlink(timer);
+			timer->running = 1;
+			CSP_EXIT_CRITICAL(timer_lock);
+			timer->callback(timer->arg);
+			CSP_ENTER_CRITICAL(timer_lock);
+			timer->running = 0;
+		}
+
+	}
+
+	CSP_EXIT_CRITICAL(timer_lock);
+
+}
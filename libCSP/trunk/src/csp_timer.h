@@ -0,0 +1,110 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef _CSP_TIMER_H_
+#define _CSP_TIMER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include <csp/csp.h>
+
+/** Timer expiry callback, called from the router task */
+typedef void (*csp_timer_callback_t)(void * arg);
+
+/** @brief Timer struct, embedded in the object that owns the timer */
+typedef struct csp_timer_s {
+	struct csp_timer_s * next;			/**< Next timer in wheel slot */
+	struct csp_timer_s ** pprev;		/**< Link pointing to this timer */
+	uint32_t expires;					/**< Expiry time in ms */
+	uint32_t tick;						/**< Expiry time in wheel ticks */
+	csp_timer_callback_t callback;		/**< Function to call on expiry */
+	void * arg;							/**< Callback argument */
+	uint8_t pending;					/**< Timer is in the wheel */
+	volatile uint8_t running;			/**< Callback is being called */
+} csp_timer_t;
+
+/**
+ * Initialise timer wheel
+ * @return CSP_ERR_NONE on success, otherwise an error code
+ */
+int csp_timer_init(void);
+
+/**
+ * Prepare timer for use
+ * @param timer Timer to prepare
+ * @param callback Function to call when timer expires
+ * @param arg Argument passed to callback
+ */
+void csp_timer_create(csp_timer_t * timer, csp_timer_callback_t callback, void * arg);
+
+/**
+ * Arm timer, or move an armed timer to a new expiry time
+ * @param timer Timer to arm
+ * @param expires Absolute expiry time in ms, as returned by csp_get_ms()
+ */
+void csp_timer_set(csp_timer_t * timer, uint32_t expires);
+
+/**
+ * Arm timer, unless it is already armed to expire before the given time
+ * @param timer Timer to arm
+ * @param expires Absolute expiry time in ms, as returned by csp_get_ms()
+ */
+void csp_timer_set_earlier(csp_timer_t * timer, uint32_t expires);
+
+/**
+ * Disarm timer
+ * @param timer Timer to disarm
+ */
+void csp_timer_cancel(csp_timer_t * timer);
+
+/**
+ * Disarm timer and wait for a callback that is already running to return,
+ * so the object owning the timer can be freed. Must not be called from the
+ * timer callback, or from anything it waits for.
+ * @param timer Timer to disarm
+ */
+void csp_timer_cancel_sync(csp_timer_t * timer);
+
+/**
+ * Time until the next armed timer expires, so the caller of csp_timer_run
+ * knows how long it may block. Only the near wheel is searched up to the
+ * given limit, timers further away return the limit. Until the next
+ * csp_timer_run, arming a timer that expires earlier calls
+ * csp_route_wakeup, so only the router task may call this.
+ * @param max_ms Longest time to return in ms
+ * @return Time in ms until csp_timer_run must be called again, 0 if now
+ */
+uint32_t csp_timer_next_timeout(uint32_t max_ms);
+
+/**
+ * Advance timer wheel to the current time and call expired timers.
+ * Must be called regularly, this is done by the router task.
+ */
+void csp_timer_run(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif // _CSP_TIMER_H_
@@ -59,6 +59,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 csp_iface_t csp_if_can = {
 	.name = "CAN",
 	.nexthop = csp_can_tx,
+	.nexthop_many = csp_can_tx_many,
 	.mtu = 256,
 };
 
@@ -98,6 +99,9 @@ csp_iface_t csp_if_can = {
 /** Buffer element timeout in ms */
 #define PBUF_TIMEOUT_MS 10000
 
+/** Packets in flight per blocking csp_can_tx_many call */
+#define CFP_TX_WINDOW 4
+
 /** CFP Frame Types */
 enum cfp_frame_t {
     CFP_BEGIN = 0,
@@ -131,13 +135,14 @@ static int id_init(void) {
 
 }
 
-static int id_get(void) {
+/* Reserve count consecutive identification numbers, returns the first */
+static int id_get(unsigned int count) {
 
     int id;
     if (csp_bin_sem_wait(&id_sem, 1000) != CSP_SEMAPHORE_OK)
     	return -1;
-    id = cfp_id++;
-    cfp_id = cfp_id & ((1 << CFP_ID_SIZE) - 1);
+    id = cfp_id;
+    cfp_id = (cfp_id + count) & ((1 << CFP_ID_SIZE) - 1);
     csp_bin_sem_post(&id_sem);
     return id;
 
@@ -530,18 +535,18 @@ int csp_rx_callback(can_frame_t * frame, CSP_BASE_TYPE * task_woken) {
 
 }
 
-int csp_can_tx(csp_packet_t * packet, unsigned int timeout) {
+/**
+ * Claim a packet buffer element for packet and send its first frame. The
+ * remaining frames are sent from the transmit callback.
+ * @param packet Packet to transmit
+ * @param ident CFP identification number
+ * @return Packet buffer element on success, NULL if the packet was not sent.
+ */
+static pbuf_element_t * csp_can_tx_begin(csp_packet_t * packet, int ident) {
 
 	uint8_t bytes, overhead, avail;
 	uint8_t frame_buf[8];
 
-	/* Get CFP identification number */
-	int ident = id_get();
-	if (ident < 0) {
-		csp_debug(CSP_WARN, "Failed to get CFP identification number\r\n");
-		return 0;
-	}
-	
 	/* Calculate overhead */
 	overhead = sizeof(csp_id_t) + sizeof(uint16_t);
 
@@ -558,7 +563,7 @@ int csp_can_tx(csp_packet_t * packet, unsigned int timeout) {
 
 	if (buf == NULL) {
 		csp_debug(CSP_WARN, "Failed to get packet buffer for CAN\r\n");
-		return 0;
+		return NULL;
 	}
 
 	/* Set packet */
@@ -582,17 +587,26 @@ int csp_can_tx(csp_packet_t * packet, unsigned int timeout) {
 	/* Take semaphore so driver can post it later */
 	csp_bin_sem_wait(&buf->tx_sem, 0);
 
-	/* Send frame */
+	/* Send frame. The caller still owns the packet, so release the buffer element without it */
 	if (can_send(id, frame_buf, overhead + bytes, NULL) != 0) {
 		csp_debug(CSP_WARN, "Failed to send CAN frame in csp_tx_can\r\n");
-		return 0;
+		buf->packet = NULL;
+		pbuf_free(buf, NULL);
+		return NULL;
 	}
 
-    /* Non blocking mode */
-    if (timeout == 0)
-        return 1;
+	return buf;
+
+}
+
+/**
+ * Wait for the last frame of a packet to be sent
+ * @param buf Packet buffer element returned by csp_can_tx_begin
+ * @param timeout Timeout in ms
+ * @return 1 if the packet was sent, 0 on timeout
+ */
+static int csp_can_tx_wait(pbuf_element_t * buf, unsigned int timeout) {
 
-    /* Blocking mode */
     if (csp_bin_sem_wait(&buf->tx_sem, timeout) != CSP_SEMAPHORE_OK) {
         csp_bin_sem_post(&buf->tx_sem);
         return 0;
@@ -603,6 +617,79 @@ int csp_can_tx(csp_packet_t * packet, unsigned int timeout) {
 
 }
 
+int csp_can_tx(csp_packet_t * packet, unsigned int timeout) {
+
+	/* Get CFP identification number */
+	int ident = id_get(1);
+	if (ident < 0) {
+		csp_debug(CSP_WARN, "Failed to get CFP identification number\r\n");
+		return 0;
+	}
+
+	pbuf_element_t * buf = csp_can_tx_begin(packet, ident);
+	if (buf == NULL)
+		return 0;
+
+    /* Non blocking mode */
+    if (timeout == 0)
+        return 1;
+
+    /* Blocking mode */
+    return csp_can_tx_wait(buf, timeout);
+
+}
+
+int csp_can_tx_many(csp_packet_t ** packets, unsigned int count, unsigned int timeout) {
+
+	pbuf_element_t * buf, * window[CFP_TX_WINDOW];
+	unsigned int started = 0, sent = 0;
+
+	/* One identification number per packet, taken under one lock */
+	int ident = id_get(count);
+	if (ident < 0) {
+		csp_debug(CSP_WARN, "Failed to get CFP identification number\r\n");
+		return 0;
+	}
+
+	/* Non blocking mode, start packets until the driver is out of room */
+	if (timeout == 0) {
+		while (started < count && csp_can_tx_begin(packets[started], ident + started) != NULL)
+			started++;
+		return started;
+	}
+
+	/* Blocking mode. Keep a window of packets in flight, so the first frame
+	 * of the next packet is queued while the driver sends the previous one.
+	 * The timeout applies to the whole batch. */
+	uint32_t begin = csp_get_ms();
+	while (sent < count) {
+
+		if (started < count && started - sent < CFP_TX_WINDOW) {
+			buf = csp_can_tx_begin(packets[started], ident + started);
+			if (buf != NULL) {
+				window[started % CFP_TX_WINDOW] = buf;
+				started++;
+				continue;
+			}
+			/* No packet in flight will make room */
+			if (started == sent)
+				break;
+		}
+
+		/* Wait for the oldest packet in flight */
+		uint32_t elapsed = csp_get_ms() - begin;
+		if (elapsed >= timeout || !csp_can_tx_wait(window[sent % CFP_TX_WINDOW], timeout - elapsed))
+			break;
+		sent++;
+
+	}
+
+	/* Packets that were started belong to the driver, which frees them when
+	 * done, so they are accepted even if waiting for them timed out */
+	return started;
+
+}
+
 int csp_can_init(uint8_t mode, void * conf, int conflen) {
 
     uint32_t mask;
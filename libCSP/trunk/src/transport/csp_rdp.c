@@ -50,15 +50,30 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define RDP_EAK 0x04
 #define RDP_RST	0x08
 
+/* SYN option flags */
+#define RDP_OPT_SACK	0x01		// EACK carries a bitmap instead of a list
+#define RDP_OPT_FASTOPEN 0x02		// Data follows the SYN without waiting for the SYN/ACK
+
+/* Fast open state of a connection */
+#define RDP_FASTOPEN_OFF		0	// Data waits for the handshake
+#define RDP_FASTOPEN_REQUESTED	1	// Client sends data behind the SYN
+#define RDP_FASTOPEN_ACCEPTED	2	// Server delivers data received before the handshake completes
+
 static uint32_t csp_rdp_window_size = 4;
 static uint32_t csp_rdp_conn_timeout = 10000;
 static uint32_t csp_rdp_packet_timeout = 1000;
 static uint32_t csp_rdp_delayed_acks = 1;
 static uint32_t csp_rdp_ack_timeout = 1000 / 4;
 static uint32_t csp_rdp_ack_delay_count = 4 / 2;
+static uint32_t csp_rdp_max_window = CSP_RDP_MAX_WINDOW;
 
-/* Used for queue calls */
-static CSP_BASE_TYPE pdTrue = 1;
+/* Ports that echoed fast open in their last SYN/ACK, one bit per host and
+ * port. Only these get data behind the SYN. */
+#define RDP_FASTOPEN_PEERS	((CSP_ID_HOST_MAX + 1) * (CSP_ID_PORT_MAX + 1))
+static uint32_t csp_rdp_fastopen_peers[(RDP_FASTOPEN_PEERS + 31) / 32];
+
+/** Largest window csp_rdp_set_max_window accepts, keeps two windows well inside the sequence space */
+#define RDP_WINDOW_LIMIT	4096
 
 typedef struct __attribute__((__packed__)) {
     /* The timestamp is placed in the padding bytes */
@@ -157,6 +172,142 @@ static inline int csp_rdp_time_after(uint32_t time, uint32_t cmp) {
 	return csp_rdp_time_before(cmp, time);
 }
 
+/** End of retransmit list */
+#define RDP_TX_NONE		0xFFFF
+
+/** Segments retransmitted per timer run, more are sent on the next run */
+#define RDP_RESEND_MAX		32
+
+/** Sequence numbers in one list EACK, sized to the buffer requested for it */
+#define RDP_EACK_MAX		((100 - sizeof(rdp_header_t)) / sizeof(uint16_t))
+
+/** Bytes in one bitmap EACK, covers 512 segments after the cumulative ACK */
+#define RDP_SACK_MAX		64
+
+/** Initial congestion window in segments */
+#define RDP_CC_INIT_WINDOW	2
+
+/**
+ * RETRANSMIT RING
+ * Unacknowledged segments are kept in a ring indexed by sequence number,
+ * and linked in a list ordered by retransmit deadline. Every
+ * (re)transmission is appended to the tail, segments deferred to an earlier
+ * deadline are linked in order, so the head always has the earliest deadline.
+ * The ring is filled by the user task and drained by the router task,
+ * all functions below must be called with tx_lock held. The lock is a
+ * mutex rather than a critical section, as the ring is walked and segments
+ * are cloned and freed while it is held.
+ */
+static inline int csp_rdp_tx_slot(csp_conn_t * conn, uint16_t seq) {
+
+	uint16_t offset = seq - conn->rdp.tx_una;
+	if (offset >= conn->rdp.tx_size)
+		return -1;
+	return (conn->rdp.tx_base + offset) % conn->rdp.tx_size;
+
+}
+
+static void csp_rdp_tx_unlink(csp_conn_t * conn, int slot) {
+
+	uint16_t prev = conn->rdp.tx_prev[slot], next = conn->rdp.tx_next[slot];
+
+	if (prev == RDP_TX_NONE)
+		conn->rdp.tx_head = next;
+	else
+		conn->rdp.tx_next[prev] = next;
+
+	if (next == RDP_TX_NONE)
+		conn->rdp.tx_tail = prev;
+	else
+		conn->rdp.tx_prev[next] = prev;
+
+}
+
+static void csp_rdp_tx_link_tail(csp_conn_t * conn, int slot) {
+
+	conn->rdp.tx_next[slot] = RDP_TX_NONE;
+	conn->rdp.tx_prev[slot] = conn->rdp.tx_tail;
+	if (conn->rdp.tx_tail == RDP_TX_NONE)
+		conn->rdp.tx_head = slot;
+	else
+		conn->rdp.tx_next[conn->rdp.tx_tail] = slot;
+	conn->rdp.tx_tail = slot;
+
+}
+
+/**
+ * Link slot by its retransmit deadline, after the segments due no later.
+ * Segments moved to an earlier deadline usually sort near the tail, so the
+ * list is searched from there.
+ */
+static void csp_rdp_tx_link_sorted(csp_conn_t * conn, int slot) {
+
+	uint32_t timestamp = ((rdp_packet_t *) conn->rdp.tx_ring[slot])->timestamp;
+	uint16_t prev = conn->rdp.tx_tail;
+	while (prev != RDP_TX_NONE && csp_rdp_time_after(((rdp_packet_t *) conn->rdp.tx_ring[prev])->timestamp, timestamp))
+		prev = conn->rdp.tx_prev[prev];
+
+	if (prev == RDP_TX_NONE) {
+		conn->rdp.tx_next[slot] = conn->rdp.tx_head;
+		conn->rdp.tx_head = slot;
+	} else {
+		conn->rdp.tx_next[slot] = conn->rdp.tx_next[prev];
+		conn->rdp.tx_next[prev] = slot;
+	}
+	conn->rdp.tx_prev[slot] = prev;
+	if (conn->rdp.tx_next[slot] == RDP_TX_NONE)
+		conn->rdp.tx_tail = slot;
+	else
+		conn->rdp.tx_prev[conn->rdp.tx_next[slot]] = slot;
+
+}
+
+static int csp_rdp_tx_add(csp_conn_t * conn, rdp_packet_t * packet, uint16_t seq) {
+
+	int slot = csp_rdp_tx_slot(conn, seq);
+	if (slot < 0 || conn->rdp.tx_ring[slot] != NULL)
+		return CSP_ERR_NOBUFS;
+
+	conn->rdp.tx_ring[slot] = (csp_packet_t *) packet;
+	csp_rdp_tx_link_tail(conn, slot);
+	conn->rdp.tx_count++;
+	return CSP_ERR_NONE;
+
+}
+
+static rdp_packet_t * csp_rdp_tx_remove(csp_conn_t * conn, int slot) {
+
+	rdp_packet_t * packet = (rdp_packet_t *) conn->rdp.tx_ring[slot];
+	conn->rdp.tx_ring[slot] = NULL;
+	conn->rdp.tx_lost[slot / 32] &= ~((uint32_t) 1 << (slot % 32));
+	csp_rdp_tx_unlink(conn, slot);
+	conn->rdp.tx_count--;
+	return packet;
+
+}
+
+/* Free all segments and restart the ring at a new initial sequence number */
+static void csp_rdp_tx_reset(csp_conn_t * conn, uint16_t iss) {
+
+	int slot;
+
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+	for (slot = 0; slot < conn->rdp.tx_size; slot++) {
+		if (conn->rdp.tx_ring[slot] != NULL) {
+			csp_buffer_free(conn->rdp.tx_ring[slot]);
+			conn->rdp.tx_ring[slot] = NULL;
+		}
+		conn->rdp.tx_lost[slot / 32] = 0;
+	}
+	conn->rdp.tx_head = RDP_TX_NONE;
+	conn->rdp.tx_tail = RDP_TX_NONE;
+	conn->rdp.tx_count = 0;
+	conn->rdp.tx_base = 0;
+	conn->rdp.tx_una = iss;
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+
+}
+
 /**
  * CONTROL MESSAGES
  * The following function is used to send empty messages,
@@ -181,13 +332,20 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 	header->syn = (flags & RDP_SYN) ? 1 : 0;
 	header->rst = (flags & RDP_RST) ? 1 : 0;
 
-	/* Send copy to tx_queue, before sending packet to IF */
+	/* Keep copy in retransmit ring, before sending packet to IF */
 	if (flags & RDP_SYN) {
 		rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
 		if (rdp_packet == NULL) return CSP_ERR_NOMEM;
 		rdp_packet->timestamp = csp_get_ms();
-		if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK)
+		rdp_packet->quarantine = 0;
+		csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+		int ret = csp_rdp_tx_add(conn, rdp_packet, seq_nr);
+		csp_mutex_unlock(&conn->rdp.tx_lock);
+		/* A repeated SYN/ACK is already in the ring */
+		if (ret != CSP_ERR_NONE)
 			csp_buffer_free(rdp_packet);
+		else
+			csp_timer_set_earlier(&conn->rdp.timer, rdp_packet->timestamp + conn->rdp.rto);
 	}
 
 	/* Send packet to IF */
@@ -207,38 +365,79 @@ static int csp_rdp_send_cmp(csp_conn_t * conn, csp_packet_t * packet, int flags,
 
 }
 
+/**
+ * Note that a segment acknowledging up to ack_nr has been sent on the
+ * connection. A pending ACK it covers need not be sent separately.
+ */
+static void csp_rdp_ack_carried(csp_conn_t * conn, uint16_t ack_nr) {
+
+	if (!csp_rdp_seq_after(ack_nr, conn->rdp.rcv_lsa) || csp_rdp_seq_after(ack_nr, conn->rdp.rcv_cur))
+		return;
+
+	conn->rdp.rcv_lsa = ack_nr;
+	conn->rdp.ack_timestamp = csp_get_ms();
+	conn->stats.acks_piggybacked++;
+
+}
+
 /**
  * EXTENDED ACKNOWLEDGEMENTS
- * The following function sends an extended ACK packet
+ * The following functions build and send an extended ACK packet. If both
+ * ends negotiated RDP_OPT_SACK, the EACK payload is a bitmap where bit n
+ * (LSB first) of byte n / 8 is seq ack_nr + 1 + n. Otherwise it is a list
+ * of 16-bit sequence numbers.
  */
+
+/** Add occupied RX ring slots in [from, to) to an EACK */
+static void csp_rdp_eack_add(csp_conn_t * conn, csp_packet_t * packet_eack, int from, int to) {
+
+	int word;
+	for (word = from / 32; word * 32 < to; word++) {
+		uint32_t map = conn->rdp.rx_map[word];
+		if (word == from / 32)
+			map &= ~(uint32_t) 0 << (from % 32);
+		if ((word + 1) * 32 > to)
+			map &= ((uint32_t) 1 << (to % 32)) - 1;
+		while (map) {
+			int slot = word * 32 + __builtin_ctz(map);
+			map &= map - 1;
+
+			int offset = (slot + conn->rdp.rx_size - conn->rdp.rx_base) % conn->rdp.rx_size;
+			if (conn->rdp.sack) {
+				if (offset >= RDP_SACK_MAX * 8)
+					return;
+				packet_eack->data[offset / 8] |= 1 << (offset % 8);
+				packet_eack->length = offset / 8 + 1;
+				continue;
+			}
+
+			if (packet_eack->length / sizeof(uint16_t) >= RDP_EACK_MAX)
+				return;
+
+			/* Add seq nr to EACK packet */
+			uint16_t seq_nr = conn->rdp.rcv_cur + 1 + offset;
+			packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(seq_nr);
+			packet_eack->length += sizeof(uint16_t);
+			csp_debug(CSP_PROTOCOL, "Added EACK nr %u\r\n", seq_nr);
+		}
+	}
+
+}
+
 static int csp_rdp_send_eack(csp_conn_t * conn) {
 
 	/* Allocate message */
 	csp_packet_t * packet_eack = csp_buffer_get(100);
 	if (packet_eack == NULL) return CSP_ERR_NOMEM;
 	packet_eack->length = 0;
+	if (conn->rdp.sack)
+		memset(packet_eack->data, 0, RDP_SACK_MAX);
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
-
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_debug(CSP_ERROR, "Cannot dequeue from rx_queue in queue deliver\r\n");
-			break;
-		}
+	/* Walk occupied slots of the RX ring in sequence order */
+	csp_rdp_eack_add(conn, packet_eack, conn->rdp.rx_base, conn->rdp.rx_size);
+	csp_rdp_eack_add(conn, packet_eack, 0, conn->rdp.rx_base);
 
-		/* Add seq nr to EACK packet */
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		packet_eack->data16[packet_eack->length/sizeof(uint16_t)] = csp_hton16(header->seq_nr);
-		packet_eack->length += sizeof(uint16_t);
-		csp_debug(CSP_PROTOCOL, "Added EACK nr %u\r\n", header->seq_nr);
-
-		/* Requeue */
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
-
-	}
+	conn->stats.eack_tx++;
 
 	return csp_rdp_send_cmp(conn, packet_eack, RDP_ACK | RDP_EAK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 
@@ -256,28 +455,52 @@ static int csp_rdp_send_syn(csp_conn_t * conn) {
 	if (packet == NULL) return CSP_ERR_NOMEM;
 
 	/* Generate contents */
-	packet->data32[0] = csp_hton32(csp_rdp_window_size);
+	packet->data32[0] = csp_hton32(conn->rdp.window_size);
 	packet->data32[1] = csp_hton32(csp_rdp_conn_timeout);
 	packet->data32[2] = csp_hton32(csp_rdp_packet_timeout);
 	packet->data32[3] = csp_hton32(csp_rdp_delayed_acks);
 	packet->data32[4] = csp_hton32(csp_rdp_ack_timeout);
 	packet->data32[5] = csp_hton32(csp_rdp_ack_delay_count);
-	packet->length = 6 * sizeof(uint32_t);
+	packet->data32[6] = csp_hton32(RDP_OPT_SACK | ((conn->conn_opts & CSP_O_RDPFASTOPEN) ? RDP_OPT_FASTOPEN : 0));
+	packet->length = 7 * sizeof(uint32_t);
 
 	return csp_rdp_send_cmp(conn, packet, RDP_SYN, conn->rdp.snd_iss, 0);
 
 }
 
+/**
+ * SYN/ACK Packet
+ * Carries the window accepted by this end, which may be smaller than the
+ * one offered in the SYN, and the accepted option flags. Peers without
+ * window negotiation ignore it.
+ */
+static int csp_rdp_send_synack(csp_conn_t * conn) {
+
+	csp_packet_t * packet = csp_buffer_get(20);
+	if (packet == NULL) return CSP_ERR_NOMEM;
+
+	packet->data32[0] = csp_hton32(conn->rdp.window_size);
+	packet->data32[1] = csp_hton32((conn->rdp.sack ? RDP_OPT_SACK : 0) |
+			(conn->rdp.fastopen == RDP_FASTOPEN_ACCEPTED ? RDP_OPT_FASTOPEN : 0));
+	packet->length = 2 * sizeof(uint32_t);
+
+	return csp_rdp_send_cmp(conn, packet, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+
+}
+
 static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet) {
 
 	/* If a rx_socket is set, this message is the first in a new connection
 	 * so the connection must be queued to the socket. */
 	if (conn->rx_socket != NULL) {
 
-		/* Try queueing */
-		if (csp_queue_enqueue(conn->rx_socket, &conn, 0) == CSP_QUEUE_FULL) {
-			csp_debug(CSP_ERROR, "ERROR socket cannot accept more connections\r\n");
-			return 0;
+		/* Try queueing, unless connection is served by a callback */
+		if (conn->callback == NULL) {
+			if (csp_queue_enqueue(conn->rx_socket->queue, &conn, 0) == CSP_QUEUE_FULL) {
+				csp_debug(CSP_ERROR, "ERROR socket cannot accept more connections\r\n");
+				return 0;
+			}
+			csp_poll_signal(conn->rx_socket, conn->rx_socket->queue);
 		}
 
 		/* Ensure that this connection will not be posted to this socket again
@@ -299,120 +522,338 @@ static inline int csp_rdp_receive_data(csp_conn_t * conn, csp_packet_t * packet)
 
 }
 
-static inline void csp_rdp_rx_queue_flush(csp_conn_t * conn) {
+/** Ring slot of an out-of-order segment, or -1 if seq_nr is outside the ring */
+static inline int csp_rdp_rx_slot(csp_conn_t * conn, uint16_t seq_nr) {
 
-	/* Loop through RX queue */
-	int i, count;
-	csp_packet_t * packet;
+	uint16_t offset = seq_nr - conn->rdp.rcv_cur - 1;
+	if (offset >= conn->rdp.rx_size)
+		return -1;
+	return (conn->rdp.rx_base + offset) % conn->rdp.rx_size;
 
-front:
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+}
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_debug(CSP_ERROR, "Cannot dequeue from rx_queue in queue deliver\r\n");
-			break;
-		}
+static inline int csp_rdp_rx_ring_used(csp_conn_t * conn, int slot) {
+	return (conn->rdp.rx_map[slot / 32] >> (slot % 32)) & 1;
+}
 
-		rdp_header_t * header = csp_rdp_header_ref(packet);
-		csp_debug(CSP_PROTOCOL, "RX Queue deliver matching Element, seq %u\r\n", header->seq_nr);
+/* Deliver segments that are now in sequence, and advance the ring with rcv_cur */
+static inline void csp_rdp_rx_ring_flush(csp_conn_t * conn) {
 
-		/* If the matching packet was found: */
-		if (header->seq_nr == (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			csp_debug(CSP_PROTOCOL, "Deliver seq %u\r\n", header->seq_nr);
-			csp_rdp_receive_data(conn, packet);
-			conn->rdp.rcv_cur++;
-			/* Loop from first element again */
-			goto front;
+	int slot = conn->rdp.rx_base;
 
-		/* Otherwise, requeue */
-		} else {
-			csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
-		}
+	while (csp_rdp_rx_ring_used(conn, slot)) {
+		csp_packet_t * packet = conn->rdp.rx_ring[slot];
+		conn->rdp.rx_ring[slot] = NULL;
+		conn->rdp.rx_map[slot / 32] &= ~((uint32_t) 1 << (slot % 32));
+
+		csp_debug(CSP_PROTOCOL, "Deliver seq %u\r\n", (uint16_t)(conn->rdp.rcv_cur + 1));
+		csp_rdp_receive_data(conn, packet);
+		conn->rdp.rcv_cur++;
 
+		slot = (slot + 1) % conn->rdp.rx_size;
+		conn->rdp.rx_base = slot;
 	}
 
 }
 
-static inline int csp_rdp_rx_queue_exists(csp_conn_t * conn, uint16_t seq_nr) {
+static inline int csp_rdp_rx_ring_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
 
-	/* Loop through RX queue */
-	int i, count;
-	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.rx_queue);
-	for (i = 0; i < count; i++) {
+	int slot = csp_rdp_rx_slot(conn, seq_nr);
+	if (slot < 0 || csp_rdp_rx_ring_used(conn, slot))
+		return CSP_ERR_USED;
 
-		if (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) {
-			csp_debug(CSP_ERROR, "Cannot dequeue from rx_queue in queue exists\r\n");
-			break;
-		}
+	conn->rdp.rx_ring[slot] = packet;
+	conn->rdp.rx_map[slot / 32] |= (uint32_t) 1 << (slot % 32);
+	return CSP_ERR_NONE;
 
-		csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+}
 
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_debug(CSP_PROTOCOL, "RX Queue exists matching Element, seq %u\r\n", header->seq_nr);
+/**
+ * CONGESTION CONTROL
+ * With CSP_RDP_CC the sender keeps no more than cwnd segments outstanding,
+ * on top of the window negotiated with the receiver. Below ssthresh cwnd
+ * grows by one segment per acknowledged segment (slow start), above it by
+ * one segment per window (congestion avoidance). A loss reported by EACK
+ * halves the window, a retransmission timeout closes it to one segment.
+ */
+static inline uint32_t csp_rdp_send_window(csp_conn_t * conn) {
 
-		/* If the matching packet was found, deliver */
-		if (header->seq_nr == seq_nr) {
-			csp_debug(CSP_PROTOCOL, "We have a match\r\n");
-			return 1;
-		}
+#if CSP_RDP_CC
+	if (conn->rdp.cwnd < conn->rdp.window_size)
+		return conn->rdp.cwnd;
+#endif
+	return conn->rdp.window_size;
 
-	}
+}
 
-	return 0;
+static void csp_rdp_cc_reset(csp_conn_t * conn) {
+
+#if CSP_RDP_CC
+	uint32_t window = conn->rdp.window_size ? conn->rdp.window_size : 1;
+	conn->rdp.cwnd = window < RDP_CC_INIT_WINDOW ? window : RDP_CC_INIT_WINDOW;
+	conn->rdp.ssthresh = window;
+	conn->rdp.cwnd_acked = 0;
+	conn->rdp.cc_recover = conn->rdp.snd_nxt;
+	conn->stats.cwnd = conn->rdp.cwnd;
+	conn->stats.ssthresh = conn->rdp.ssthresh;
+#endif
 
 }
 
-static inline int csp_rdp_rx_queue_add(csp_conn_t * conn, csp_packet_t * packet, uint16_t seq_nr) {
+static void csp_rdp_cc_ack(csp_conn_t * conn, unsigned int acked) {
 
-	if (csp_rdp_rx_queue_exists(conn, seq_nr))
-		return 0;
-	return csp_queue_enqueue_isr(conn->rdp.rx_queue, &packet, &pdTrue);
+#if CSP_RDP_CC
+	if (acked == 0 || conn->rdp.state != RDP_OPEN)
+		return;
+
+	if (conn->rdp.cwnd < conn->rdp.ssthresh) {
+		unsigned int room = conn->rdp.ssthresh - conn->rdp.cwnd;
+		unsigned int grow = acked < room ? acked : room;
+		conn->rdp.cwnd += grow;
+		acked -= grow;
+	}
+
+	conn->rdp.cwnd_acked += acked;
+	while (conn->rdp.cwnd_acked >= conn->rdp.cwnd) {
+		conn->rdp.cwnd_acked -= conn->rdp.cwnd;
+		conn->rdp.cwnd++;
+	}
+
+	/* Growing past the receive window gives nothing */
+	if (conn->rdp.cwnd >= conn->rdp.window_size) {
+		conn->rdp.cwnd = conn->rdp.window_size;
+		conn->rdp.cwnd_acked = 0;
+	}
+	conn->stats.cwnd = conn->rdp.cwnd;
+#else
+	(void) conn;
+	(void) acked;
+#endif
+
+}
+
+static void csp_rdp_cc_loss(csp_conn_t * conn, int timeout) {
+
+#if CSP_RDP_CC
+	uint16_t flight = conn->rdp.snd_nxt - conn->rdp.snd_una;
+	conn->rdp.ssthresh = flight / 2 > 2 ? flight / 2 : 2;
+	conn->rdp.cwnd = timeout ? 1 : conn->rdp.ssthresh;
+	conn->rdp.cwnd_acked = 0;
+	conn->rdp.cc_recover = conn->rdp.snd_nxt;
+	conn->stats.cwnd = conn->rdp.cwnd;
+	conn->stats.ssthresh = conn->rdp.ssthresh;
+	csp_debug(CSP_PROTOCOL, "RDP: %s, cwnd %u, ssthresh %u\r\n", timeout ? "Timeout" : "Loss",
+			conn->rdp.cwnd, conn->rdp.ssthresh);
+#else
+	(void) conn;
+	(void) timeout;
+#endif
 
 }
 
 static void csp_rdp_flush_eack(csp_conn_t * conn, csp_packet_t * eack_packet) {
 
-	/* Loop through TX queue */
-	int i, j, count;
-	rdp_packet_t * packet;
-	count = csp_queue_size(conn->rdp.tx_queue);
+	int i, count, slot, found = 0, acked = 0, lost = 0;
+	uint16_t seq, highest = 0;
+	uint16_t base = csp_rdp_header_ref(eack_packet)->ack_nr + 1;
+	uint32_t time_now = csp_get_ms();
+
+	if (conn->rdp.sack)
+		count = (eack_packet->length - sizeof(rdp_header_t)) * 8;
+	else
+		count = (eack_packet->length - sizeof(rdp_header_t)) / sizeof(uint16_t);
+
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+
+	/* Free segments received out of order by the other end */
 	for (i = 0; i < count; i++) {
+		if (conn->rdp.sack) {
+			if (!((eack_packet->data[i / 8] >> (i % 8)) & 1))
+				continue;
+			seq = base + i;
+		} else {
+			seq = csp_ntoh16(eack_packet->data16[i]);
+		}
+		if (!found || csp_rdp_seq_after(seq, highest))
+			highest = seq;
+		found = 1;
+
+		slot = csp_rdp_tx_slot(conn, seq);
+		if (slot >= 0 && conn->rdp.tx_ring[slot] != NULL) {
+			csp_buffer_free(csp_rdp_tx_remove(conn, slot));
+			acked++;
+		}
+	}
 
-		if (csp_queue_dequeue(conn->rdp.tx_queue, &packet, 0) != CSP_QUEUE_OK) {
-			csp_debug(CSP_ERROR, "Cannot dequeue from tx_queue in flush EACK\r\n");
+	/* Segments before the highest EACK are probably lost. One decrease of the
+	 * congestion window per window of data. */
+	if (found) {
+		if ((uint16_t)(highest - conn->rdp.tx_una) > conn->rdp.tx_size)
+			highest = conn->rdp.tx_una + conn->rdp.tx_size;
+#if CSP_RDP_CC
+		seq = conn->rdp.cc_recover;
+		if (csp_rdp_seq_before(seq, conn->rdp.tx_una))
+			seq = conn->rdp.tx_una;
+		for (; csp_rdp_seq_before(seq, highest); seq++) {
+			slot = csp_rdp_tx_slot(conn, seq);
+			if (slot >= 0 && conn->rdp.tx_ring[slot] != NULL) {
+				lost = 1;
+				break;
+			}
+		}
+#endif
+	}
+
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+
+	csp_debug(CSP_PROTOCOL, "EACK freed %d TX elements\r\n", acked);
+	csp_rdp_cc_ack(conn, acked);
+	if (lost)
+		csp_rdp_cc_loss(conn, 0);
+
+	if (!found)
+		return;
+
+	/**
+	 * FAST RETRANSMIT:
+	 * Resend the missing segments now, oldest first, instead of waiting for
+	 * their timeout. A segment is resent at most once per quarantine period,
+	 * and at most a send window of segments per EACK. The rest are tried
+	 * again in one round trip by the retransmission timer.
+	 */
+	csp_packet_t * resend[RDP_RESEND_MAX];
+	uint32_t budget = csp_rdp_send_window(conn);
+	int deferred = 0;
+	count = 0;
+
+	uint32_t rtt = conn->stats.rtt;
+	if (rtt == 0 || rtt > conn->rdp.rto)
+		rtt = conn->rdp.rto;
+
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+	for (seq = conn->rdp.tx_una; csp_rdp_seq_before(seq, highest); seq++) {
+		slot = csp_rdp_tx_slot(conn, seq);
+		if (slot < 0)
 			break;
+		rdp_packet_t * packet = (rdp_packet_t *) conn->rdp.tx_ring[slot];
+		if (packet == NULL || !csp_rdp_time_after(time_now, packet->quarantine))
+			continue;
+
+		packet->quarantine = time_now + conn->rdp.rto / 2;
+		conn->rdp.rtt_ambiguous = conn->rdp.snd_nxt;
+
+		uint32_t bit = (uint32_t) 1 << (slot % 32);
+		if (count >= RDP_RESEND_MAX || (uint32_t) count >= budget) {
+			/* Not counted as a new timeout when it expires */
+			conn->rdp.tx_lost[slot / 32] |= bit;
+			packet->timestamp = time_now + rtt - conn->rdp.rto;
+			csp_rdp_tx_unlink(conn, slot);
+			csp_rdp_tx_link_sorted(conn, slot);
+			deferred = 1;
+			continue;
 		}
+		conn->rdp.tx_lost[slot / 32] &= ~bit;
 
 		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
-		csp_debug(CSP_PROTOCOL, "EACK compare element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(header->seq_nr));
-
-		/* Look for this element in EACKs */
-		int match = 0;
-		for (j = 0; j < (int)((eack_packet->length - sizeof(rdp_header_t)) / sizeof(uint16_t)); j++) {
-			if (csp_ntoh16(eack_packet->data16[j]) == csp_ntoh16(header->seq_nr))
-				match = 1;
-
-			/* Enable this if you want EACK's to trigger retransmission */
-			if (csp_ntoh16(eack_packet->data16[j]) > csp_ntoh16(header->seq_nr)) {
-				uint32_t time_now = csp_get_ms();
-				if (csp_rdp_time_after(time_now, packet->quarantine)) {
-					packet->timestamp = time_now - conn->rdp.packet_timeout - 1;
-					packet->quarantine = time_now +	conn->rdp.packet_timeout / 2;
-				}
-			}
-		}
+		header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+		conn->stats.fast_retransmits++;
+
+		/* Send a copy, the segment stays in the ring */
+		packet->timestamp = time_now;
+		resend[count] = csp_buffer_clone(packet);
+		if (resend[count] != NULL)
+			count++;
 
-		if (match == 0) {
-			/* If not found, put back on tx queue */
-			csp_queue_enqueue(conn->rdp.tx_queue, &packet, 0);
+		csp_rdp_tx_unlink(conn, slot);
+		csp_rdp_tx_link_tail(conn, slot);
+	}
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+
+	uint16_t ack_nr = conn->rdp.rcv_cur;
+	for (i = 0; i < count; i++) {
+		csp_debug(CSP_PROTOCOL, "Fast retransmit seq %u\r\n", csp_ntoh16(csp_rdp_header_ref(resend[i])->seq_nr));
+		if (csp_send_direct(conn->idout, resend[i], 0) != CSP_ERR_NONE) {
+			csp_debug(CSP_WARN, "Fast retransmission failed\r\n");
+			csp_buffer_free(resend[i]);
 		} else {
-			/* Found, free */
-			csp_debug(CSP_PROTOCOL, "TX Element %u freed\r\n", csp_ntoh16(header->seq_nr));
-			csp_buffer_free(packet);
+			csp_rdp_ack_carried(conn, ack_nr);
 		}
+	}
+
+	if (deferred)
+		csp_timer_set_earlier(&conn->rdp.timer, time_now + rtt);
+
+}
+
+/** Check if a peer port accepted fast open the last time it was asked */
+static int csp_rdp_fastopen_known(csp_id_t idout) {
+
+	unsigned int peer = idout.dst * (CSP_ID_PORT_MAX + 1) + idout.dport;
+	return (csp_rdp_fastopen_peers[peer / 32] >> (peer % 32)) & 1;
+
+}
+
+/** Remember if a peer port accepts fast open, from its SYN/ACK or a failed fast open */
+static void csp_rdp_fastopen_learn(csp_id_t idout, int accepted) {
+
+	unsigned int peer = idout.dst * (CSP_ID_PORT_MAX + 1) + idout.dport;
+	uint32_t bit = (uint32_t) 1 << (peer % 32);
 
+	if (accepted)
+		__sync_fetch_and_or(&csp_rdp_fastopen_peers[peer / 32], bit);
+	else
+		__sync_fetch_and_and(&csp_rdp_fastopen_peers[peer / 32], ~bit);
+
+}
+
+/**
+ * FAST OPEN:
+ * Segments sent behind the SYN acknowledge nothing. Once the SYN/ACK has
+ * arrived they carry ACKs like other segments, and they are resent at once
+ * if the other end did not accept data before the handshake.
+ */
+static void csp_rdp_fastopen_ack(csp_conn_t * conn, int resend) {
+
+	csp_packet_t * clones[RDP_RESEND_MAX];
+	uint32_t time_now = csp_get_ms();
+	int i, slot, count = 0;
+	uint16_t seq;
+
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+	for (i = 0, seq = conn->rdp.tx_una; i < conn->rdp.tx_size; i++, seq++) {
+		slot = csp_rdp_tx_slot(conn, seq);
+		rdp_packet_t * packet = (rdp_packet_t *) conn->rdp.tx_ring[slot];
+		if (packet == NULL)
+			continue;
+		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+		if (header->syn)
+			continue;
+
+		header->ack = 1;
+		header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+		if (!resend || count == RDP_RESEND_MAX)
+			continue;
+
+		packet->timestamp = time_now;
+		clones[count] = csp_buffer_clone(packet);
+		if (clones[count] != NULL)
+			count++;
+
+		csp_rdp_tx_unlink(conn, slot);
+		csp_rdp_tx_link_tail(conn, slot);
+	}
+	if (resend)
+		conn->rdp.rtt_ambiguous = conn->rdp.snd_nxt;
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+
+	uint16_t ack_nr = conn->rdp.rcv_cur;
+	for (i = 0; i < count; i++) {
+		if (csp_send_direct(conn->idout, clones[i], 0) != CSP_ERR_NONE) {
+			csp_debug(CSP_WARN, "Fast open retransmission failed\r\n");
+			csp_buffer_free(clones[i]);
+		} else {
+			csp_rdp_ack_carried(conn, ack_nr);
+		}
 	}
 
 }
@@ -436,63 +877,349 @@ static inline int csp_rdp_should_ack(csp_conn_t * conn) {
 
 }
 
+/** Clamp a window to the local maximum */
+static uint32_t csp_rdp_window_limit(uint32_t window) {
+
+	if (window > csp_rdp_max_window)
+		window = csp_rdp_max_window;
+	if (window == 0)
+		window = 1;
+	return window;
+
+}
+
+/** RX queue length that holds two windows, as a segment is only acknowledged while a full window fits behind it */
+static uint32_t csp_rdp_rxq_length(uint32_t window) {
+
+	uint32_t length = window * 2;
+	if (length < CSP_RX_QUEUE_LENGTH)
+		length = CSP_RX_QUEUE_LENGTH;
+	return length;
+
+}
+
+unsigned int csp_rdp_rx_queue_length(void) {
+
+	return csp_rdp_rxq_length(csp_rdp_window_limit(csp_rdp_window_size));
+
+}
+
+/**
+ * Size the retransmit and receive rings for a window. All rings of a
+ * connection share one allocation, which is kept for the next connection
+ * if it has the same window. The rings must be empty.
+ */
+static int csp_rdp_rings_alloc(csp_conn_t * conn, uint32_t window) {
+
+	/* Both ends accept sequence numbers up to two windows ahead */
+	uint32_t tx_size = window * 2, rx_size = window * 2;
+
+	if (conn->rdp.tx_size == tx_size && conn->rdp.rx_size == rx_size)
+		return CSP_ERR_NONE;
+
+	csp_free(conn->rdp.tx_ring);
+	conn->rdp.tx_size = 0;
+	conn->rdp.tx_ring = NULL;
+	conn->rdp.rx_size = 0;
+	conn->rdp.rx_ring = NULL;
+
+	/* Pointers first, then bitmaps, then slot indices, to keep alignment */
+	size_t tx_words = (tx_size + 31) / 32, rx_words = (rx_size + 31) / 32;
+	size_t size = (tx_size + rx_size) * sizeof(csp_packet_t *)
+			+ (tx_words + rx_words) * sizeof(uint32_t)
+			+ 2 * tx_size * sizeof(uint16_t);
+	uint8_t * mem = csp_malloc(size);
+	if (mem == NULL)
+		return CSP_ERR_NOMEM;
+	memset(mem, 0, size);
+
+	conn->rdp.tx_ring = (csp_packet_t **) mem;
+	conn->rdp.rx_ring = conn->rdp.tx_ring + tx_size;
+	conn->rdp.tx_lost = (uint32_t *) (conn->rdp.rx_ring + rx_size);
+	conn->rdp.rx_map = conn->rdp.tx_lost + tx_words;
+	conn->rdp.tx_next = (uint16_t *) (conn->rdp.rx_map + rx_words);
+	conn->rdp.tx_prev = conn->rdp.tx_next + tx_size;
+	conn->rdp.tx_size = tx_size;
+	conn->rdp.rx_size = rx_size;
+	conn->rdp.rx_base = 0;
+	csp_rdp_tx_reset(conn, conn->rdp.tx_una);
+
+	return CSP_ERR_NONE;
+
+}
+
 void csp_rdp_flush_all(csp_conn_t * conn) {
 
-	if ((conn == NULL) || conn->rdp.tx_queue == NULL) {
+	if (conn == NULL) {
 		csp_debug(CSP_ERROR, "Null pointer passed to rdp flush all\r\n");
 		return;
 	}
 
-	rdp_packet_t * packet;
+	/* Empty retransmit ring */
+	csp_rdp_tx_reset(conn, conn->rdp.snd_nxt);
 
-	/* Empty TX queue */
-    while (csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-    	if (packet != NULL) {
-    		csp_debug(CSP_PROTOCOL, "Flush TX Element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-    		csp_buffer_free(packet);
-    	}
-    }
-
-	/* Empty RX queue */
-    while (csp_queue_dequeue_isr(conn->rdp.rx_queue, &packet, &pdTrue) == CSP_QUEUE_OK) {
-		if (packet != NULL) {
-			csp_debug(CSP_PROTOCOL, "Flush RX Element, time %u, seq %u\r\n", packet->timestamp, csp_ntoh16(csp_rdp_header_ref((csp_packet_t *) packet)->seq_nr));
-			csp_buffer_free(packet);
+	/* Empty RX ring */
+	int slot;
+	for (slot = 0; slot < conn->rdp.rx_size; slot++) {
+		if (csp_rdp_rx_ring_used(conn, slot)) {
+			csp_debug(CSP_PROTOCOL, "Flush RX Element, slot %u\r\n", slot);
+			csp_buffer_free(conn->rdp.rx_ring[slot]);
+			conn->rdp.rx_ring[slot] = NULL;
 		}
 	}
+	for (slot = 0; slot < conn->rdp.rx_size; slot += 32)
+		conn->rdp.rx_map[slot / 32] = 0;
+	conn->rdp.rx_base = 0;
 
 }
 
-int csp_rdp_check_ack(csp_conn_t * conn) {
+/**
+ * Time at which unacknowledged segments must be acknowledged. If the ACK is
+ * held back because the receive queue is full, check again after one ACK
+ * timeout, or earlier when user space reads from the connection.
+ */
+static uint32_t csp_rdp_ack_deadline(csp_conn_t * conn) {
 
-	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur) {
-		/* Check all RX queues for spare capacity */
-		int prio, avail = 1;
-		for (prio = 0; prio < CSP_RX_QUEUES; prio++) {
-			if (CSP_RX_QUEUE_LENGTH - csp_queue_size(conn->rx_queue[prio]) <= (int32_t)conn->rdp.window_size) {
-				avail = 0;
-				break;
+	uint32_t time_now = csp_get_ms();
+	uint32_t deadline = conn->rdp.ack_timestamp + conn->rdp.ack_timeout;
+
+	if (!conn->rdp.delayed_acks || !csp_rdp_time_after(deadline, time_now))
+		deadline = time_now + conn->rdp.ack_timeout;
+
+	return deadline;
+
+}
+
+/**
+ * Lower bound of the retransmission timeout. With delayed acknowledgements
+ * the receiver may hold back an ACK for ack_timeout, so never fire before.
+ */
+static uint32_t csp_rdp_rto_min(csp_conn_t * conn) {
+
+	uint32_t min = 2 * CSP_TIMER_RESOLUTION;
+	if (conn->rdp.delayed_acks)
+		min += conn->rdp.ack_timeout;
+	return min;
+
+}
+
+/**
+ * Upper bound of the retransmission timeout, which caps backoff. Waiting
+ * longer than half the connection timeout would let the connection die
+ * before the first retransmission.
+ */
+static uint32_t csp_rdp_rto_max(csp_conn_t * conn) {
+
+	uint32_t max = conn->rdp.conn_timeout / 2;
+	if (max < conn->rdp.packet_timeout)
+		max = conn->rdp.packet_timeout;
+	return max;
+
+}
+
+static void csp_rdp_rto_set(csp_conn_t * conn, uint32_t rto) {
+
+	uint32_t min = csp_rdp_rto_min(conn);
+	uint32_t max = csp_rdp_rto_max(conn);
+
+	if (rto > max)
+		rto = max;
+	if (rto < min)
+		rto = min;
+	conn->rdp.rto = rto;
+	conn->stats.rto = rto;
+
+}
+
+/**
+ * Forget RTT estimate, the negotiated packet timeout is used until the
+ * first sample arrives
+ */
+static void csp_rdp_rtt_reset(csp_conn_t * conn) {
+
+	conn->rdp.srtt = 0;
+	conn->rdp.rttvar = 0;
+	conn->stats.rtt = 0;
+	conn->stats.rttvar = 0;
+	csp_rdp_rto_set(conn, conn->rdp.packet_timeout);
+
+}
+
+/**
+ * Update RTT estimate and retransmission timeout with a new sample
+ * (Jacobson/Karels, RFC 6298). srtt is kept scaled by 8 and rttvar by 4,
+ * so the gains of 1/8 and 1/4 are shifts. A valid sample also ends any
+ * backoff, since rto is recomputed from the estimate.
+ */
+static void csp_rdp_rtt_sample(csp_conn_t * conn, uint32_t rtt) {
+
+	if (conn->rdp.srtt == 0) {
+		conn->rdp.srtt = rtt << 3;
+		conn->rdp.rttvar = rtt << 1;
+	} else {
+		int32_t delta = (int32_t) rtt - (int32_t) (conn->rdp.srtt >> 3);
+		conn->rdp.srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		delta -= conn->rdp.rttvar >> 2;
+		conn->rdp.rttvar += delta;
+	}
+
+	/* Zero means not measured, a sub-millisecond RTT counts as 1 ms */
+	if (conn->rdp.srtt < 8)
+		conn->rdp.srtt = 8;
+
+	conn->stats.rtt = conn->rdp.srtt >> 3;
+	conn->stats.rttvar = conn->rdp.rttvar >> 2;
+
+	uint32_t var = conn->rdp.rttvar;
+	if (var < CSP_TIMER_RESOLUTION)
+		var = CSP_TIMER_RESOLUTION;
+	csp_rdp_rto_set(conn, conn->stats.rtt + var);
+
+}
+
+/**
+ * Free acknowledged segments from the retransmit ring, and wake user task
+ * if the TX window has room for more data. The newest acknowledged segment
+ * gives an RTT sample, unless it may have been retransmitted (Karn).
+ */
+static void csp_rdp_tx_release(csp_conn_t * conn) {
+
+	rdp_packet_t * packet;
+	int i, sampled = 0, count, acked = 0;
+	uint32_t sample_time = 0;
+
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+	for (i = 0; i < conn->rdp.tx_size && csp_rdp_seq_before(conn->rdp.tx_una, conn->rdp.snd_una); i++) {
+		int slot = conn->rdp.tx_base;
+		if (conn->rdp.tx_ring[slot] != NULL) {
+			packet = csp_rdp_tx_remove(conn, slot);
+			/* Segments are released in order, so the last sample is the newest */
+			if (!csp_rdp_seq_before(conn->rdp.tx_una, conn->rdp.rtt_ambiguous)) {
+				sample_time = packet->timestamp;
+				sampled = 1;
 			}
+			csp_buffer_free(packet);
+			acked++;
 		}
-
-		/* If more space available, only send after ack timeout or immediately if delay_acks is zero */
-		if (avail && csp_rdp_should_ack(conn))
-			csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+		conn->rdp.tx_base = (slot + 1) % conn->rdp.tx_size;
+		conn->rdp.tx_una++;
 	}
+	/* Ring is empty if snd_una moved more than a ring ahead */
+	if (i == conn->rdp.tx_size)
+		conn->rdp.tx_una = conn->rdp.snd_una;
+	count = conn->rdp.tx_count;
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+
+	if (sampled)
+		csp_rdp_rtt_sample(conn, csp_get_ms() - sample_time);
+	csp_rdp_cc_ack(conn, acked);
+
+	if (conn->rdp.state == RDP_OPEN)
+		if (count < (int)csp_rdp_send_window(conn))
+			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
+				csp_bin_sem_post(&conn->rdp.tx_wait);
+
+}
+
+/**
+ * Pending acknowledgement. An ACK is dropped if a data segment sent since
+ * the last ACK has carried it.
+ * @return 1 if segments received in sequence have not been acknowledged
+ */
+static int csp_rdp_ack_pending(csp_conn_t * conn) {
+
+	csp_rdp_ack_carried(conn, conn->rdp.ack_carried);
+
+	return conn->rdp.rcv_lsa != conn->rdp.rcv_cur;
+
+}
+
+/** Check all RX queues for room for a full window */
+static int csp_rdp_rx_room(csp_conn_t * conn) {
+
+	int prio;
+	for (prio = 0; prio < CSP_RX_QUEUES; prio++)
+		if (conn->rx_queue_length - csp_queue_size(conn->rx_queue[prio]) <= (int32_t)conn->rdp.window_size)
+			return 0;
+
+	return 1;
+
+}
+
+/**
+ * Send the delayed ACK if it is due. In the router task, a pending ACK that
+ * a data segment has carried is dropped and counted. The user task only
+ * checks if the ACK was carried, as the ACK state and counters are updated
+ * by the router task.
+ */
+static void csp_rdp_ack_check(csp_conn_t * conn, int router) {
+
+	int pending;
+	if (router)
+		pending = csp_rdp_ack_pending(conn);
+	else
+		pending = conn->rdp.rcv_lsa != conn->rdp.rcv_cur && conn->rdp.ack_carried != conn->rdp.rcv_cur;
+
+	/* If more space available, only send after ack timeout or immediately if delay_acks is zero */
+	if (pending && csp_rdp_rx_room(conn) && csp_rdp_should_ack(conn))
+		csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+
+	/* Check again when the delayed ACK is due */
+	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur)
+		csp_timer_set_earlier(&conn->rdp.timer, csp_rdp_ack_deadline(conn));
+
+}
+
+int csp_rdp_check_ack(csp_conn_t * conn) {
+
+	csp_rdp_ack_check(conn, 0);
 
 	return CSP_ERR_NONE;
 
 }
 
 /**
- * This function must be called with regular intervals for the
- * RDP protocol to work as expected. This takes care of closing
- * stale connections and retransmitting traffic. A good place to
- * call this function is from the CSP router task.
+ * Connection timer callback, called from the router task when the
+ * earliest retransmission, ACK or connection deadline has passed.
+ */
+static void csp_rdp_timer_callback(void * arg) {
+
+	csp_conn_t * conn = arg;
+
+	if (conn->state == CONN_OPEN && (conn->idin.flags & CSP_FRDP))
+		csp_rdp_check_timeouts(conn);
+
+}
+
+/**
+ * Arm connection timer for the deadlines that do not depend on the
+ * TX queue. Retransmission deadlines are armed when segments are queued.
+ */
+static void csp_rdp_timer_update(csp_conn_t * conn) {
+
+	if (conn->state != CONN_OPEN)
+		return;
+
+	if (conn->rx_socket != NULL || conn->rdp.state == RDP_CLOSE_WAIT)
+		csp_timer_set_earlier(&conn->rdp.timer, conn->timestamp + conn->rdp.conn_timeout);
+
+	if (conn->rdp.rcv_lsa != conn->rdp.rcv_cur)
+		csp_timer_set_earlier(&conn->rdp.timer, csp_rdp_ack_deadline(conn));
+
+}
+
+/**
+ * This function takes care of closing stale connections and retransmitting
+ * traffic. It is called by the connection timer, when a deadline has
+ * passed, and arms the timer again for the next deadline.
  */
 void csp_rdp_check_timeouts(csp_conn_t * conn) {
 
 	rdp_packet_t * packet;
+	uint32_t deadline = 0;
+	int armed = 0;
 
 	/**
 	 * CONNECTION TIMEOUT:
@@ -505,6 +1232,33 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 			csp_close(conn);
 			return;
 		}
+		deadline = conn->timestamp + conn->rdp.conn_timeout;
+		armed = 1;
+	}
+
+	/**
+	 * FAST OPEN TIMEOUT:
+	 * A fast open connect does not wait for the SYN/ACK, so give up here if
+	 * it has not arrived within the connection timeout. User space is woken
+	 * by a NULL packet, as on reset.
+	 */
+	if (conn->rdp.state == RDP_SYN_SENT && conn->rdp.fastopen) {
+		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
+			csp_debug(CSP_WARN, "RDP: Fast open connection timed out\r\n");
+			csp_rdp_fastopen_learn(conn->idout, 0);
+			conn->rdp.state = RDP_CLOSE_WAIT;
+			conn->timestamp = time_now;
+			csp_timer_set(&conn->rdp.timer, conn->timestamp + conn->rdp.conn_timeout);
+			void * null_pointer = NULL;
+			csp_conn_enqueue_packet(conn, (csp_packet_t *) null_pointer);
+			csp_poll_signal(conn, NULL);
+			csp_callback_schedule_conn(conn);
+			return;
+		}
+		if (!armed || csp_rdp_time_before(conn->timestamp + conn->rdp.conn_timeout, deadline)) {
+			deadline = conn->timestamp + conn->rdp.conn_timeout;
+			armed = 1;
+		}
 	}
 
 	/**
@@ -515,64 +1269,120 @@ void csp_rdp_check_timeouts(csp_conn_t * conn) {
 		if (csp_rdp_time_after(time_now, conn->timestamp + conn->rdp.conn_timeout)) {
 			csp_debug(CSP_PROTOCOL, "CLOSE_WAIT timeout\r\n");
 			csp_close(conn);
+		} else {
+			csp_timer_set(&conn->rdp.timer, conn->timestamp + conn->rdp.conn_timeout);
 		}
 		return;
 	}
 
 	/**
 	 * MESSAGE TIMEOUT:
-	 * Check each outgoing message for TX timeout
+	 * Retransmit segments from the head of the retransmit list until one
+	 * has not timed out. Retransmitted segments move to the tail. The first
+	 * timeout of a segment presumes everything outstanding lost: the timeout
+	 * backs off and the congestion window closes once, and the others are
+	 * resent as they expire without further backoff.
 	 */
-	int i, count;
-	count = csp_queue_size(conn->rdp.tx_queue);
-	for (i = 0; i < count; i++) {
+	csp_packet_t * resend[RDP_RESEND_MAX];
+	int i, j, count = 0, slot, next;
 
-		if ((csp_queue_dequeue_isr(conn->rdp.tx_queue, &packet, &pdTrue) != CSP_QUEUE_OK) || packet == NULL) {
-			csp_debug(CSP_WARN, "Cannot dequeue from tx_queue in check timeout\r\n");
-			break;
-		}
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+	slot = conn->rdp.tx_head;
+	for (i = 0; i < conn->rdp.tx_size && slot != RDP_TX_NONE; i++, slot = next) {
 
-		/* Get header */
-		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+		next = conn->rdp.tx_next[slot];
+		packet = (rdp_packet_t *) conn->rdp.tx_ring[slot];
 
 		/* If acked, do not retransmit */
-		if (csp_rdp_seq_before(csp_ntoh16(header->seq_nr), conn->rdp.snd_una)) {
-			csp_debug(CSP_PROTOCOL, "TX Element Free, time %u, seq %u, una %u\r\n", packet->timestamp, csp_ntoh16(header->seq_nr), conn->rdp.snd_una);
-			csp_buffer_free(packet);
+		uint16_t seq = conn->rdp.tx_una + (slot + conn->rdp.tx_size - conn->rdp.tx_base) % conn->rdp.tx_size;
+		if (csp_rdp_seq_before(seq, conn->rdp.snd_una)) {
+			csp_buffer_free(csp_rdp_tx_remove(conn, slot));
 			continue;
 		}
 
-		/* Check timestamp and retransmit if needed */
-		if (csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.packet_timeout)) {
-			csp_debug(CSP_PROTOCOL, "TX Element timed out, retransmitting seq %u\r\n", csp_ntoh16(header->seq_nr));
-
-			/* Update to latest outgoing ACK */
-			header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+		if (!csp_rdp_time_after(time_now, packet->timestamp + conn->rdp.rto))
+			break;
+		if (count == RDP_RESEND_MAX)
+			break;
 
-			/* Send copy to tx_queue */
-			packet->timestamp = csp_get_ms();
-			csp_packet_t * new_packet = csp_buffer_clone(packet);
-			if (csp_send_direct(conn->idout, new_packet, 0) != CSP_ERR_NONE) {
-				csp_debug(CSP_WARN, "Retransmission failed\r\n");
-				csp_buffer_free(new_packet);
-			}
+		uint32_t bit = (uint32_t) 1 << (slot % 32);
+		if (!(conn->rdp.tx_lost[slot / 32] & bit)) {
+			for (j = 0; j < conn->rdp.tx_size; j++)
+				if (conn->rdp.tx_ring[j] != NULL)
+					conn->rdp.tx_lost[j / 32] |= (uint32_t) 1 << (j % 32);
+			csp_rdp_cc_loss(conn, 1);
+			/* Exponential backoff, kept until a valid RTT sample */
+			csp_rdp_rto_set(conn, conn->rdp.rto * 2);
+		}
 
+#if CSP_RDP_CC
+		/* Congestion window is full, try again in a round trip */
+		if (count >= conn->rdp.cwnd) {
+			uint32_t rtt = conn->stats.rtt;
+			if (rtt == 0 || rtt > conn->rdp.rto)
+				rtt = conn->rdp.rto;
+			packet->timestamp = time_now + rtt - conn->rdp.rto;
+			csp_rdp_tx_unlink(conn, slot);
+			csp_rdp_tx_link_sorted(conn, slot);
+			continue;
 		}
+#endif
+		conn->rdp.tx_lost[slot / 32] &= ~bit;
+
+		rdp_header_t * header = csp_rdp_header_ref((csp_packet_t *) packet);
+
+		/* Update to latest outgoing ACK */
+		header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
 
-		/* Requeue the TX element */
-		csp_queue_enqueue_isr(conn->rdp.tx_queue, &packet, &pdTrue);
+		/* Acknowledgements of segments sent so far give no RTT sample */
+		conn->rdp.rtt_ambiguous = conn->rdp.snd_nxt;
+		conn->stats.retransmits++;
+
+		/* Send a copy, the segment stays in the ring */
+		packet->timestamp = time_now;
+		resend[count] = csp_buffer_clone(packet);
+		if (resend[count] != NULL)
+			count++;
+
+		csp_rdp_tx_unlink(conn, slot);
+		csp_rdp_tx_link_tail(conn, slot);
 
 	}
 
+	/* Next retransmission deadline */
+	if (conn->rdp.tx_head != RDP_TX_NONE) {
+		uint32_t next = ((rdp_packet_t *) conn->rdp.tx_ring[conn->rdp.tx_head])->timestamp + conn->rdp.rto;
+		if (!armed || csp_rdp_time_before(next, deadline)) {
+			deadline = next;
+			armed = 1;
+		}
+	}
+	int in_flight = conn->rdp.tx_count;
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+
+	uint16_t ack_nr = conn->rdp.rcv_cur;
+	for (i = 0; i < count; i++) {
+		csp_debug(CSP_PROTOCOL, "TX Element timed out, retransmitting seq %u\r\n", csp_ntoh16(csp_rdp_header_ref(resend[i])->seq_nr));
+		if (csp_send_direct(conn->idout, resend[i], 0) != CSP_ERR_NONE) {
+			csp_debug(CSP_WARN, "Retransmission failed\r\n");
+			csp_buffer_free(resend[i]);
+		} else {
+			csp_rdp_ack_carried(conn, ack_nr);
+		}
+	}
+
+	if (armed)
+		csp_timer_set(&conn->rdp.timer, deadline);
+
 	/**
 	 * ACK TIMEOUT:
 	 * Check ACK timeouts, if we have unacknowledged segments
 	 */
-	csp_rdp_check_ack(conn);
+	csp_rdp_ack_check(conn, 1);
 
 	/* Wake user task if TX queue is ready for more data */
 	if (conn->rdp.state == RDP_OPEN)
-		if (csp_queue_size(conn->rdp.tx_queue) < (int)conn->rdp.window_size)
+		if (in_flight < (int)csp_rdp_send_window(conn))
 			if (csp_rdp_seq_before(conn->rdp.snd_nxt - conn->rdp.snd_una, conn->rdp.window_size * 2))
 				csp_bin_sem_post(&conn->rdp.tx_wait);
 
@@ -597,6 +1407,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		if (rx_header->ack) {
 			/* Store current ack'ed sequence number */
 			conn->rdp.snd_una = rx_header->ack_nr + 1;
+			csp_rdp_tx_release(conn);
 		}
 
 		if (conn->rdp.state == RDP_CLOSE_WAIT || conn->rdp.state == RDP_CLOSED) {
@@ -607,6 +1418,10 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		} else {
 			csp_debug(CSP_PROTOCOL, "Got RESET in state %u\r\n", conn->rdp.state);
 
+			/* The peer may have reset on data behind the SYN, do not send it any more */
+			if (conn->rdp.state == RDP_SYN_SENT && conn->rdp.fastopen)
+				csp_rdp_fastopen_learn(conn->idout, 0);
+
 			if (rx_header->seq_nr == (uint16_t)(conn->rdp.rcv_cur + 1)) {
 				csp_debug(CSP_PROTOCOL, "RESET in sequence, no more data incoming, reply with RESET\r\n");
 				conn->rdp.state = RDP_CLOSE_WAIT;
@@ -628,6 +1443,12 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 	 */
 	case RDP_CLOSED: {
 
+		/* Data from a fast open client overtook its SYN, which is retransmitted */
+		if (!rx_header->syn && !rx_header->ack && (conn->conn_opts & CSP_SO_RDPFASTOPEN)) {
+			csp_debug(CSP_PROTOCOL, "Fast open data before SYN in CLOSED state. Discarding packet\r\n");
+			goto discard_close;
+		}
+
 		/* No SYN flag set while in closed. Inform by sending back RST */
 		if (!rx_header->syn) {
 			csp_debug(CSP_PROTOCOL, "Not SYN received in CLOSED state. Discarding packet\r\n");
@@ -637,34 +1458,60 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		csp_debug(CSP_PROTOCOL, "RDP: SYN-Received\r\n");
 
+		/* Accept at most the local maximum window, and size the rings and RX
+		 * queues for it. Only the router task queues packets on the connection
+		 * until it is accepted, so the queues can be replaced here. */
+		uint32_t window = csp_rdp_window_limit(csp_ntoh32(packet->data32[0]));
+		if (csp_conn_rx_queue_resize(conn, csp_rdp_rxq_length(window)) != CSP_ERR_NONE ||
+				csp_rdp_rings_alloc(conn, window) != CSP_ERR_NONE) {
+			csp_debug(CSP_ERROR, "RDP: No memory for window of %"PRIu32"\r\n", window);
+			csp_rdp_send_cmp(conn, NULL, RDP_RST, 0, rx_header->seq_nr);
+			goto discard_close;
+		}
+
 		/* Setup TX seq. */
 		srand(csp_get_ms());
 		conn->rdp.snd_iss = (uint16_t)rand();
 		conn->rdp.snd_nxt = conn->rdp.snd_iss + 1;
 		conn->rdp.snd_una = conn->rdp.snd_iss;
+		csp_rdp_tx_reset(conn, conn->rdp.snd_iss);
+		conn->rdp.rtt_ambiguous = conn->rdp.snd_iss;
 
 		/* Store RX seq. */
 		conn->rdp.rcv_cur = rx_header->seq_nr;
 		conn->rdp.rcv_irs = rx_header->seq_nr;
 		conn->rdp.rcv_lsa = rx_header->seq_nr;
+		conn->rdp.ack_carried = conn->rdp.rcv_lsa;
 
 		/* Store RDP options */
-		conn->rdp.window_size 		= csp_ntoh32(packet->data32[0]);
+		conn->rdp.window_size 		= window;
 		conn->rdp.conn_timeout 		= csp_ntoh32(packet->data32[1]);
 		conn->rdp.packet_timeout 	= csp_ntoh32(packet->data32[2]);
 		conn->rdp.delayed_acks 		= csp_ntoh32(packet->data32[3]);
 		conn->rdp.ack_timeout 		= csp_ntoh32(packet->data32[4]);
 		conn->rdp.ack_delay_count 	= csp_ntoh32(packet->data32[5]);
+		conn->rdp.sack = 0;
+		conn->rdp.fastopen = RDP_FASTOPEN_OFF;
+		if (packet->length >= sizeof(rdp_header_t) + 7 * sizeof(uint32_t)) {
+			uint32_t opts = csp_ntoh32(packet->data32[6]);
+			conn->rdp.sack = (opts & RDP_OPT_SACK) ? 1 : 0;
+			if (opts & RDP_OPT_FASTOPEN)
+				conn->rdp.fastopen = (conn->conn_opts & CSP_SO_RDPFASTOPEN) ?
+						RDP_FASTOPEN_ACCEPTED : RDP_FASTOPEN_REQUESTED;
+		}
 		csp_debug(CSP_PROTOCOL, "RDP: Window Size %u, conn timeout %u, packet timeout %u\r\n",
 				conn->rdp.window_size, conn->rdp.conn_timeout, conn->rdp.packet_timeout);
-		csp_debug(CSP_PROTOCOL, "RDP: Delayed acks: %u, ack timeout %u, ack each %u packet\r\n",
-				conn->rdp.delayed_acks, conn->rdp.ack_timeout, conn->rdp.ack_delay_count);
+		csp_debug(CSP_PROTOCOL, "RDP: Delayed acks: %u, ack timeout %u, ack each %u packet, sack %u, fast open %u\r\n",
+				conn->rdp.delayed_acks, conn->rdp.ack_timeout, conn->rdp.ack_delay_count, conn->rdp.sack,
+				conn->rdp.fastopen);
+		csp_rdp_rtt_reset(conn);
+		csp_rdp_cc_reset(conn);
 
 		/* Connection accepted */
 		conn->rdp.state = RDP_SYN_RCVD;
 
 		/* Send SYN/ACK */
-		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+		csp_rdp_send_synack(conn);
 
 		goto discard_open;
 
@@ -682,12 +1529,44 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			conn->rdp.rcv_cur = rx_header->seq_nr;
 			conn->rdp.rcv_irs = rx_header->seq_nr;
 			conn->rdp.rcv_lsa = rx_header->seq_nr - 1;
+			conn->rdp.ack_carried = conn->rdp.rcv_lsa;
 			conn->rdp.snd_una = rx_header->ack_nr + 1;
 			conn->rdp.ack_timestamp = csp_get_ms();
+
+			/* The other end may accept a smaller window than offered */
+			if (packet->length >= sizeof(rdp_header_t) + sizeof(uint32_t)) {
+				uint32_t window = csp_ntoh32(packet->data32[0]);
+				if (window > 0 && window < conn->rdp.window_size) {
+					csp_debug(CSP_PROTOCOL, "RDP: Window reduced to %"PRIu32"\r\n", window);
+					conn->rdp.window_size = window;
+					csp_rdp_cc_reset(conn);
+				}
+			}
+			uint32_t opts = 0;
+			if (packet->length >= sizeof(rdp_header_t) + 2 * sizeof(uint32_t))
+				opts = csp_ntoh32(packet->data32[1]);
+			conn->rdp.sack = (opts & RDP_OPT_SACK) ? 1 : 0;
+
+			/* Release the SYN, before the state change so it does not count
+			 * towards the congestion window */
+			csp_rdp_tx_release(conn);
+
 			conn->rdp.state = RDP_OPEN;
 
 			csp_debug(CSP_PROTOCOL, "RDP: NP: Connection OPEN\r\n");
 
+			/* Data behind the SYN is only sent to ports that accepted it before */
+			if (conn->conn_opts & CSP_O_RDPFASTOPEN)
+				csp_rdp_fastopen_learn(conn->idout, opts & RDP_OPT_FASTOPEN);
+
+			/* Data sent behind the SYN now carries ACKs, and must be sent again
+			 * if the other end did not accept it */
+			if (conn->rdp.fastopen) {
+				if (opts & RDP_OPT_FASTOPEN)
+					conn->rdp.fastopen = RDP_FASTOPEN_ACCEPTED;
+				csp_rdp_fastopen_ack(conn, conn->rdp.fastopen != RDP_FASTOPEN_ACCEPTED);
+			}
+
 			/* Send ACK */
 			if (conn->rdp.delayed_acks == 0)
 				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
@@ -704,6 +1583,11 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		 * we don't have a method for signaling this to the user space.
 		 */
 		if (rx_header->ack) {
+			/* A fast open server may send data before its SYN/ACK arrives */
+			if (conn->rdp.fastopen && csp_rdp_seq_between(rx_header->ack_nr, conn->rdp.snd_iss, conn->rdp.snd_nxt - 1)) {
+				csp_debug(CSP_PROTOCOL, "Segment before SYN/ACK, discarding\r\n");
+				goto discard_open;
+			}
 			csp_debug(CSP_ERROR, "Half-open connection found, sending RST\r\n");
 			csp_rdp_send_cmp(conn, NULL, RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 			csp_bin_sem_post(&conn->rdp.tx_wait);
@@ -728,8 +1612,10 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 	case RDP_OPEN:
 	{
 
-		/* SYN or !ACK is invalid */
-		if (rx_header->syn || !rx_header->ack) {
+		/* SYN or !ACK is invalid, except for data sent behind the SYN by a
+		 * fast open client, which acknowledges nothing */
+		int early = !rx_header->syn && !rx_header->ack && conn->rdp.fastopen;
+		if ((rx_header->syn || !rx_header->ack) && !early) {
 			if (rx_header->seq_nr != conn->rdp.rcv_irs) {
 				csp_debug(CSP_ERROR, "Invalid SYN or no ACK, resetting!\r\n");
 				goto discard_close;
@@ -739,13 +1625,19 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			}
 		}
 
+		/* Without fast open, the client sends the data again after the SYN/ACK */
+		if (early && conn->rdp.fastopen != RDP_FASTOPEN_ACCEPTED) {
+			csp_debug(CSP_PROTOCOL, "Fast open not accepted, discarding data\r\n");
+			goto discard_open;
+		}
+
 		/* Check sequence number */
 		if (!csp_rdp_seq_between(rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + conn->rdp.window_size * 2)) {
 			csp_debug(CSP_PROTOCOL, "Invalid sequence number! %"PRIu16" not between %"PRIu16" and %"PRIu16"\r\n",
 					rx_header->seq_nr, conn->rdp.rcv_cur + 1, conn->rdp.rcv_cur + 1 + conn->rdp.window_size * 2);
 			/* If duplicate SYN received, send another SYN/ACK */
 			if (conn->rdp.state == RDP_SYN_RCVD)
-				csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_SYN, conn->rdp.snd_iss, conn->rdp.rcv_irs);
+				csp_rdp_send_synack(conn);
 			/* If duplicate data packet received, send EACK back */
 			if (conn->rdp.state == RDP_OPEN)
 				csp_rdp_send_eack(conn);
@@ -753,31 +1645,35 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			goto discard_open;
 		}
 
-        /* Check ACK number */
-		if (!csp_rdp_seq_between(rx_header->ack_nr, conn->rdp.snd_una - 1 - (conn->rdp.window_size * 2), conn->rdp.snd_nxt - 1)) {
-			csp_debug(CSP_ERROR, "Invalid ACK number! %u not between %u and %u\r\n",
-					rx_header->ack_nr, conn->rdp.snd_una - 1 - (conn->rdp.window_size * 2), conn->rdp.snd_nxt - 1);
-			goto discard_open;
-		}
+		if (!early) {
+			/* Check ACK number */
+			if (!csp_rdp_seq_between(rx_header->ack_nr, conn->rdp.snd_una - 1 - (conn->rdp.window_size * 2), conn->rdp.snd_nxt - 1)) {
+				csp_debug(CSP_ERROR, "Invalid ACK number! %u not between %u and %u\r\n",
+						rx_header->ack_nr, conn->rdp.snd_una - 1 - (conn->rdp.window_size * 2), conn->rdp.snd_nxt - 1);
+				goto discard_open;
+			}
 
-		/* Check SYN_RCVD ACK */
-		if (conn->rdp.state == RDP_SYN_RCVD) {
-			if (rx_header->ack_nr != conn->rdp.snd_iss) {
-				csp_debug(CSP_ERROR, "SYN-RCVD: Wrong ACK number\r\n");
-				goto discard_close;
+			/* Check SYN_RCVD ACK */
+			if (conn->rdp.state == RDP_SYN_RCVD) {
+				if (rx_header->ack_nr != conn->rdp.snd_iss) {
+					csp_debug(CSP_ERROR, "SYN-RCVD: Wrong ACK number\r\n");
+					goto discard_close;
+				}
+				csp_debug(CSP_PROTOCOL, "RDP: NC: Connection OPEN\r\n");
+				conn->rdp.state = RDP_OPEN;
 			}
-			csp_debug(CSP_PROTOCOL, "RDP: NC: Connection OPEN\r\n");
-			conn->rdp.state = RDP_OPEN;
-		}
 
-		/* Store current ack'ed sequence number */
-		conn->rdp.snd_una = rx_header->ack_nr + 1;
+			/* Store current ack'ed sequence number */
+			conn->rdp.snd_una = rx_header->ack_nr + 1;
+			csp_rdp_tx_release(conn);
 
-		/* We have an EACK */
-		if (rx_header->eak) {
-			if (packet->length > sizeof(rdp_header_t))
-				csp_rdp_flush_eack(conn, packet);
-			goto discard_open;
+			/* We have an EACK */
+			if (rx_header->eak) {
+				conn->stats.eack_rx++;
+				if (packet->length > sizeof(rdp_header_t))
+					csp_rdp_flush_eack(conn, packet);
+				goto discard_open;
+			}
 		}
 
 		/* If no data, return here */
@@ -786,7 +1682,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* If message is not in sequence, send EACK and store packet */
 		if (rx_header->seq_nr != (uint16_t)(conn->rdp.rcv_cur + 1)) {
-			if (csp_rdp_rx_queue_add(conn, packet, rx_header->seq_nr) != CSP_QUEUE_OK) {
+			if (csp_rdp_rx_ring_add(conn, packet, rx_header->seq_nr) != CSP_ERR_NONE) {
 				csp_debug(CSP_PROTOCOL, "Duplicate sequence number\r\n");
 				goto discard_open;
 			}
@@ -794,6 +1690,13 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 			goto accepted_open;
 		}
 
+		/* In-sequence data from a fast open client opens the connection. Its
+		 * sequence number follows the ISS of this SYN, so it is no old duplicate. */
+		if (conn->rdp.state == RDP_SYN_RCVD) {
+			csp_debug(CSP_PROTOCOL, "RDP: NC: Connection OPEN by fast open data\r\n");
+			conn->rdp.state = RDP_OPEN;
+		}
+
 		/* Store sequence number before stripping RDP header */
 		uint16_t seq_nr = rx_header->seq_nr;
 
@@ -801,8 +1704,9 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		if (!csp_rdp_receive_data(conn, packet))
 			goto discard_open;
 
-		/* Update last received packet */
+		/* Update last received packet, its ring slot is now behind rcv_cur */
 		conn->rdp.rcv_cur = seq_nr;
+		conn->rdp.rx_base = (conn->rdp.rx_base + 1) % conn->rdp.rx_size;
 
 		/* The message is in sequence and contains data */
 		int rxq = csp_conn_get_rxq(packet->id.pri);
@@ -811,15 +1715,23 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 		/* Only ACK the message if there is room for a full window in the RX buffer.
 		 * Unacknowledged segments are ACKed by csp_rdp_check_timeouts when the buffer is
 		 * no longer full. */
-		if (rx_queue_size + conn->rdp.window_size <= CSP_RX_QUEUE_LENGTH) {
-			if (csp_rdp_should_ack(conn))
-				csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+		if (rx_queue_size + conn->rdp.window_size <= conn->rx_queue_length) {
+			if (csp_rdp_ack_pending(conn) && csp_rdp_should_ack(conn)) {
+				/* A sending task woken by this segment will carry the ACK,
+				 * give it one timer tick before sending the ACK separately.
+				 * The router wait is bounded by the timer, so it fires on time. */
+				if (conn->rdp.tx_waiting &&
+						(uint16_t)(conn->rdp.snd_nxt - conn->rdp.snd_una) < csp_rdp_send_window(conn))
+					csp_timer_set_earlier(&conn->rdp.timer, csp_get_ms() + CSP_TIMER_RESOLUTION);
+				else
+					csp_rdp_send_cmp(conn, NULL, RDP_ACK, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
+			}
 		} else {
 			csp_debug(CSP_PROTOCOL, "Less than one window free in RX_queue, deferring acknowledgment for %"PRIu16"\r\n", conn->rdp.rcv_cur);
 		}
 
-		/* Flush RX queue */
-		csp_rdp_rx_queue_flush(conn);
+		/* Deliver queued segments that are now in sequence */
+		csp_rdp_rx_ring_flush(conn);
 
 		goto accepted_open;
 
@@ -843,6 +1755,7 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 		/* Store current ack'ed sequence number */
 		conn->rdp.snd_una = rx_header->ack_nr + 1;
+		csp_rdp_tx_release(conn);
 
 		/* Send back a reset */
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
@@ -861,6 +1774,8 @@ discard_close:
 		csp_debug(CSP_PROTOCOL, "Waiting for userspace to close\r\n");
 	    void * null_pointer = NULL;
 	    csp_conn_enqueue_packet(conn, (csp_packet_t *) null_pointer);
+	    csp_poll_signal(conn, NULL);
+	    csp_callback_schedule_conn(conn);
 	} else {
 		csp_close(conn);
 	}
@@ -868,6 +1783,7 @@ discard_close:
 discard_open:
 	csp_buffer_free(packet);
 accepted_open:
+	csp_rdp_timer_update(conn);
 	return;
 
 }
@@ -876,13 +1792,32 @@ int csp_rdp_connect(csp_conn_t * conn, unsigned int timeout) {
 
 	int retry = 1;
 
-	conn->rdp.window_size     = csp_rdp_window_size;
+	conn->rdp.window_size     = csp_rdp_window_limit(csp_rdp_window_size);
 	conn->rdp.conn_timeout    = csp_rdp_conn_timeout;
+
+	/* The RX queues were sized by csp_conn_new, before the router could find
+	 * the connection. Fit the window to them, the option may have changed. */
+	if (csp_rdp_rxq_length(conn->rdp.window_size) > conn->rx_queue_length)
+		conn->rdp.window_size = conn->rx_queue_length / 2;
+
 	conn->rdp.packet_timeout  = csp_rdp_packet_timeout;
 	conn->rdp.delayed_acks    = csp_rdp_delayed_acks;
 	conn->rdp.ack_timeout 	  = csp_rdp_ack_timeout;
 	conn->rdp.ack_delay_count = csp_rdp_ack_delay_count;
 	conn->rdp.ack_timestamp   = csp_get_ms();
+	conn->rdp.sack            = 0;
+	conn->rdp.fastopen        = RDP_FASTOPEN_OFF;
+	csp_rdp_rtt_reset(conn);
+
+	/* Send data behind the SYN only to ports known to accept it. The SYN
+	 * asks for fast open anyway, so the SYN/ACK tells for next time. */
+	if ((conn->conn_opts & CSP_O_RDPFASTOPEN) && csp_rdp_fastopen_known(conn->idout))
+		conn->rdp.fastopen = RDP_FASTOPEN_REQUESTED;
+
+	if (csp_rdp_rings_alloc(conn, conn->rdp.window_size) != CSP_ERR_NONE) {
+		csp_debug(CSP_ERROR, "RDP: No memory for window of %"PRIu32"\r\n", conn->rdp.window_size);
+		return CSP_ERR_NOMEM;
+	}
 
 retry:
 	csp_debug(CSP_PROTOCOL, "RDP: Active connect, conn state %u\r\n", conn->rdp.state);
@@ -898,6 +1833,9 @@ retry:
 
 	conn->rdp.snd_nxt = conn->rdp.snd_iss + 1;
 	conn->rdp.snd_una = conn->rdp.snd_iss;
+	conn->rdp.rtt_ambiguous = conn->rdp.snd_iss;
+	csp_rdp_tx_reset(conn, conn->rdp.snd_iss);
+	csp_rdp_cc_reset(conn);
 
 	csp_debug(CSP_PROTOCOL, "RDP: AC: Sending SYN\r\n");
 
@@ -909,6 +1847,13 @@ retry:
 	if (csp_rdp_send_syn(conn) != CSP_ERR_NONE)
 		goto error;
 
+	/* With fast open, data may follow the SYN at once. The router task
+	 * completes the handshake, or closes the connection on timeout. */
+	if (conn->rdp.fastopen) {
+		csp_debug(CSP_PROTOCOL, "RDP: AC: Fast open, not waiting for SYN/ACK\r\n");
+		return CSP_ERR_NONE;
+	}
+
 	/* Wait for router task to release semaphore */
 	csp_debug(CSP_PROTOCOL, "RDP: AC: Waiting for SYN/ACK reply...\r\n");
 	int result = csp_bin_sem_wait(&conn->rdp.tx_wait, conn->rdp.conn_timeout);
@@ -941,29 +1886,33 @@ error:
 
 int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout) {
 
-	if (conn->rdp.state != RDP_OPEN) {
+	if (conn->rdp.state != RDP_OPEN && !(conn->rdp.state == RDP_SYN_SENT && conn->rdp.fastopen)) {
 		csp_debug(CSP_ERROR, "RDP: ERROR cannot send, connection reset by peer!\r\n");
 		return CSP_ERR_RESET;
 	}
 
 	/* If TX window is full, wait here */
 	uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una + 1;
-	if (in_flight > conn->rdp.window_size) {
+	if (in_flight > csp_rdp_send_window(conn)) {
 		csp_debug(CSP_PROTOCOL, "RDP: Waiting for window update before sending seq %u\r\n", conn->rdp.snd_nxt);
 		csp_bin_sem_wait(&conn->rdp.tx_wait, 0);
-		if ((csp_bin_sem_wait(&conn->rdp.tx_wait, timeout)) != CSP_SEMAPHORE_OK) {
+		conn->rdp.tx_waiting = 1;
+		int ret = csp_bin_sem_wait(&conn->rdp.tx_wait, timeout);
+		conn->rdp.tx_waiting = 0;
+		if (ret != CSP_SEMAPHORE_OK) {
 			csp_debug(CSP_ERROR, "Timeout during send\r\n");
 			return CSP_ERR_TIMEDOUT;
 		}
 	}
 
-	/* Add RDP header */
+	/* Add RDP header, the segment acknowledges all data received so far */
+	uint16_t ack_nr = conn->rdp.rcv_cur;
 	rdp_header_t * tx_header = csp_rdp_header_add(packet);
-	tx_header->ack_nr = csp_hton16(conn->rdp.rcv_cur);
+	tx_header->ack_nr = csp_hton16(ack_nr);
 	tx_header->seq_nr = csp_hton16(conn->rdp.snd_nxt);
 	tx_header->ack = 1;
 
-	/* Send copy to tx_queue */
+	/* Keep copy in retransmit ring */
 	rdp_packet_t * rdp_packet = csp_buffer_clone(packet);
 	if (rdp_packet == NULL) {
 		csp_debug(CSP_ERROR, "Failed to allocate packet buffer\r\n");
@@ -972,11 +1921,23 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout)
 
 	rdp_packet->timestamp = csp_get_ms();
 	rdp_packet->quarantine = 0;
-	if (csp_queue_enqueue(conn->rdp.tx_queue, &rdp_packet, 0) != CSP_QUEUE_OK) {
-		csp_debug(CSP_ERROR, "No more space in RDP retransmit queue\r\n");
+	csp_mutex_lock(&conn->rdp.tx_lock, CSP_MAX_DELAY);
+	/* Fast open data sent before the SYN/ACK acknowledges nothing. The router
+	 * task sets the ACK flag of the copy in the ring when the SYN/ACK arrives. */
+	if (conn->rdp.state == RDP_SYN_SENT) {
+		tx_header->ack = 0;
+		csp_rdp_header_ref((csp_packet_t *) rdp_packet)->ack = 0;
+	}
+	int ret = csp_rdp_tx_add(conn, rdp_packet, conn->rdp.snd_nxt);
+	csp_mutex_unlock(&conn->rdp.tx_lock);
+	if (ret != CSP_ERR_NONE) {
+		csp_debug(CSP_ERROR, "No more space in RDP retransmit ring\r\n");
 		csp_buffer_free(rdp_packet);
 		return CSP_ERR_NOBUFS;
 	}
+	csp_timer_set_earlier(&conn->rdp.timer, rdp_packet->timestamp + conn->rdp.rto);
+	if (tx_header->ack)
+		conn->rdp.ack_carried = ack_nr;
 
 	csp_debug(CSP_PROTOCOL, "RDP: Sending  in S %u: syn %u, ack %u, eack %u, "
 				"rst %u, seq_nr %5u, ack_nr %5u, packet_len %u (%u)\r\n",
@@ -989,6 +1950,26 @@ int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout)
 
 }
 
+unsigned int csp_rdp_header_size(void) {
+
+	return sizeof(rdp_header_t);
+
+}
+
+int csp_rdp_tx_room(csp_conn_t * conn) {
+
+	if (conn->rdp.state != RDP_OPEN && !(conn->rdp.state == RDP_SYN_SENT && conn->rdp.fastopen))
+		return 0;
+
+	uint16_t in_flight = conn->rdp.snd_nxt - conn->rdp.snd_una;
+	uint32_t window = csp_rdp_send_window(conn);
+	if (in_flight >= window)
+		return 0;
+
+	return window - in_flight;
+
+}
+
 int csp_rdp_allocate(csp_conn_t * conn) {
 
 	csp_debug(CSP_BUFFER, "RDP: Creating RDP queues for conn %p\r\n", conn);
@@ -997,6 +1978,7 @@ int csp_rdp_allocate(csp_conn_t * conn) {
 	conn->rdp.state = RDP_CLOSED;
 	conn->rdp.conn_timeout = csp_rdp_conn_timeout;
 	conn->rdp.packet_timeout = csp_rdp_packet_timeout;
+	csp_timer_create(&conn->rdp.timer, csp_rdp_timer_callback, conn);
 
 	/* Create a binary semaphore to wait on for tasks */
 	if (csp_bin_sem_create(&conn->rdp.tx_wait) != CSP_SEMAPHORE_OK) {
@@ -1004,22 +1986,20 @@ int csp_rdp_allocate(csp_conn_t * conn) {
 		return CSP_ERR_NOMEM;
 	}
 
-	/* Create TX queue */
-	conn->rdp.tx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW, sizeof(csp_packet_t *));
-	if (conn->rdp.tx_queue == NULL) {
-		csp_debug(CSP_ERROR, "Failed to create TX queue for conn\r\n");
+	/* Lock for the retransmit ring */
+	if (csp_mutex_create(&conn->rdp.tx_lock) != CSP_MUTEX_OK) {
+		csp_debug(CSP_ERROR, "Failed to initialize semaphore\r\n");
 		csp_bin_sem_remove(&conn->rdp.tx_wait);
 		return CSP_ERR_NOMEM;
 	}
 
-	/* Create RX queue */
-	conn->rdp.rx_queue = csp_queue_create(CSP_RDP_MAX_WINDOW * 2, sizeof(csp_packet_t *));
-	if (conn->rdp.rx_queue == NULL) {
-		csp_debug(CSP_ERROR, "Failed to create RX queue for conn\r\n");
-		csp_bin_sem_remove(&conn->rdp.tx_wait);
-		csp_queue_remove(conn->rdp.tx_queue);
-		return CSP_ERR_NOMEM;
-	}
+	/* Rings are allocated when the window is known */
+	conn->rdp.tx_size = 0;
+	conn->rdp.tx_ring = NULL;
+	conn->rdp.rx_size = 0;
+	conn->rdp.rx_ring = NULL;
+	csp_rdp_tx_reset(conn, 0);
+	conn->rdp.rx_base = 0;
 
 	return CSP_ERR_NONE;
 
@@ -1038,6 +2018,7 @@ int csp_rdp_close(csp_conn_t * conn) {
 	if (conn->rdp.state != RDP_CLOSE_WAIT) {
 		conn->rdp.state = RDP_CLOSE_WAIT;
 		conn->timestamp = csp_get_ms();
+		csp_timer_set(&conn->rdp.timer, conn->timestamp + conn->rdp.conn_timeout);
 		csp_rdp_send_cmp(conn, NULL, RDP_ACK | RDP_RST, conn->rdp.snd_nxt, conn->rdp.rcv_cur);
 		csp_debug(CSP_PROTOCOL, "RDP Close, sent RST on conn %p\r\n", conn);
 		return 1;
@@ -1084,14 +2065,33 @@ void csp_rdp_get_opt(unsigned int * window_size, unsigned int * conn_timeout_ms,
 		*ack_delay_count = csp_rdp_ack_delay_count;
 }
 
+int csp_rdp_set_max_window(unsigned int max_window) {
+
+	if (max_window == 0 || max_window > RDP_WINDOW_LIMIT)
+		return CSP_ERR_INVAL;
+
+	csp_rdp_max_window = max_window;
+	return CSP_ERR_NONE;
+
+}
+
+unsigned int csp_rdp_get_max_window(void) {
+
+	return csp_rdp_max_window;
+
+}
+
 #ifdef CSP_DEBUG
 void csp_rdp_conn_print(csp_conn_t * conn) {
 
 	if (conn == NULL)
 		return;
 
-	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32"\r\n",
-			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size);
+	printf("\tRDP: State %"PRIu16", rcv %"PRIu16", snd %"PRIu16", win %"PRIu32", fast open %"PRIu8"\r\n",
+			conn->rdp.state, conn->rdp.rcv_cur, conn->rdp.snd_una, conn->rdp.window_size, conn->rdp.fastopen);
+#if CSP_RDP_CC
+	printf("\tRDP: cwnd %"PRIu16", ssthresh %"PRIu16"\r\n", conn->rdp.cwnd, conn->rdp.ssthresh);
+#endif
 
 }
 #endif
@@ -32,9 +32,12 @@ void csp_rdp_new_packet(csp_conn_t * conn, csp_packet_t * packet);
 /** RDP: USER REQUESTS */
 int csp_rdp_connect(csp_conn_t * conn, unsigned int timeout);
 int csp_rdp_allocate(csp_conn_t * conn);
+unsigned int csp_rdp_rx_queue_length(void);
 int csp_rdp_close(csp_conn_t * conn);
 void csp_rdp_conn_print(csp_conn_t * conn);
 int csp_rdp_send(csp_conn_t * conn, csp_packet_t * packet, unsigned int timeout);
+int csp_rdp_tx_room(csp_conn_t * conn);
+unsigned int csp_rdp_header_size(void);
 int csp_rdp_check_ack(csp_conn_t * conn);
 void csp_rdp_check_timeouts(csp_conn_t * conn);
 void csp_rdp_flush_all(csp_conn_t * conn);
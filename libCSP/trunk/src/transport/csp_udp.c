@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "../arch/csp_queue.h"
 #include "../csp_port.h"
 #include "../csp_conn.h"
+#include "../csp_callback.h"
 
 void csp_udp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
@@ -36,10 +37,13 @@ void csp_udp_new_packet(csp_conn_t * conn, csp_packet_t * packet) {
 
 	/* Try to queue up the new connection pointer */
 	if (conn->rx_socket != NULL) {
-		if (csp_queue_enqueue(conn->rx_socket, &conn, 0) != CSP_QUEUE_OK) {
-			csp_debug(CSP_WARN, "Warning Routing Queue Full\r\n");
-			csp_close(conn);
-			return;
+		if (conn->callback == NULL) {
+			if (csp_queue_enqueue(conn->rx_socket->queue, &conn, 0) != CSP_QUEUE_OK) {
+				csp_debug(CSP_WARN, "Warning Routing Queue Full\r\n");
+				csp_close(conn);
+				return;
+			}
+			csp_poll_signal(conn->rx_socket, conn->rx_socket->queue);
 		}
 
 		/* Ensure that this connection will not be posted to this socket again */
@@ -0,0 +1,370 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Benchmarks of the connection layer, run on the host.
+ * Connection lookup: the hash index against a linear scan of the
+ * connection pool, for a growing number of open connections.
+ * RDP under loss: a bulk transfer over a link that delays every packet
+ * and drops a share of them, showing how the AIMD congestion window
+ * backs off and recovers.
+ * RDP window size: the same transfer without loss for negotiated windows
+ * of 1 to 64 segments, with the RX queues sized to match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_interface.h>
+
+#include "csp_conn.h"
+
+#define MY_ADDRESS		1
+#define BENCH_CONNS		256
+#define BENCH_LOOKUPS	1000000
+
+#define BENCH_PORT		10
+#define BENCH_DELAY_MS	5		// One way delay of the link
+#define BENCH_LINK_SIZE	256		// Packets the link can hold
+#define BENCH_PACKETS	500		// Packets per transfer
+#define BENCH_LENGTH	100		// Bytes per packet
+#define BENCH_WINDOW	16		// RDP window, unless varied
+#define BENCH_WINDOW_MAX	64	// Largest RDP window tried
+
+static double bench_now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/**
+ * Time lookups of open connections. A full connection mask uses the hash
+ * index. Adding a flag bit, which is clear in all identifiers, gives the
+ * same matches through the linear scan.
+ */
+static int bench_lookup(void) {
+
+	static csp_conn_t * conns[BENCH_CONNS];
+	static uint32_t ids[BENCH_CONNS];
+	const int sizes[] = {8, 32, 128, BENCH_CONNS};
+	uint32_t linear_mask = CSP_ID_CONN_MASK | CSP_FRES1;
+	unsigned int i, s, open = 0, errors = 0;
+	double start, hash_ns, linear_ns;
+
+	printf("Connection lookup, %d lookups\r\n", BENCH_LOOKUPS);
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+
+		/* Open connections from distinct hosts and ports, to bound ports only */
+		while (open < (unsigned int) sizes[s]) {
+			csp_id_t idin, idout;
+			idin.ext = 0;
+			idin.pri = CSP_PRIO_NORM;
+			idin.src = open % (CSP_ID_HOST_MAX + 1);
+			idin.dst = MY_ADDRESS;
+			idin.dport = (open / (CSP_ID_HOST_MAX + 1)) % (CSP_MAX_BIND_PORT + 1);
+			idin.sport = open / ((CSP_ID_HOST_MAX + 1) * (CSP_MAX_BIND_PORT + 1)) + CSP_MAX_BIND_PORT + 1;
+			idout.ext = 0;
+			idout.pri = idin.pri;
+			idout.src = idin.dst;
+			idout.dst = idin.src;
+			idout.dport = idin.sport;
+			idout.sport = idin.dport;
+			conns[open] = csp_conn_new(idin, idout);
+			if (conns[open] == NULL) {
+				printf("Failed to open connection %u\r\n", open);
+				return 1;
+			}
+			ids[open++] = idin.ext;
+		}
+
+		start = bench_now();
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			if (csp_conn_find(ids[i % open], CSP_ID_CONN_MASK) != conns[i % open])
+				errors++;
+		hash_ns = (bench_now() - start) * 1e9 / BENCH_LOOKUPS;
+
+		start = bench_now();
+		for (i = 0; i < BENCH_LOOKUPS; i++)
+			if (csp_conn_find(ids[i % open], linear_mask) != conns[i % open])
+				errors++;
+		linear_ns = (bench_now() - start) * 1e9 / BENCH_LOOKUPS;
+
+		printf("  %3u connections: hash %6.1f ns, linear %7.1f ns\r\n", open, hash_ns, linear_ns);
+
+	}
+
+	for (i = 0; i < open; i++)
+		csp_close(conns[i]);
+
+	if (errors)
+		printf("  %u lookups found the wrong connection\r\n", errors);
+
+	return errors ? 1 : 0;
+
+}
+
+/* Link that delivers packets back to this node after BENCH_DELAY_MS, and
+ * drops RDP packets with a probability of link_loss percent */
+static struct {
+	csp_packet_t * packet;
+	double due;
+} link_ring[BENCH_LINK_SIZE];
+static unsigned int link_head, link_count;
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;
+static volatile int link_loss;
+
+static int bench_link_tx(csp_packet_t * packet, unsigned int timeout);
+
+static csp_iface_t bench_link = {
+	.name = "BENCH",
+	.nexthop = bench_link_tx,
+};
+
+static int bench_link_tx(csp_packet_t * packet, unsigned int timeout) {
+
+	if ((packet->id.flags & CSP_FRDP) && rand() % 100 < link_loss) {
+		csp_buffer_free(packet);
+		return 1;
+	}
+
+	pthread_mutex_lock(&link_lock);
+	if (link_count == BENCH_LINK_SIZE) {
+		pthread_mutex_unlock(&link_lock);
+		bench_link.drop++;
+		csp_buffer_free(packet);
+		return 1;
+	}
+	link_ring[(link_head + link_count) % BENCH_LINK_SIZE].packet = packet;
+	link_ring[(link_head + link_count) % BENCH_LINK_SIZE].due = bench_now() + BENCH_DELAY_MS / 1e3;
+	link_count++;
+	pthread_cond_signal(&link_cond);
+	pthread_mutex_unlock(&link_lock);
+
+	return 1;
+
+}
+
+static void * bench_link_task(void * arg) {
+
+	csp_packet_t * packet;
+	double wait;
+
+	pthread_mutex_lock(&link_lock);
+	while (1) {
+		if (link_count == 0) {
+			pthread_cond_wait(&link_cond, &link_lock);
+			continue;
+		}
+
+		/* All packets have the same delay, so the oldest is due first */
+		wait = link_ring[link_head].due - bench_now();
+		if (wait > 0) {
+			pthread_mutex_unlock(&link_lock);
+			usleep(wait * 1e6);
+			pthread_mutex_lock(&link_lock);
+			continue;
+		}
+
+		packet = link_ring[link_head].packet;
+		link_head = (link_head + 1) % BENCH_LINK_SIZE;
+		link_count--;
+		pthread_mutex_unlock(&link_lock);
+		csp_new_packet(packet, &bench_link, NULL);
+		pthread_mutex_lock(&link_lock);
+	}
+
+	return NULL;
+
+}
+
+/* Packets received by the server in the current transfer */
+static volatile int server_received;
+
+static void * bench_server_task(void * arg) {
+
+	csp_socket_t * sock = csp_socket(CSP_SO_NONE);
+	csp_bind(sock, BENCH_PORT);
+	csp_listen(sock, 5);
+
+	while (1) {
+		csp_conn_t * conn = csp_accept(sock, CSP_MAX_DELAY);
+		csp_packet_t * packet;
+		if (conn == NULL)
+			continue;
+		while ((packet = csp_read(conn, 1000)) != NULL) {
+			server_received++;
+			csp_buffer_free(packet);
+		}
+		csp_close(conn);
+	}
+
+	return NULL;
+
+}
+
+/**
+ * Send BENCH_PACKETS over an RDP connection and wait until the server has
+ * received them all. The congestion window is sampled after each send.
+ * The window and RX queue length of the connection are returned in
+ * window, if not NULL.
+ * @return 0 on success, 1 if the transfer failed
+ */
+static int bench_transfer(double * seconds, csp_conn_stats_t * stats, double * cwnd_mean, unsigned int window[2]) {
+
+	csp_conn_t * conn;
+	double start, cwnd_sum = 0;
+	int i;
+
+	server_received = 0;
+	conn = csp_connect(CSP_PRIO_NORM, MY_ADDRESS, BENCH_PORT, 1000, CSP_O_RDP);
+	if (conn == NULL)
+		return 1;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_PACKETS; i++) {
+		csp_packet_t * packet = csp_buffer_get(BENCH_LENGTH);
+		if (packet == NULL)
+			break;
+		memset(packet->data, i, BENCH_LENGTH);
+		packet->length = BENCH_LENGTH;
+		if (!csp_send(conn, packet, 10000)) {
+			csp_buffer_free(packet);
+			break;
+		}
+		csp_conn_stats(conn, stats);
+		cwnd_sum += stats->cwnd;
+	}
+
+	/* Wait for the last segments, including retransmissions */
+	while (server_received < i && bench_now() - start < 60)
+		usleep(1000);
+	*seconds = bench_now() - start;
+	*cwnd_mean = cwnd_sum / BENCH_PACKETS;
+	csp_conn_stats(conn, stats);
+	if (window != NULL) {
+		window[0] = conn->rdp.window_size;
+		window[1] = conn->rx_queue_length;
+	}
+	csp_close(conn);
+
+	return server_received == BENCH_PACKETS ? 0 : 1;
+
+}
+
+/**
+ * Bulk transfers at increasing packet loss. Loss halves the congestion
+ * window, so the mean window shrinks and throughput falls, while all
+ * packets still arrive.
+ */
+static int bench_loss(void) {
+
+	const int losses[] = {0, 1, 2, 5, 10};
+	csp_conn_stats_t stats;
+	double seconds, cwnd_mean;
+	unsigned int l;
+	int failures = 0;
+
+	printf("RDP under loss, %d packets of %d bytes, %d ms one way delay\r\n",
+			BENCH_PACKETS, BENCH_LENGTH, BENCH_DELAY_MS);
+
+	for (l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+		link_loss = losses[l];
+		if (bench_transfer(&seconds, &stats, &cwnd_mean, NULL) != 0) {
+			printf("  %2d%% loss: transfer failed, %d packets received\r\n", losses[l], server_received);
+			failures++;
+			continue;
+		}
+		printf("  %2d%% loss: %5.0f packets/s, retransmits %3"PRIu32" timeout %3"PRIu32" fast, "
+				"cwnd mean %4.1f, ssthresh %2"PRIu32"\r\n",
+				losses[l], BENCH_PACKETS / seconds, stats.retransmits, stats.fast_retransmits,
+				cwnd_mean, stats.ssthresh);
+	}
+	link_loss = 0;
+
+	return failures;
+
+}
+
+/**
+ * Bulk transfers without loss for growing windows. At most one window is
+ * sent per round trip, so throughput rises with the window.
+ */
+static int bench_window(void) {
+
+	const unsigned int windows[] = {1, 2, 4, 8, 16, 32, BENCH_WINDOW_MAX};
+	csp_conn_stats_t stats;
+	double seconds, cwnd_mean;
+	unsigned int w, window[2];
+	int failures = 0;
+
+	printf("RDP window size, %d packets of %d bytes, %d ms one way delay\r\n",
+			BENCH_PACKETS, BENCH_LENGTH, BENCH_DELAY_MS);
+
+	for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+		csp_rdp_set_opt(windows[w], 10000, 1000, 1, 10, 4);
+		if (bench_transfer(&seconds, &stats, &cwnd_mean, window) != 0) {
+			printf("  window %2u: transfer failed, %d packets received\r\n", windows[w], server_received);
+			failures++;
+			continue;
+		}
+		printf("  window %2u: %5.0f packets/s, rx queues %3u, cwnd mean %4.1f, retransmits %"PRIu32"\r\n",
+				window[0], BENCH_PACKETS / seconds, window[1], cwnd_mean,
+				stats.retransmits + stats.fast_retransmits);
+	}
+	csp_rdp_set_opt(BENCH_WINDOW, 10000, 1000, 1, 10, 4);
+
+	return failures;
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int failures = 0;
+	pthread_t link, server;
+
+	/* Room for a full window of segments and their retransmit copies */
+	csp_buffer_init(4 * BENCH_WINDOW_MAX, 300);
+	csp_conn_set_max(BENCH_CONNS);
+	csp_init(MY_ADDRESS);
+	csp_rdp_set_max_window(BENCH_WINDOW_MAX);
+	csp_rdp_set_opt(BENCH_WINDOW, 10000, 1000, 1, 10, 4);
+	csp_route_set(MY_ADDRESS, &bench_link, CSP_NODE_MAC);
+	csp_route_start_task(0, 0);
+	pthread_create(&link, NULL, bench_link_task, NULL);
+	pthread_create(&server, NULL, bench_server_task, NULL);
+
+	failures += bench_lookup();
+	failures += bench_loss();
+	failures += bench_window();
+
+	return failures ? 1 : 0;
+
+}
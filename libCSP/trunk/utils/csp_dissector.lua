@@ -0,0 +1,231 @@
+--[[
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+]]
+
+--[[
+Wireshark dissector for CSP captures written by csp_capture_start().
+
+Install by copying to the Wireshark personal plugins directory, or run:
+  wireshark -X lua_script:csp_dissector.lua capture.pcapng
+
+Records use link type USER0 (147) and hold the 32 bit CSP identifier in
+network byte order followed by the packet data, including any trailers:
+  [data][RDP header 5][HMAC 4][CRC32 4][XTEA nonce 4]
+XTEA encrypts everything before the nonce, so encrypted packets are shown
+as opaque data.
+
+CAN frames carrying CFP fragments are decoded heuristically from SocketCAN
+captures. The CSP header is decoded from the first fragment of a packet.
+]]
+
+local csp = Proto("csp", "Cubesat Space Protocol")
+
+local prios = { [0] = "Critical", [1] = "High", [2] = "Norm", [3] = "Low" }
+
+local f = csp.fields
+f.id     = ProtoField.uint32("csp.id", "Identifier", base.HEX)
+f.pri    = ProtoField.uint32("csp.pri", "Priority", base.DEC, prios, 0xC0000000)
+f.src    = ProtoField.uint32("csp.src", "Source", base.DEC, nil, 0x3E000000)
+f.dst    = ProtoField.uint32("csp.dst", "Destination", base.DEC, nil, 0x01F00000)
+f.dport  = ProtoField.uint32("csp.dport", "Destination port", base.DEC, nil, 0x000FC000)
+f.sport  = ProtoField.uint32("csp.sport", "Source port", base.DEC, nil, 0x00003F00)
+f.flags  = ProtoField.uint32("csp.flags", "Flags", base.HEX, nil, 0x000000FF)
+f.fhmac  = ProtoField.bool("csp.flags.hmac", "HMAC", 32, nil, 0x00000008)
+f.fxtea  = ProtoField.bool("csp.flags.xtea", "XTEA", 32, nil, 0x00000004)
+f.frdp   = ProtoField.bool("csp.flags.rdp", "RDP", 32, nil, 0x00000002)
+f.fcrc   = ProtoField.bool("csp.flags.crc32", "CRC32", 32, nil, 0x00000001)
+f.data   = ProtoField.bytes("csp.data", "Data")
+f.hmac   = ProtoField.bytes("csp.hmac", "HMAC")
+f.crc    = ProtoField.uint32("csp.crc32", "CRC32", base.HEX)
+f.nonce  = ProtoField.uint32("csp.xtea.nonce", "XTEA nonce", base.HEX)
+f.crypt  = ProtoField.bytes("csp.xtea.data", "Encrypted data")
+
+f.rdp        = ProtoField.uint8("csp.rdp.flags", "RDP flags", base.HEX)
+f.rdp_syn    = ProtoField.bool("csp.rdp.syn", "SYN", 8, nil, 0x08)
+f.rdp_ack    = ProtoField.bool("csp.rdp.ack", "ACK", 8, nil, 0x04)
+f.rdp_eak    = ProtoField.bool("csp.rdp.eak", "EACK", 8, nil, 0x02)
+f.rdp_rst    = ProtoField.bool("csp.rdp.rst", "RST", 8, nil, 0x01)
+f.rdp_seq    = ProtoField.uint16("csp.rdp.seq", "Sequence number")
+f.rdp_acknr  = ProtoField.uint16("csp.rdp.ack_nr", "Acknowledgement number")
+f.rdp_eacknr = ProtoField.uint16("csp.rdp.eack_nr", "EACK sequence number")
+f.rdp_opt    = ProtoField.uint32("csp.rdp.option", "Option")
+
+f.cfp_src    = ProtoField.uint32("csp.cfp.src", "CFP source", base.DEC, nil, 0x1F000000)
+f.cfp_dst    = ProtoField.uint32("csp.cfp.dst", "CFP destination", base.DEC, nil, 0x00F80000)
+f.cfp_type   = ProtoField.uint32("csp.cfp.type", "CFP type", base.DEC, { [0] = "Begin", [1] = "More" }, 0x00040000)
+f.cfp_remain = ProtoField.uint32("csp.cfp.remain", "CFP remaining frames", base.DEC, nil, 0x0003FC00)
+f.cfp_id     = ProtoField.uint32("csp.cfp.id", "CFP identifier", base.DEC, nil, 0x000003FF)
+f.cfp_length = ProtoField.uint16("csp.cfp.length", "CSP length")
+
+csp.prefs.crc_le = Pref.bool("CRC32 little endian", true,
+	"CRC32 trailer is appended in host byte order of the sender")
+
+local syn_options = { "Window size", "Connection timeout", "Packet timeout",
+	"Delayed ACKs", "ACK timeout", "ACK delay count" }
+
+local function dissect_rdp(buf, tree, data_len, pinfo)
+
+	local hdr = buf(data_len, 5)
+	local flags = hdr(0, 1):uint()
+	local t = tree:add(f.rdp, hdr(0, 1))
+	t:add(f.rdp_syn, hdr(0, 1))
+	t:add(f.rdp_ack, hdr(0, 1))
+	t:add(f.rdp_eak, hdr(0, 1))
+	t:add(f.rdp_rst, hdr(0, 1))
+	tree:add(f.rdp_seq, hdr(1, 2))
+	tree:add(f.rdp_acknr, hdr(3, 2))
+
+	local names = {}
+	if bit.band(flags, 0x08) ~= 0 then names[#names + 1] = "SYN" end
+	if bit.band(flags, 0x04) ~= 0 then names[#names + 1] = "ACK" end
+	if bit.band(flags, 0x02) ~= 0 then names[#names + 1] = "EACK" end
+	if bit.band(flags, 0x01) ~= 0 then names[#names + 1] = "RST" end
+	pinfo.cols.info:append(string.format(" RDP [%s] seq=%u ack=%u",
+		table.concat(names, ","), hdr(1, 2):uint(), hdr(3, 2):uint()))
+
+	if bit.band(flags, 0x08) ~= 0 then
+		for i = 0, math.min(data_len / 4, #syn_options) - 1 do
+			tree:add(f.rdp_opt, buf(i * 4, 4)):set_text(
+				string.format("%s: %u", syn_options[i + 1], buf(i * 4, 4):uint()))
+		end
+		return true
+	elseif bit.band(flags, 0x02) ~= 0 then
+		for i = 0, data_len / 2 - 1 do
+			tree:add(f.rdp_eacknr, buf(i * 2, 2))
+		end
+		return true
+	end
+
+	return false
+
+end
+
+local function dissect_csp(buf, pinfo, tree)
+
+	pinfo.cols.protocol = "CSP"
+
+	local id = buf(0, 4):uint()
+	local flags = bit.band(id, 0xFF)
+	local t = tree:add(csp, buf(), "Cubesat Space Protocol")
+	local h = t:add(f.id, buf(0, 4))
+	h:add(f.pri, buf(0, 4))
+	h:add(f.src, buf(0, 4))
+	h:add(f.dst, buf(0, 4))
+	h:add(f.dport, buf(0, 4))
+	h:add(f.sport, buf(0, 4))
+	local fl = h:add(f.flags, buf(0, 4))
+	fl:add(f.fhmac, buf(0, 4))
+	fl:add(f.fxtea, buf(0, 4))
+	fl:add(f.frdp, buf(0, 4))
+	fl:add(f.fcrc, buf(0, 4))
+
+	pinfo.cols.src = tostring(bit.rshift(bit.band(id, 0x3E000000), 25))
+	pinfo.cols.dst = tostring(bit.rshift(bit.band(id, 0x01F00000), 20))
+	pinfo.cols.info = string.format("%u:%u -> %u:%u",
+		bit.rshift(bit.band(id, 0x3E000000), 25), bit.rshift(bit.band(id, 0x00003F00), 8),
+		bit.rshift(bit.band(id, 0x01F00000), 20), bit.rshift(bit.band(id, 0x000FC000), 14))
+
+	if buf:len() <= 4 then return end
+	local payload = buf(4):tvb()
+	local len = payload:len()
+
+	if bit.band(flags, 0x04) ~= 0 then
+		if len < 4 then return end
+		t:add(f.crypt, payload(0, len - 4))
+		t:add(f.nonce, payload(len - 4, 4))
+		pinfo.cols.info:append(" [encrypted]")
+		return
+	end
+
+	if bit.band(flags, 0x01) ~= 0 and len >= 4 then
+		len = len - 4
+		if csp.prefs.crc_le then
+			t:add_le(f.crc, payload(len, 4))
+		else
+			t:add(f.crc, payload(len, 4))
+		end
+	end
+
+	if bit.band(flags, 0x08) ~= 0 and len >= 4 then
+		len = len - 4
+		t:add(f.hmac, payload(len, 4))
+	end
+
+	if bit.band(flags, 0x02) ~= 0 and len >= 5 then
+		len = len - 5
+		if dissect_rdp(payload, t, len, pinfo) then return end
+	end
+
+	if len > 0 then
+		t:add(f.data, payload(0, len))
+	end
+
+	pinfo.cols.info:append(string.format(" len=%u", len))
+
+end
+
+function csp.dissector(buf, pinfo, tree)
+	if buf:len() < 4 then return 0 end
+	dissect_csp(buf, pinfo, tree)
+	return buf:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, csp)
+
+-- CFP fragments over SocketCAN
+local can_id_field = Field.new("can.id")
+local can_ext_field = Field.new("can.flags.xtd")
+
+local function cfp_heuristic(buf, pinfo, tree)
+
+	local ext = can_ext_field()
+	if ext == nil or not ext() then return false end
+	local can_id = can_id_field()
+	if can_id == nil then return false end
+	local id = can_id()
+
+	pinfo.cols.protocol = "CFP"
+	local t = tree:add(csp, buf(), "CSP Fragmentation Protocol")
+	local idr = ByteArray.new(string.format("%08x", id)):tvb("CAN identifier")
+	t:add(f.cfp_src, idr(0, 4))
+	t:add(f.cfp_dst, idr(0, 4))
+	t:add(f.cfp_type, idr(0, 4))
+	t:add(f.cfp_remain, idr(0, 4))
+	t:add(f.cfp_id, idr(0, 4))
+
+	local cfp_type = bit.band(bit.rshift(id, 18), 1)
+	local remain = bit.band(bit.rshift(id, 10), 0xFF)
+	local ident = bit.band(id, 0x3FF)
+
+	if cfp_type == 0 and buf:len() >= 6 then
+		t:add(f.cfp_length, buf(4, 2))
+		dissect_csp(buf(0, 4):tvb(), pinfo, t)
+		pinfo.cols.info:append(string.format(" CFP %u begin, %u remaining, length %u",
+			ident, remain, buf(4, 2):uint()))
+		if buf:len() > 6 then t:add(f.data, buf(6)) end
+	else
+		pinfo.cols.info = string.format("CFP %u more, %u remaining", ident, remain)
+		t:add(f.data, buf())
+	end
+
+	return true
+
+end
+
+csp:register_heuristic("can", cfp_heuristic)
@@ -0,0 +1,171 @@
+/*
+Cubesat Space Protocol - A small network-layer protocol designed for Cubesats
+Copyright (C) 2011 GomSpace ApS (http://www.gomspace.com)
+Copyright (C) 2011 AAUSAT3 Project (http://aausat3.space.aau.dk)
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Close multiplexed connections with requests still pending.
+ * The server answers requests after a random delay, and the requests time
+ * out at about the time the connection is closed, so replies, timeouts and
+ * csp_mux_close race. Every request must complete exactly once, and no
+ * callback may run after csp_mux_close has returned. Build with
+ * -fsanitize=address to also catch use of the freed connection.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <csp/csp.h>
+#include <csp/csp_error.h>
+#include <csp/csp_mux.h>
+#include <csp/csp_interface.h>
+#include <csp/interfaces/csp_if_lo.h>
+
+#define MY_ADDRESS		1
+#define MY_PORT			10
+#define ROUNDS			200
+#define BUFFERS			100
+
+static volatile int completed[CSP_MUX_INFLIGHT];
+static volatile int closed;
+static int failures;
+
+static void * serve_task(void * arg) {
+
+	csp_conn_t * conn = arg;
+	csp_packet_t * packet;
+	uint16_t id;
+
+	while ((packet = csp_read(conn, 1000)) != NULL) {
+		usleep(rand() % 20000);
+		if (csp_mux_get_id(packet, &id) != CSP_ERR_NONE || !csp_mux_reply(conn, packet, id, 0))
+			csp_buffer_free(packet);
+	}
+	csp_close(conn);
+
+	return NULL;
+
+}
+
+static void * server_task(void * arg) {
+
+	csp_socket_t * sock = csp_socket(CSP_SO_NONE);
+	csp_bind(sock, MY_PORT);
+	csp_listen(sock, 10);
+
+	/* One task per connection, so a slow connection does not hold up accept */
+	while (1) {
+		csp_conn_t * conn = csp_accept(sock, CSP_MAX_DELAY);
+		pthread_t task;
+		if (conn != NULL && pthread_create(&task, NULL, serve_task, conn) == 0)
+			pthread_detach(task);
+	}
+
+	return NULL;
+
+}
+
+static void request_done(int status, csp_packet_t * reply, void * arg) {
+
+	intptr_t index = (intptr_t) arg;
+
+	/* Keep the callback busy, so close has to wait for it */
+	usleep(1000);
+
+	if (closed) {
+		printf("Callback of request %d after close\r\n", (int) index);
+		failures++;
+	}
+	if (status != CSP_ERR_NONE && reply != NULL) {
+		printf("Reply with status %d\r\n", status);
+		failures++;
+	}
+
+	__sync_fetch_and_add(&completed[index], 1);
+
+	if (reply != NULL)
+		csp_buffer_free(reply);
+
+}
+
+int main(int argc, char * argv[]) {
+
+	int round, i, sent;
+	pthread_t server;
+
+	/* Closed connections linger for the connection timeout, keep it short */
+	csp_buffer_init(BUFFERS, 300);
+	csp_conn_set_max(128);
+	csp_init(MY_ADDRESS);
+	csp_rdp_set_opt(4, 1000, 200, 1, 50, 2);
+	csp_route_set(MY_ADDRESS, &csp_if_lo, CSP_NODE_MAC);
+	csp_route_start_task(0, 0);
+	csp_callback_start_tasks(0, 0);
+	pthread_create(&server, NULL, server_task, NULL);
+
+	for (round = 0; round < ROUNDS; round++) {
+
+		csp_mux_t * mux = csp_mux_open(CSP_PRIO_NORM, MY_ADDRESS, MY_PORT, 1000, CSP_O_RDP);
+		if (mux == NULL) {
+			printf("Failed to open connection in round %d\r\n", round);
+			return 1;
+		}
+
+		closed = 0;
+		for (i = 0, sent = 0; i < CSP_MUX_INFLIGHT; i++) {
+			completed[i] = 0;
+			csp_packet_t * packet = csp_buffer_get(10);
+			if (packet == NULL)
+				break;
+			packet->length = 1;
+			packet->data[0] = i;
+			if (csp_mux_request(mux, packet, 5 + rand() % 20, request_done, (void *) (intptr_t) i) == NULL) {
+				csp_buffer_free(packet);
+				break;
+			}
+			sent++;
+		}
+
+		usleep(rand() % 20000);
+		csp_mux_close(mux);
+		closed = 1;
+
+		for (i = 0; i < sent; i++) {
+			if (completed[i] != 1) {
+				printf("Request %d of round %d completed %d times\r\n", i, round, completed[i]);
+				failures++;
+			}
+		}
+	}
+
+	/* Let the server see the last close, then all buffers must be back */
+	sleep(2);
+	if (csp_buffer_remaining() != BUFFERS) {
+		printf("Buffers leaked\r\n");
+		failures++;
+	}
+
+	printf("%d rounds of %d requests, %d failures, %d buffers free\r\n",
+			ROUNDS, CSP_MUX_INFLIGHT, failures, csp_buffer_remaining());
+
+	return failures ? 1 : 0;
+
+}